@@ -0,0 +1,94 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "fib_handcomp.h"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Worker arenas.  Two application threads each run fib in a loop of cilkified
+ * regions at the same time, one in an arena of -a workers and the other in an
+ * arena of -b workers, and check every result and the worker count seen in
+ * each arena.  With -c and -d, the arenas run on the given CPU lists, such as
+ * "0-3" and "4-7".
+ */
+
+struct arena_job {
+    __cilkrts_arena *arena;
+    unsigned nworkers;
+    int n, rounds, expected;
+    int failed;
+};
+
+static void run_fib(void *arg) {
+    struct arena_job *job = arg;
+    for (int i = 0; i < job->rounds; ++i) {
+        int res = fib(job->n);
+        unsigned nworkers = __cilkrts_get_nworkers();
+        if (res != job->expected || nworkers != job->nworkers) {
+            fprintf(stderr, "FAILED: fib(%d) = %d on %u workers, expected "
+                            "%d on %u workers\n",
+                    job->n, res, nworkers, job->expected, job->nworkers);
+            job->failed = 1;
+        }
+    }
+}
+
+static void *run_in_arena(void *arg) {
+    struct arena_job *job = arg;
+    __cilkrts_arena_run(job->arena, run_fib, job);
+    return NULL;
+}
+
+const char *specifiers[] = {"-n", "-r", "-a", "-b", "-c", "-d", 0};
+int opt_types[] = {INTARG, INTARG, INTARG, INTARG, STRINGARG, STRINGARG, 0};
+
+int main(int argc, char *argv[]) {
+    int n = 30, rounds = 10, a = 2, b = 4;
+    char cpus_a[256] = "", cpus_b[256] = "";
+
+    get_options(argc, argv, specifiers, opt_types, &n, &rounds, &a, &b,
+                cpus_a, cpus_b);
+    if (n < 0 || rounds < 1 || a < 1 || b < 1) {
+        fprintf(stderr, "Usage: arenas [-n <fib arg>] [-r <regions>] "
+                        "[-a <workers>] [-b <workers>] [-c <cpus>] "
+                        "[-d <cpus>]\n");
+        exit(1);
+    }
+
+    struct arena_job jobs[2] = {
+        {NULL, a, n, rounds, fib_serial(n), 0},
+        {NULL, b, n, rounds, fib_serial(n), 0},
+    };
+    const char *cpus[2] = {cpus_a[0] ? cpus_a : NULL,
+                           cpus_b[0] ? cpus_b : NULL};
+    for (int i = 0; i < 2; ++i) {
+        jobs[i].arena = __cilkrts_arena_create(jobs[i].nworkers, cpus[i]);
+        if (!jobs[i].arena) {
+            fprintf(stderr, "__cilkrts_arena_create(%u, %s) failed\n",
+                    jobs[i].nworkers, cpus[i] ? cpus[i] : "NULL");
+            exit(1);
+        }
+    }
+
+    pthread_t threads[2];
+    clockmark_t begin = ktiming_getmark();
+    for (int i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, run_in_arena, &jobs[i]);
+    for (int i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+    clockmark_t end = ktiming_getmark();
+
+    printf("arenas of %d and %d workers x %d regions of fib(%d): %.3f s\n", a,
+           b, rounds, n, ktiming_diff_sec(&begin, &end));
+
+    for (int i = 0; i < 2; ++i)
+        __cilkrts_arena_destroy(jobs[i].arena);
+
+    return jobs[0].failed | jobs[1].failed;
+}
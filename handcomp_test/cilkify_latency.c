@@ -0,0 +1,118 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Cilkify latency benchmark.  Runs many short cilkified regions, sleeping
+ * between them so that the workers go back to waiting for the next region.
+ * Each region spawns one task that waits for its continuation to be stolen,
+ * and the benchmark reports the time from entering the region to that first
+ * steal.
+ *
+void region(void) {
+    cilk_spawn wait_for_steal();
+    stolen_at = now();
+    cilk_sync;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static _Atomic clockmark_t stolen_at;
+static long timeout_us = 10000;
+
+static void __attribute__((noinline)) wait_for_steal(void) {
+    clockmark_t begin = ktiming_getmark();
+    while (!atomic_load_explicit(&stolen_at, memory_order_acquire) &&
+           ktiming_getmark() - begin < (clockmark_t)timeout_us * 1000)
+        ;
+}
+
+static void __attribute__((noinline))
+region_spawn_helper(__cilkrts_stack_frame *parent);
+
+static void region(void) {
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    /* cilk_spawn wait_for_steal() */
+    if (!__cilk_prepare_spawn(&sf)) {
+        region_spawn_helper(&sf);
+    }
+    // The continuation runs before the spawned task finishes only if it was
+    // stolen.
+    if (!atomic_load_explicit(&stolen_at, memory_order_relaxed))
+        atomic_store_explicit(&stolen_at, ktiming_getmark(),
+                              memory_order_release);
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+region_spawn_helper(__cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    wait_for_steal();
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+const char *specifiers[] = {"-r", "-g", "-w", 0};
+int opt_types[] = {LONGARG, LONGARG, LONGARG, 0};
+
+int main(int argc, char *argv[]) {
+    long rounds = 1000, gap_us = 1000;
+
+    get_options(argc, argv, specifiers, opt_types, &rounds, &gap_us,
+                &timeout_us);
+    if (rounds <= 0 || gap_us < 0 || timeout_us <= 0) {
+        fprintf(stderr, "Usage: cilkify_latency [-r <regions>] "
+                        "[-g <usec between regions>] [-w <steal timeout usec>]\n");
+        exit(1);
+    }
+
+    uint64_t *latency = malloc(rounds * sizeof(uint64_t));
+    long steals = 0;
+    for (long i = 0; i < rounds; i++) {
+        if (gap_us)
+            usleep(gap_us);
+        atomic_store(&stolen_at, 0);
+        clockmark_t begin = ktiming_getmark();
+        region();
+        clockmark_t end = atomic_load(&stolen_at);
+        // The continuation records its own time when no steal happens before
+        // the task times out; only count real steals.
+        if (ktiming_diff_nsec(&begin, &end) < (uint64_t)timeout_us * 1000)
+            latency[steals++] = ktiming_diff_nsec(&begin, &end);
+    }
+
+    printf("regions: %ld, stolen: %ld\n", rounds, steals);
+    if (steals > 0) {
+        qsort(latency, steals, sizeof(uint64_t), cmp_u64);
+        printf("cilkify-to-first-steal usec: p50 %.1f, p90 %.1f, p99 %.1f, "
+               "max %.1f\n",
+               latency[steals / 2] / 1000.0, latency[steals * 9 / 10] / 1000.0,
+               latency[steals * 99 / 100] / 1000.0,
+               latency[steals - 1] / 1000.0);
+    }
+    free(latency);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Cilkify round-trip benchmark.  Runs many tiny cilkified regions, with a
+ * fixed gap between them, as a service handling frequent small requests
+ * would, and reports the time from entering each region to returning from
+ * it.  The gap is busy-waited, so that the calling thread stays on its CPU.
+ *
+void region(void) {
+    cilk_spawn noop();
+    noop();
+    cilk_sync;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static void __attribute__((noinline)) noop(void) { dummy(NULL); }
+
+static void __attribute__((noinline))
+region_spawn_helper(__cilkrts_stack_frame *parent);
+
+static void region(void) {
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    /* cilk_spawn noop() */
+    if (!__cilk_prepare_spawn(&sf)) {
+        region_spawn_helper(&sf);
+    }
+    noop();
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+region_spawn_helper(__cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    noop();
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+const char *specifiers[] = {"-r", "-g", 0};
+int opt_types[] = {LONGARG, LONGARG, 0};
+
+int main(int argc, char *argv[]) {
+    long rounds = 100000, gap_us = 20;
+
+    get_options(argc, argv, specifiers, opt_types, &rounds, &gap_us);
+    if (rounds <= 0 || gap_us < 0) {
+        fprintf(stderr, "Usage: cilkify_roundtrip [-r <regions>] "
+                        "[-g <usec between regions>]\n");
+        exit(1);
+    }
+
+    // Start the workers outside of the measurement.
+    region();
+
+    uint64_t *latency = malloc(rounds * sizeof(uint64_t));
+    clockmark_t first = ktiming_getmark();
+    for (long i = 0; i < rounds; i++) {
+        clockmark_t begin = ktiming_getmark();
+        while (ktiming_getmark() - begin < (clockmark_t)gap_us * 1000)
+            ;
+        begin = ktiming_getmark();
+        region();
+        clockmark_t end = ktiming_getmark();
+        latency[i] = ktiming_diff_nsec(&begin, &end);
+    }
+    clockmark_t last = ktiming_getmark();
+
+    qsort(latency, rounds, sizeof(uint64_t), cmp_u64);
+    printf("regions: %ld, gap %ld usec, %.0f regions/s\n", rounds, gap_us,
+           rounds / ktiming_diff_sec(&first, &last));
+    printf("cilkify round trip usec: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           latency[rounds / 2] / 1000.0, latency[rounds * 9 / 10] / 1000.0,
+           latency[rounds * 99 / 100] / 1000.0, latency[rounds - 1] / 1000.0);
+    free(latency);
+
+    return 0;
+}
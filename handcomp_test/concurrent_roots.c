@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "fib_handcomp.h"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Concurrent cilkified regions.  Several application threads each run fib in
+ * a loop of cilkified regions at the same time, sharing the worker pool, and
+ * check every result.  With -s, the threads instead take turns behind a
+ * mutex, as applications had to before regions could run concurrently.
+ */
+
+static int n = 30, rounds = 10, expected;
+static int serialize = 0;
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *run_regions(void *arg) {
+    long failed = 0;
+    for (int i = 0; i < rounds; ++i) {
+        if (serialize)
+            pthread_mutex_lock(&serial_lock);
+        int res = fib(n);
+        if (serialize)
+            pthread_mutex_unlock(&serial_lock);
+        if (res != expected) {
+            fprintf(stderr, "FAILED: thread %ld got fib(%d) = %d\n",
+                    (long)arg, n, res);
+            failed = 1;
+        }
+    }
+    return (void *)failed;
+}
+
+const char *specifiers[] = {"-n", "-t", "-r", "-s", 0};
+int opt_types[] = {INTARG, INTARG, INTARG, BOOLARG, 0};
+
+int main(int argc, char *argv[]) {
+    int nthreads = 4;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &nthreads, &rounds,
+                &serialize);
+    if (n < 0 || nthreads < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: concurrent_roots [-n <fib arg>] [-t <threads>] "
+                        "[-r <regions per thread>] [-s]\n");
+        exit(1);
+    }
+    expected = fib_serial(n);
+
+    // Run one region on the main thread first, so that it starts the workers.
+    if (fib(n) != expected) {
+        fprintf(stderr, "FAILED: main thread got a wrong fib(%d)\n", n);
+        exit(1);
+    }
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    clockmark_t begin = ktiming_getmark();
+    for (long t = 0; t < nthreads; ++t)
+        pthread_create(&threads[t], NULL, run_regions, (void *)t);
+    int failed = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        void *res;
+        pthread_join(threads[t], &res);
+        failed |= res != NULL;
+    }
+    clockmark_t end = ktiming_getmark();
+    free(threads);
+
+    printf("%d threads x %d regions of fib(%d)%s: %.3f s\n", nthreads, rounds,
+           n, serialize ? ", serialized" : "", ktiming_diff_sec(&begin, &end));
+
+    return failed;
+}
@@ -0,0 +1,64 @@
+#ifndef _FIB_HANDCOMP_H_
+#define _FIB_HANDCOMP_H_
+
+/*
+ * Hand-compiled fib, shared by the tests that run fib in cilkified regions.
+ * Include it after ../runtime/cilk2c_inlined.c.
+ *
+int fib(int n) {
+    if (n < 2)
+        return n;
+    int x = cilk_spawn fib(n - 1);
+    int y = fib(n - 2);
+    cilk_sync;
+    return x + y;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static void __attribute__((noinline))
+fib_spawn_helper(int *x, int n, __cilkrts_stack_frame *parent);
+
+static int fib(int n) {
+    int x = 0, y, _tmp;
+
+    if (n < 2)
+        return n;
+
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    /* x = spawn fib(n-1) */
+    if (!__cilk_prepare_spawn(&sf)) {
+        fib_spawn_helper(&x, n - 1, &sf);
+    }
+
+    y = fib(n - 2);
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+    _tmp = x + y;
+
+    __cilk_parent_epilogue(&sf);
+
+    return _tmp;
+}
+
+static void __attribute__((noinline))
+fib_spawn_helper(int *x, int n, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    *x = fib(n);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static int fib_serial(int n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+#endif
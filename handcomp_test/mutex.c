@@ -0,0 +1,281 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+#ifndef TIMING_COUNT
+#define TIMING_COUNT 1
+#endif
+
+/*
+ * Cilk-aware mutex test.  A parallel loop of n iterations, split by divide
+ * and conquer, does some work in each iteration and then updates shared
+ * counters in a critical section guarded by a __cilkrts_mutex.  Checks the
+ * counters and reports the time.  With -p, a pthread mutex guards the
+ * critical section instead, for comparison.  With -s, each critical section
+ * spawns half of its work, so that the mutex is held across a spawn and may
+ * be released by another worker.  With -b, each of n rounds instead has the
+ * holder of the mutex wait for the continuation of a spawn whose child blocks
+ * on the mutex, which needs at least 2 workers.  With 2 workers, the other
+ * worker is busy holding the mutex, so the round finishes only if the strand
+ * parks without hiding that continuation.
+ *
+void loop(long lo, long hi) {
+    if (hi - lo <= grain) {
+        for (long i = lo; i < hi; ++i) {
+            work(i);
+            __cilkrts_mutex_lock(&m);
+            critical(i);
+            __cilkrts_mutex_unlock(&m);
+        }
+        return;
+    }
+    long mid = lo + (hi - lo) / 2;
+    cilk_spawn loop(lo, mid);
+    loop(mid, hi);
+    cilk_sync;
+}
+
+void blocked_round(long i) {
+    held = go = 0;
+    cilk_spawn hold();
+    while (!held)
+        ;
+    cilk_spawn take(i);
+    go = 1;
+    cilk_sync;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static long grain = 64, work_iters = 2000, critical_iters = 200;
+static int use_pthread = 0, spawn_critical = 0, blocked_holder = 0;
+
+static __cilkrts_mutex cilk_lock = __CILKRTS_MUTEX_INIT;
+static pthread_mutex_t pthread_lock = PTHREAD_MUTEX_INITIALIZER;
+static long count, sum;
+static volatile int held, go;
+
+static void __attribute__((noinline)) spin(long iters) {
+    for (volatile long j = 0; j < iters; ++j)
+        ;
+}
+
+static void __attribute__((noinline))
+spin_spawn_helper(long iters, __cilkrts_stack_frame *parent);
+
+// Do iters of work in two halves, one of them spawned.
+static void spin_parallel(long iters) {
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    /* cilk_spawn spin(iters / 2) */
+    if (!__cilk_prepare_spawn(&sf)) {
+        spin_spawn_helper(iters / 2, &sf);
+    }
+
+    spin(iters - iters / 2);
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+spin_spawn_helper(long iters, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    spin(iters);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static void run_leaf(long lo, long hi) {
+    for (long i = lo; i < hi; ++i) {
+        spin(work_iters);
+        if (use_pthread)
+            pthread_mutex_lock(&pthread_lock);
+        else
+            __cilkrts_mutex_lock(&cilk_lock);
+        ++count;
+        sum += i;
+        if (spawn_critical)
+            spin_parallel(critical_iters);
+        else
+            spin(critical_iters);
+        if (use_pthread)
+            pthread_mutex_unlock(&pthread_lock);
+        else
+            __cilkrts_mutex_unlock(&cilk_lock);
+    }
+}
+
+static void __attribute__((noinline))
+loop_spawn_helper(long lo, long hi, __cilkrts_stack_frame *parent);
+
+static void loop(long lo, long hi) {
+    if (hi - lo <= grain) {
+        run_leaf(lo, hi);
+        return;
+    }
+
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    long mid = lo + (hi - lo) / 2;
+
+    /* cilk_spawn loop(lo, mid) */
+    if (!__cilk_prepare_spawn(&sf)) {
+        loop_spawn_helper(lo, mid, &sf);
+    }
+
+    loop(mid, hi);
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+loop_spawn_helper(long lo, long hi, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    loop(lo, hi);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+// Hold the mutex until go is set.
+static void hold(void) {
+    __cilkrts_mutex_lock(&cilk_lock);
+    ++count;
+    held = 1;
+    while (!go)
+        spin(1);
+    __cilkrts_mutex_unlock(&cilk_lock);
+}
+
+static void take(long i) {
+    __cilkrts_mutex_lock(&cilk_lock);
+    ++count;
+    sum += i;
+    __cilkrts_mutex_unlock(&cilk_lock);
+}
+
+static void __attribute__((noinline))
+hold_spawn_helper(__cilkrts_stack_frame *parent);
+static void __attribute__((noinline))
+take_spawn_helper(long i, __cilkrts_stack_frame *parent);
+
+static void blocked_round(long i) {
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    held = 0;
+    go = 0;
+
+    /* cilk_spawn hold() */
+    if (!__cilk_prepare_spawn(&sf)) {
+        hold_spawn_helper(&sf);
+    }
+
+    while (!held)
+        spin(1);
+
+    /* cilk_spawn take(i) */
+    if (!__cilk_prepare_spawn(&sf)) {
+        take_spawn_helper(i, &sf);
+    }
+
+    go = 1;
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+hold_spawn_helper(__cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    hold();
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static void __attribute__((noinline))
+take_spawn_helper(long i, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    take(i);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+const char *specifiers[] = {"-n", "-g", "-w", "-c", "-p", "-s", "-b", 0};
+int opt_types[] = {LONGARG, LONGARG, LONGARG, LONGARG,
+                   BOOLARG, BOOLARG, BOOLARG, 0};
+
+int main(int argc, char *argv[]) {
+    long n = 100000;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &grain, &work_iters,
+                &critical_iters, &use_pthread, &spawn_critical,
+                &blocked_holder);
+    // A pthread mutex must be unlocked by the thread that locked it.
+    if (n < 0 || grain < 1 || work_iters < 0 || critical_iters < 0 ||
+        use_pthread + spawn_critical + blocked_holder > 1) {
+        fprintf(stderr, "Usage: mutex [-n <iterations>] [-g <grain>] "
+                        "[-w <work per iteration>] "
+                        "[-c <work in critical section>] [-p | -s | -b]\n");
+        exit(1);
+    }
+    if (blocked_holder && __cilkrts_get_nworkers() < 2) {
+        printf("blocked holder needs 2 workers, skipped\n");
+        return 0;
+    }
+
+    int failed = 0;
+    for (int r = 0; r < TIMING_COUNT; ++r) {
+        count = 0;
+        sum = 0;
+        clockmark_t begin = ktiming_getmark();
+        if (blocked_holder) {
+            for (long i = 0; i < n; ++i)
+                blocked_round(i);
+        } else {
+            loop(0, n);
+        }
+        clockmark_t end = ktiming_getmark();
+        printf("%s mutex%s%s, %ld iterations: %.3f s\n",
+               use_pthread ? "pthread" : "cilk",
+               spawn_critical ? " held across a spawn" : "",
+               blocked_holder ? " held by a blocked holder" : "", n,
+               ktiming_diff_sec(&begin, &end));
+        if (count != (blocked_holder ? 2 * n : n) ||
+            sum != n * (n - 1) / 2) {
+            fprintf(stderr, "FAILED: count %ld, sum %ld\n", count, sum);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
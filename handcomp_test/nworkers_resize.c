@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "fib_handcomp.h"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Worker-pool resize test.  Runs fib in successive cilkified regions,
+ * changing the number of workers with __cilkrts_set_nworkers before each
+ * region, and checks the result and the worker count of every region.
+ */
+
+const char *specifiers[] = {"-n", "-m", 0};
+int opt_types[] = {INTARG, INTARG, 0};
+
+int main(int argc, char *argv[]) {
+    int n = 30, max_workers = 16;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &max_workers);
+    if (n < 0 || max_workers < 1) {
+        fprintf(stderr,
+                "Usage: nworkers_resize [-n <fib arg>] [-m <max workers>]\n");
+        exit(1);
+    }
+
+    // Shrink and grow across the initial worker count, and beyond it.
+    int counts[] = {1, max_workers / 2, max_workers, 2, max_workers * 2, 1,
+                    max_workers};
+    // Switch the scheduling profile along with the worker count.  The new
+    // profile is published to workers that keep stealing, not applied with
+    // the workers stopped, so each round also checks fib under a tuning
+    // switched while the workers run.
+    const char *profiles[] = {"latency", "shared-host", "throughput"};
+    int expected = fib_serial(n);
+    int failed = 0;
+    for (size_t i = 0; i < sizeof counts / sizeof counts[0]; ++i) {
+        int p = counts[i] > 0 ? counts[i] : 1;
+        if (__cilkrts_set_nworkers(p) != 0) {
+            fprintf(stderr, "__cilkrts_set_nworkers(%d) failed\n", p);
+            exit(1);
+        }
+        const char *profile = profiles[i % 3];
+        if (__cilkrts_set_sched_profile(profile) != 0) {
+            fprintf(stderr, "__cilkrts_set_sched_profile(%s) failed\n",
+                    profile);
+            exit(1);
+        }
+        clockmark_t begin = ktiming_getmark();
+        int res = fib(n);
+        clockmark_t end = ktiming_getmark();
+        unsigned nworkers = __cilkrts_get_nworkers();
+        printf("workers %3u: fib(%d) = %d in %.3f s\n", nworkers, n, res,
+               ktiming_diff_sec(&begin, &end));
+        if (res != expected || nworkers != (unsigned)p) {
+            fprintf(stderr, "FAILED: expected fib(%d) = %d on %d workers\n",
+                    n, expected, p);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+#ifndef TIMING_COUNT
+#define TIMING_COUNT 1
+#endif
+
+/*
+ * Deque contention microbenchmark.  A single loop spawns many tiny tasks, so
+ * nearly every continuation is stolen and the runtime's ready-deque operations
+ * dominate the running time.
+ *
+void storm(long n, long grain, long *out) {
+    for (long i = 0; i < n; i++)
+        cilk_spawn tiny(i, grain, out);
+    cilk_sync;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static void __attribute__((noinline)) tiny(long i, long grain, long *out) {
+    long x = i;
+    for (long k = 0; k < grain; k++)
+        x = x * 1103515245 + 12345;
+    out[i] = x;
+}
+
+static void __attribute__((noinline))
+storm_spawn_helper(long i, long grain, long *out,
+                   __cilkrts_stack_frame *parent);
+
+static void storm(long n, long grain, long *out) {
+    long i;
+
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    for (i = 0; i < n; i++) {
+        /* cilk_spawn tiny(i, grain, out) */
+        if (!__cilk_prepare_spawn(&sf)) {
+            storm_spawn_helper(i, grain, out, &sf);
+        }
+    }
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+storm_spawn_helper(long i, long grain, long *out,
+                   __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    tiny(i, grain, out);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+const char *specifiers[] = {"-n", "-g", 0};
+int opt_types[] = {LONGARG, LONGARG, 0};
+
+int main(int argc, char *argv[]) {
+    long n = 1000000, grain = 16;
+    clockmark_t begin, end;
+    uint64_t running_time[TIMING_COUNT];
+
+    get_options(argc, argv, specifiers, opt_types, &n, &grain);
+    if (n <= 0 || grain < 0) {
+        fprintf(stderr, "Usage: spawn_storm [-n <tasks>] [-g <grain>]\n");
+        exit(1);
+    }
+
+    long *out = malloc(n * sizeof(long));
+    for (int i = 0; i < TIMING_COUNT; i++) {
+        begin = ktiming_getmark();
+        storm(n, grain, out);
+        end = ktiming_getmark();
+        running_time[i] = ktiming_diff_nsec(&begin, &end);
+    }
+    printf("Tasks: %ld, grain: %ld, last: %ld\n", n, grain, out[n - 1]);
+    print_runtime(running_time, TIMING_COUNT);
+    free(out);
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+#ifndef TIMING_COUNT
+#define TIMING_COUNT 1
+#endif
+
+/*
+ * Fiber stack class test.  A parallel loop of n iterations, split by divide
+ * and conquer, recurses d KB deep in each iteration.  The region and the
+ * loop's frames ask for stack class c, so that every iteration runs on a
+ * stack of that class, and the rest of the program keeps the small stacks of
+ * class 0.  Run with CILK_STACK_CLASSES set, such as "64K,4M".  Checks the
+ * results and reports the time.
+ *
+void loop(long lo, long hi) {
+    __cilkrts_set_frame_stack_class(c);
+    if (hi - lo <= 1) {
+        sum += deep(d);
+        return;
+    }
+    long mid = lo + (hi - lo) / 2;
+    cilk_spawn loop(lo, mid);
+    loop(mid, hi);
+    cilk_sync;
+}
+ */
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+#define FRAME_BYTES 1024
+
+static long depth_kb = 1024, stack_class = 1;
+static long results[1 << 16];
+
+// Recurse about FRAME_BYTES per level, levels deep.
+static long __attribute__((noinline)) deep(long levels) {
+    volatile char buf[FRAME_BYTES];
+    buf[0] = (char)levels;
+    buf[FRAME_BYTES - 1] = 1;
+    if (levels <= 1)
+        return buf[0] + buf[FRAME_BYTES - 1];
+    return deep(levels - 1) + buf[FRAME_BYTES - 1];
+}
+
+static void __attribute__((noinline))
+loop_spawn_helper(long lo, long hi, __cilkrts_stack_frame *parent);
+
+static void loop(long lo, long hi) {
+    if (hi - lo <= 1) {
+        results[lo] = deep(depth_kb * 1024 / FRAME_BYTES);
+        return;
+    }
+
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+    __cilkrts_set_frame_stack_class(stack_class);
+
+    long mid = lo + (hi - lo) / 2;
+
+    /* cilk_spawn loop(lo, mid) */
+    if (!__cilk_prepare_spawn(&sf)) {
+        loop_spawn_helper(lo, mid, &sf);
+    }
+
+    loop(mid, hi);
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+loop_spawn_helper(long lo, long hi, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    loop(lo, hi);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+const char *specifiers[] = {"-n", "-d", "-c", 0};
+int opt_types[] = {LONGARG, LONGARG, LONGARG, 0};
+
+int main(int argc, char *argv[]) {
+    long n = 4096;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &depth_kb,
+                &stack_class);
+    if (n < 2 || n > (long)(sizeof results / sizeof results[0]) ||
+        depth_kb < 1 || stack_class < 0) {
+        fprintf(stderr, "Usage: stack_classes [-n <iterations>] "
+                        "[-d <KB of recursion>] [-c <stack class>]\n");
+        exit(1);
+    }
+    if (__cilkrts_set_region_stack_class(stack_class) != 0) {
+        fprintf(stderr, "stack class %ld is not configured; "
+                        "set CILK_STACK_CLASSES\n",
+                stack_class);
+        exit(1);
+    }
+
+    // deep(levels) returns levels + 1.
+    long expected = depth_kb * 1024 / FRAME_BYTES + 1;
+    int failed = 0;
+    for (int r = 0; r < TIMING_COUNT; ++r) {
+        clockmark_t begin = ktiming_getmark();
+        loop(0, n);
+        clockmark_t end = ktiming_getmark();
+        printf("stack class %ld, %ld iterations of %ld KB recursion: "
+               "%.3f s\n",
+               stack_class, n, depth_kb, ktiming_diff_sec(&begin, &end));
+        for (long i = 0; i < n; ++i) {
+            if (results[i] != expected) {
+                fprintf(stderr, "FAILED: result %ld is %ld, not %ld\n", i,
+                        results[i], expected);
+                failed = 1;
+                break;
+            }
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,98 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "fib_handcomp.h"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Task submission.  The main thread, which never enters a cilkified region
+ * itself, submits -t fib tasks with handles and -d detached tasks in each of
+ * -r bursts, polls the handles until the tasks are done, and checks every
+ * result.
+ */
+
+struct fib_job {
+    int n, result;
+};
+
+static _Atomic int detached_done;
+
+static void fib_task(void *arg) {
+    struct fib_job *job = arg;
+    job->result = fib(job->n);
+}
+
+static void detached_task(void *arg) {
+    struct fib_job *job = arg;
+    job->result = fib(job->n);
+    atomic_fetch_add_explicit(&detached_done, 1, memory_order_release);
+}
+
+const char *specifiers[] = {"-n", "-t", "-d", "-r", 0};
+int opt_types[] = {INTARG, INTARG, INTARG, INTARG, 0};
+
+int main(int argc, char *argv[]) {
+    int n = 25, ntasks = 16, ndetached = 16, rounds = 10;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &ntasks, &ndetached,
+                &rounds);
+    if (n < 0 || ntasks < 0 || ndetached < 0 || rounds < 1) {
+        fprintf(stderr, "Usage: submit [-n <fib arg>] [-t <tasks>] "
+                        "[-d <detached tasks>] [-r <bursts>]\n");
+        exit(1);
+    }
+    int expected = fib_serial(n);
+
+    struct fib_job *jobs = malloc((ntasks + ndetached) * sizeof(*jobs));
+    __cilkrts_task **tasks = malloc(ntasks * sizeof(*tasks));
+    int failed = 0;
+    long polls = 0;
+    clockmark_t begin = ktiming_getmark();
+    for (int r = 0; r < rounds; ++r) {
+        atomic_store(&detached_done, 0);
+        for (int i = 0; i < ntasks + ndetached; ++i) {
+            jobs[i].n = n;
+            jobs[i].result = -1;
+            int err = i < ntasks
+                          ? __cilkrts_submit(fib_task, &jobs[i], &tasks[i])
+                          : __cilkrts_submit(detached_task, &jobs[i], NULL);
+            if (err) {
+                fprintf(stderr, "__cilkrts_submit failed\n");
+                exit(1);
+            }
+        }
+
+        // The submitting thread stays free while the workers run the tasks.
+        for (int i = 0; i < ntasks; ++i) {
+            while (!__cilkrts_task_done(tasks[i]))
+                ++polls;
+            __cilkrts_task_wait(tasks[i]);
+        }
+        while (atomic_load_explicit(&detached_done, memory_order_acquire) <
+               ndetached)
+            ++polls;
+
+        for (int i = 0; i < ntasks + ndetached; ++i) {
+            if (jobs[i].result != expected) {
+                fprintf(stderr, "FAILED: task %d got fib(%d) = %d\n", i, n,
+                        jobs[i].result);
+                failed = 1;
+            }
+        }
+    }
+    clockmark_t end = ktiming_getmark();
+    free(tasks);
+    free(jobs);
+
+    printf("%d bursts of %d + %d detached fib(%d) tasks: %.3f s, %ld polls\n",
+           rounds, ntasks, ndetached, n, ktiming_diff_sec(&begin, &end),
+           polls);
+
+    return failed;
+}
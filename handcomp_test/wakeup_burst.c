@@ -0,0 +1,143 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "getoptions.h"
+#include "ktiming.h"
+
+#ifndef TIMING_COUNT
+#define TIMING_COUNT 1
+#endif
+
+/*
+ * Wakeup latency benchmark.  Each round runs a serial phase long enough for
+ * idle thieves to disengage, then spawns a burst of short tasks.  It reports
+ * how long after the burst starts the first N distinct workers begin running
+ * tasks.
+ *
+void burst(long ntasks, long serial_us, long task_us) {
+    spin(serial_us);
+    start = now();
+    for (long i = 0; i < ntasks; i++)
+        cilk_spawn task(task_us);
+    cilk_sync;
+}
+ */
+
+#define MAX_THREADS 1024
+
+extern size_t ZERO;
+void __attribute__((weak)) dummy(void *p) { return; }
+
+static clockmark_t burst_start;
+static _Atomic clockmark_t first_task[MAX_THREADS];
+static _Atomic int nthreads_seen;
+static _Thread_local int thread_slot = -1;
+static _Thread_local int thread_round = -1;
+static int round_no;
+
+static void spin_usec(long usec) {
+    clockmark_t begin = ktiming_getmark();
+    while (ktiming_getmark() - begin < (clockmark_t)usec * 1000)
+        ;
+}
+
+static void __attribute__((noinline)) task(long task_us) {
+    if (thread_slot < 0)
+        thread_slot = atomic_fetch_add(&nthreads_seen, 1);
+    if (thread_round != round_no && thread_slot < MAX_THREADS) {
+        thread_round = round_no;
+        first_task[thread_slot] = ktiming_getmark();
+    }
+    spin_usec(task_us);
+}
+
+static void __attribute__((noinline))
+burst_spawn_helper(long task_us, __cilkrts_stack_frame *parent);
+
+static void burst(long ntasks, long serial_us, long task_us) {
+    long i;
+
+    dummy(alloca(ZERO));
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame(&sf);
+
+    spin_usec(serial_us);
+    burst_start = ktiming_getmark();
+
+    for (i = 0; i < ntasks; i++) {
+        /* cilk_spawn task(task_us) */
+        if (!__cilk_prepare_spawn(&sf)) {
+            burst_spawn_helper(task_us, &sf);
+        }
+    }
+
+    /* cilk_sync */
+    __cilk_sync_nothrow(&sf);
+
+    __cilk_parent_epilogue(&sf);
+}
+
+static void __attribute__((noinline))
+burst_spawn_helper(long task_us, __cilkrts_stack_frame *parent) {
+
+    __cilkrts_stack_frame sf;
+    __cilkrts_enter_frame_helper(&sf, parent, false);
+    __cilkrts_detach(&sf, parent);
+    task(task_us);
+    __cilk_helper_epilogue(&sf, parent, false);
+}
+
+static int cmp_mark(const void *a, const void *b) {
+    clockmark_t x = *(const clockmark_t *)a, y = *(const clockmark_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+const char *specifiers[] = {"-n", "-s", "-t", 0};
+int opt_types[] = {LONGARG, LONGARG, LONGARG, 0};
+
+int main(int argc, char *argv[]) {
+    long ntasks = 10000, serial_us = 20000, task_us = 20;
+    clockmark_t started[MAX_THREADS];
+
+    get_options(argc, argv, specifiers, opt_types, &ntasks, &serial_us,
+                &task_us);
+    if (ntasks <= 0 || serial_us < 0 || task_us < 0) {
+        fprintf(stderr,
+                "Usage: wakeup_burst [-n <tasks>] [-s <serial usec>] "
+                "[-t <task usec>]\n");
+        exit(1);
+    }
+
+    int rounds = TIMING_COUNT > 0 ? TIMING_COUNT : 1;
+    for (round_no = 0; round_no < rounds; round_no++) {
+        for (int i = 0; i < MAX_THREADS; i++)
+            first_task[i] = 0;
+        burst(ntasks, serial_us, task_us);
+
+        int n = 0;
+        int seen = nthreads_seen < MAX_THREADS ? nthreads_seen : MAX_THREADS;
+        for (int i = 0; i < seen; i++) {
+            clockmark_t t = first_task[i];
+            if (t)
+                started[n++] = t < burst_start ? burst_start : t;
+        }
+        qsort(started, n, sizeof(clockmark_t), cmp_mark);
+
+        // Report the time to reach 1/4, 1/2, and all of the active workers.
+        printf("round %d: %d workers active;", round_no, n);
+        int marks[] = {(n + 3) / 4, (n + 1) / 2, n};
+        for (int k = 0; k < 3; k++) {
+            if (marks[k] == 0)
+                continue;
+            printf(" %d in %.1f us%s", marks[k],
+                   ktiming_diff_nsec(&burst_start, &started[marks[k] - 1]) /
+                       1000.0,
+                   k < 2 ? "," : "\n");
+        }
+    }
+
+    return 0;
+}
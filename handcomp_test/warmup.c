@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cilk/cilk_api.h>
+
+#include "../runtime/cilk2c.h"
+#include "../runtime/cilk2c_inlined.c"
+#include "fib_handcomp.h"
+#include "getoptions.h"
+#include "ktiming.h"
+
+/*
+ * Warm-up benchmark.  Optionally warms up the runtime with __cilkrts_warmup,
+ * then times the first cilkified region, which otherwise pays for creating
+ * the worker threads and faulting in fiber stacks, against a later region.
+ * Checks the result of each region.
+ */
+
+const char *specifiers[] = {"-n", "-w", 0};
+int opt_types[] = {INTARG, INTARG, 0};
+
+int main(int argc, char *argv[]) {
+    int n = 25, nfibers = -1;
+
+    get_options(argc, argv, specifiers, opt_types, &n, &nfibers);
+    if (n < 0 || nfibers < -1) {
+        fprintf(stderr, "Usage: warmup [-n <fib arg>] [-w <fibers per worker, "
+                        "-1 = no warm-up>]\n");
+        exit(1);
+    }
+    int expected = fib_serial(n);
+
+    if (nfibers >= 0) {
+        clockmark_t begin = ktiming_getmark();
+        if (__cilkrts_warmup(nfibers) != 0) {
+            fprintf(stderr, "__cilkrts_warmup(%d) failed\n", nfibers);
+            exit(1);
+        }
+        clockmark_t end = ktiming_getmark();
+        printf("warm-up with %d fibers per worker: %.3f ms\n", nfibers,
+               ktiming_diff_nsec(&begin, &end) / 1e6);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < 2; ++i) {
+        clockmark_t begin = ktiming_getmark();
+        int res = fib(n);
+        clockmark_t end = ktiming_getmark();
+        printf("%s region: fib(%d) = %d in %.3f ms\n", i ? "second" : "first",
+               n, res, ktiming_diff_nsec(&begin, &end) / 1e6);
+        if (res != expected) {
+            fprintf(stderr, "FAILED: expected fib(%d) = %d\n", n, expected);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
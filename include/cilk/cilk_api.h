@@ -16,6 +16,42 @@ int __cilkrts_atexit(void (*callback)(void));
 unsigned __cilkrts_get_nworkers(void);
 unsigned __cilkrts_get_worker_number(void) __attribute__((deprecated));
 int __cilkrts_running_on_workers(void);
+/* Select the "throughput", "latency", or "shared-host" scheduling profile. */
+int __cilkrts_set_sched_profile(const char *name);
+/* Set the number of workers from the next cilkified region on. */
+int __cilkrts_set_nworkers(unsigned nworkers);
+/* Start the workers and fault in nfibers fibers per worker ahead of use. */
+int __cilkrts_warmup(unsigned nfibers);
+/* Select the fiber stack class of new regions or of the current frame. */
+int __cilkrts_set_region_stack_class(unsigned cls);
+int __cilkrts_set_frame_stack_class(unsigned cls);
+
+/* Arenas: runtime instances with their own workers, pinned to a cpulist. */
+typedef struct __cilkrts_arena __cilkrts_arena;
+__cilkrts_arena *__cilkrts_arena_create(unsigned nworkers, const char *cpus);
+void __cilkrts_arena_run(__cilkrts_arena *arena, void (*fn)(void *),
+                         void *arg);
+void __cilkrts_arena_destroy(__cilkrts_arena *arena);
+
+/* Run fn(arg) on the workers without waiting; wait on *handle, if given. */
+typedef struct __cilkrts_task __cilkrts_task;
+int __cilkrts_submit(void (*fn)(void *), void *arg, __cilkrts_task **handle);
+int __cilkrts_task_done(__cilkrts_task *task);
+void __cilkrts_task_wait(__cilkrts_task *task);
+
+/* A mutex that parks a blocked strand and lets its worker steal instead. */
+struct __cilkrts_mutex_waiter;
+typedef struct __cilkrts_mutex {
+    unsigned int state;
+    unsigned int waiters_lock;
+    struct __cilkrts_mutex_waiter *waiters_head;
+    struct __cilkrts_mutex_waiter *waiters_tail;
+} __cilkrts_mutex;
+#define __CILKRTS_MUTEX_INIT {0, 0, 0, 0}
+void __cilkrts_mutex_init(__cilkrts_mutex *m);
+void __cilkrts_mutex_lock(__cilkrts_mutex *m);
+int __cilkrts_mutex_trylock(__cilkrts_mutex *m);
+void __cilkrts_mutex_unlock(__cilkrts_mutex *m);
 
 #include <inttypes.h>
 typedef struct __cilkrts_pedigree {
@@ -0,0 +1,30 @@
+#ifndef _CILK_MUTEX_H
+#define _CILK_MUTEX_H
+
+#ifdef __cplusplus
+
+#include <cilk/cilk_api.h>
+
+namespace cilk {
+
+// A mutex that parks a contending strand instead of blocking its worker.  It
+// meets the Lockable requirements, so std::lock_guard and std::unique_lock
+// work with it.  See __cilkrts_mutex in cilk/cilk_api.h.
+class mutex {
+    __cilkrts_mutex m = __CILKRTS_MUTEX_INIT;
+
+  public:
+    mutex() noexcept = default;
+    mutex(const mutex &) = delete;
+    mutex &operator=(const mutex &) = delete;
+
+    void lock() { __cilkrts_mutex_lock(&m); }
+    bool try_lock() { return __cilkrts_mutex_trylock(&m) != 0; }
+    void unlock() { __cilkrts_mutex_unlock(&m); }
+};
+
+} // namespace cilk
+
+#endif // __cplusplus
+
+#endif // _CILK_MUTEX_H
@@ -0,0 +1,69 @@
+#ifndef _CILK_SUBMIT_H
+#define _CILK_SUBMIT_H
+
+#ifdef __cplusplus
+
+#include <cilk/cilk_api.h>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace cilk {
+
+// Handle to a task started by cilk::submit.  done() polls the task, and
+// wait() blocks until it is done.  A handle that is destroyed or assigned to
+// waits for its task first.
+class task_handle {
+    __cilkrts_task *task;
+
+  public:
+    explicit task_handle(__cilkrts_task *task) : task(task) {}
+    task_handle(task_handle &&other) noexcept : task(other.task) {
+        other.task = nullptr;
+    }
+    task_handle &operator=(task_handle &&other) noexcept {
+        if (this != &other) {
+            wait();
+            task = other.task;
+            other.task = nullptr;
+        }
+        return *this;
+    }
+    task_handle(const task_handle &) = delete;
+    task_handle &operator=(const task_handle &) = delete;
+    ~task_handle() { wait(); }
+
+    bool done() const { return !task || __cilkrts_task_done(task); }
+    void wait() {
+        if (task) {
+            __cilkrts_task_wait(task);
+            task = nullptr;
+        }
+    }
+};
+
+template <typename F> static void submit_thunk(void *arg) {
+    std::unique_ptr<F> f(static_cast<F *>(arg));
+    (*f)();
+}
+
+// Run the callable f on the workers without waiting for it.  f may spawn, but
+// must not throw.
+template <typename F> task_handle submit(F &&f) {
+    using Fn = typename std::decay<F>::type;
+    __cilkrts_task *task;
+    __cilkrts_submit(submit_thunk<Fn>, new Fn(std::forward<F>(f)), &task);
+    return task_handle(task);
+}
+
+// Like submit, but with no handle to wait on.
+template <typename F> void submit_detached(F &&f) {
+    using Fn = typename std::decay<F>::type;
+    __cilkrts_submit(submit_thunk<Fn>, new Fn(std::forward<F>(f)), nullptr);
+}
+
+} // namespace cilk
+
+#endif // __cplusplus
+
+#endif // _CILK_SUBMIT_H
@@ -29,6 +29,31 @@ int __cilkrts_running_on_workers(void) {
     return !__cilkrts_need_to_cilkify;
 }
 
+// Select a scheduling profile.  Like a change to the number of workers, the
+// boss applies it when it starts the next cilkified region with no other
+// region active.
+int __cilkrts_set_sched_profile(const char *name) {
+    if (!default_cilkrts || !name)
+        return -1;
+    int i = find_sched_profile(name);
+    if (i < 0)
+        return -1;
+    atomic_store_explicit(&default_cilkrts->pending_profile, i + 1,
+                          memory_order_relaxed);
+    return 0;
+}
+
+// Request a new number of workers.  The boss applies the request when it
+// starts the next cilkified region with no other region active, so this may
+// be called from anywhere, including from inside a cilkified region.
+int __cilkrts_set_nworkers(unsigned nworkers) {
+    if (!default_cilkrts || nworkers == 0 || nworkers >= 10000)
+        return -1;
+    atomic_store_explicit(&default_cilkrts->pending_nworkers, nworkers,
+                          memory_order_relaxed);
+    return 0;
+}
+
 // These callback-registration methods can run before the runtime system has
 // started.
 //
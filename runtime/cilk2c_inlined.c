@@ -30,7 +30,12 @@ _Alignas(__cilkrts_stack_frame)
 size_t __cilkrts_stack_frame_align = __alignof__(__cilkrts_stack_frame);
 
 __attribute__((always_inline)) unsigned __cilkrts_get_nworkers(void) {
-    return __cilkrts_nproc;
+    // Count the workers of the runtime instance this thread runs in.  Without
+    // arenas, that is the default runtime, and the TLS lookup is not needed.
+    if (__builtin_expect(__cilkrts_narenas == 0, true))
+        return __cilkrts_nproc;
+    global_state *g = __cilkrts_get_tls_worker()->g;
+    return g ? g->nworkers : __cilkrts_nproc;
 }
 
 // Internal method to get the Cilk worker ID.  Intended for debugging purposes.
@@ -376,7 +381,8 @@ __cilk_helper_epilogue_exn(__cilkrts_stack_frame *sf,
 ///     grainsize = min(2048, ceil(n / (8 * nworkers)))
 #define __cilkrts_grainsize_fn_impl(NAME, INT_T)                               \
     __attribute__((always_inline)) INT_T NAME(INT_T n) {                       \
-        INT_T small_loop_grainsize = n / (8 * __cilkrts_nproc);                \
+        INT_T small_loop_grainsize =                                           \
+            n / (8 * __cilkrts_get_nworkers());                                \
         if (small_loop_grainsize <= 1)                                         \
             return 1;                                                          \
         INT_T large_loop_grainsize = 2048;                                     \
@@ -389,7 +395,7 @@ __cilk_helper_epilogue_exn(__cilkrts_stack_frame *sf,
 
 __attribute__((always_inline)) uint8_t
 __cilkrts_cilk_for_grainsize_8(uint8_t n) {
-    uint8_t small_loop_grainsize = n / (8 * __cilkrts_nproc);
+    uint8_t small_loop_grainsize = n / (8 * __cilkrts_get_nworkers());
     if (small_loop_grainsize <= 1)
         return 1;
     return small_loop_grainsize;
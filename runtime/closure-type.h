@@ -38,6 +38,8 @@ struct Closure {
     enum ClosureStatus status : 8; /* doubles as magic number */
     bool has_cilk_callee;
     bool exception_pending;
+    bool is_root; /* root closure of a cilkified region */
+    bool mutex_parked; /* suspended on a __cilkrts_mutex, not at a sync */
     unsigned int join_counter; /* number of outstanding spawned children */
     char *orig_rsp; /* the rsp one should use when sync successfully */
 
@@ -141,6 +141,8 @@ static inline void Closure_init(Closure *t, __cilkrts_stack_frame *frame) {
     t->status = CLOSURE_PRE_INVALID;
     t->has_cilk_callee = false;
     t->exception_pending = false;
+    t->is_root = false;
+    t->mutex_parked = false;
     t->join_counter = 0;
 
     t->frame = frame;
@@ -371,6 +373,31 @@ static inline void Closure_suspend(struct ReadyDeque *deques, worker_id self,
     USE_UNUSED(cl1);
 }
 
+/* Like Closure_suspend, for a closure whose running strand parks on a
+   __cilkrts_mutex.  The strand may be in a spawned child whose frame was
+   never promoted, and the closure keeps its fiber. */
+static inline void Closure_park(struct ReadyDeque *deques, worker_id self,
+                                Closure *cl) {
+
+    Closure *cl1;
+
+    cilkrts_alert(SCHED, "Closure_park %p", (void *)cl);
+
+    Closure_checkmagic(cl);
+    Closure_assert_ownership(self, cl);
+    deque_assert_ownership(deques, self, self);
+
+    CILK_ASSERT(cl->fiber != NULL);
+
+    Closure_change_status(cl, CLOSURE_RUNNING, CLOSURE_SUSPENDED);
+    cl->mutex_parked = true;
+
+    cl1 = deque_xtract_bottom(deques, self, self);
+
+    CILK_ASSERT_POINTER_EQUAL(cl, cl1);
+    USE_UNUSED(cl1);
+}
+
 static inline void Closure_make_ready(Closure *cl) { cl->status = CLOSURE_READY; }
 
 static inline void Closure_clean(Closure *t) {
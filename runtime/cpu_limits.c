@@ -0,0 +1,258 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu_limits.h"
+#include "debug.h"
+#include "global.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef __linux__
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+// Read the first line of the file at path into buf.  Returns false if the file
+// cannot be read.
+static bool read_line(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+static unsigned int quota_to_cpus(long long quota, long long period) {
+    if (quota <= 0 || period <= 0)
+        return 0;
+    long long cpus = (quota + period - 1) / period;
+    return cpus < UINT_MAX ? (unsigned int)cpus : UINT_MAX;
+}
+
+// Return the number of CPUs allowed by the quota of the cgroup v2 directory
+// dir, or 0 if it has none.  cpu.max holds "max <period>" or "<quota>
+// <period>".
+static unsigned int read_quota_v2(const char *dir) {
+    char path[PATH_MAX + 32], buf[64];
+    snprintf(path, sizeof path, "%s/cpu.max", dir);
+    if (!read_line(path, buf, sizeof buf) || strncmp(buf, "max", 3) == 0)
+        return 0;
+    char *end;
+    long long quota = strtoll(buf, &end, 10);
+    long long period = strtoll(end, NULL, 10);
+    return quota_to_cpus(quota, period);
+}
+
+// Return the number of CPUs allowed by the quota of the cgroup v1 directory
+// dir, or 0 if it has none.  A quota of -1 means unlimited.
+static unsigned int read_quota_v1(const char *dir) {
+    char path[PATH_MAX + 32], buf[64];
+    snprintf(path, sizeof path, "%s/cpu.cfs_quota_us", dir);
+    if (!read_line(path, buf, sizeof buf))
+        return 0;
+    long long quota = strtoll(buf, NULL, 10);
+    snprintf(path, sizeof path, "%s/cpu.cfs_period_us", dir);
+    if (!read_line(path, buf, sizeof buf))
+        return 0;
+    long long period = strtoll(buf, NULL, 10);
+    return quota_to_cpus(quota, period);
+}
+
+// Record the tightest quota on the cgroup at path, in the hierarchy mounted at
+// mount, and on its ancestors, since the quota of every ancestor applies.
+static void find_quota(struct cpu_limits *limits, const char *mount,
+                       const char *path, bool v2) {
+    char dir[PATH_MAX];
+    if (strcmp(path, "/") == 0)
+        path = "";
+    int n = snprintf(dir, sizeof dir, "%s%s", mount, path);
+    if (n < 0 || (size_t)n >= sizeof dir)
+        return;
+    size_t mount_len = strlen(mount);
+
+    while (true) {
+        unsigned int cpus = v2 ? read_quota_v2(dir) : read_quota_v1(dir);
+        if (cpus > 0 &&
+            (limits->quota_cpus == 0 || cpus < limits->quota_cpus)) {
+            limits->quota_cpus = cpus;
+            free(limits->stat_path);
+            size_t size = strlen(dir) + sizeof "/cpu.stat";
+            limits->stat_path = malloc(size);
+            snprintf(limits->stat_path, size, "%s/cpu.stat", dir);
+        }
+        char *slash = strrchr(dir + mount_len, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+}
+
+// Check if the comma-separated list of cgroup v1 controllers includes the cpu
+// controller.
+static bool has_cpu_controller(const char *controllers) {
+    const char *p = controllers;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        if (len == 3 && strncmp(p, "cpu", 3) == 0)
+            return true;
+        p += len;
+        if (*p == ',')
+            ++p;
+    }
+    return false;
+}
+
+static void read_cgroup_quota(struct cpu_limits *limits) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof line, f)) {
+        // Each line is "<hierarchy>:<controllers>:<path>".  The controllers
+        // are empty for the unified (v2) hierarchy.
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        if (!controllers)
+            continue;
+        ++controllers;
+        char *path = strchr(controllers, ':');
+        if (!path)
+            continue;
+        *path++ = '\0';
+
+        if (*controllers == '\0') {
+            find_quota(limits, CGROUP_ROOT, path, true);
+        } else if (has_cpu_controller(controllers)) {
+            char mount[PATH_MAX];
+            snprintf(mount, sizeof mount, CGROUP_ROOT "/%s", controllers);
+            if (access(mount, F_OK) != 0)
+                snprintf(mount, sizeof mount, CGROUP_ROOT "/cpu");
+            find_quota(limits, mount, path, false);
+        }
+    }
+    fclose(f);
+}
+
+// Return the number of periods in which the cgroup was throttled, from its
+// cpu.stat file.
+static uint64_t read_nr_throttled(const char *stat_path) {
+    FILE *f = fopen(stat_path, "r");
+    if (!f)
+        return 0;
+    char line[128];
+    uint64_t nr_throttled = 0;
+    while (fgets(line, sizeof line, f)) {
+        if (strncmp(line, "nr_throttled ", 13) == 0) {
+            nr_throttled = strtoull(line + 13, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return nr_throttled;
+}
+
+// Return the number of runnable threads in the system, from the fourth field
+// of /proc/loadavg ("<runnable>/<total>"), or -1 if it cannot be read.
+static long read_runnable(void) {
+    char buf[128];
+    if (!read_line("/proc/loadavg", buf, sizeof buf))
+        return -1;
+    double load[3];
+    long runnable;
+    if (sscanf(buf, "%lf %lf %lf %ld/", &load[0], &load[1], &load[2],
+               &runnable) != 4)
+        return -1;
+    return runnable;
+}
+
+#else
+
+static void read_cgroup_quota(struct cpu_limits *limits) { (void)limits; }
+
+static uint64_t read_nr_throttled(const char *stat_path) {
+    (void)stat_path;
+    return 0;
+}
+
+static long read_runnable(void) { return -1; }
+
+#endif // __linux__
+
+struct cpu_limits *cpu_limits_init(unsigned int ncpus) {
+    struct cpu_limits *limits = calloc(1, sizeof(struct cpu_limits));
+    limits->ncpus = ncpus;
+    read_cgroup_quota(limits);
+    if (limits->stat_path)
+        limits->nr_throttled = read_nr_throttled(limits->stat_path);
+    cilkrts_alert(BOOT, "(cpu_limits_init) %u cpus, cgroup quota %u cpus",
+                  ncpus, limits->quota_cpus);
+    return limits;
+}
+
+void cpu_limits_destroy(struct cpu_limits *limits) {
+    if (!limits)
+        return;
+    free(limits->stat_path);
+    free(limits);
+}
+
+void cpu_limits_sample(global_state *g, uint32_t engaged) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    uint64_t next =
+        atomic_load_explicit(&g->next_cpu_sample, memory_order_relaxed);
+    // Only the sentinel that claims the sample takes it.
+    if (now < next || !atomic_compare_exchange_strong_explicit(
+                          &g->next_cpu_sample, &next, now + ADAPT_SAMPLE_NSEC,
+                          memory_order_relaxed, memory_order_relaxed))
+        return;
+
+    struct cpu_limits *limits = g->cpu_limits;
+    uint32_t cap = atomic_load_explicit(&g->engaged_cap, memory_order_relaxed);
+    long target = g->nworkers;
+
+    // If the cgroup was throttled since the last sample, the workers ran more
+    // threads than the quota allows.  Drop to the quota, or by one worker if
+    // the cap is already there, since other threads of the cgroup share it.
+    if (limits->stat_path) {
+        uint64_t nr_throttled = read_nr_throttled(limits->stat_path);
+        if (nr_throttled > limits->nr_throttled)
+            target = cap > limits->quota_cpus ? limits->quota_cpus
+                                              : (long)cap - 1;
+        limits->nr_throttled = nr_throttled;
+    }
+
+    // Leave a CPU to each runnable thread of other processes.  The run-queue
+    // count includes the engaged workers, which are all runnable.
+    long runnable = read_runnable();
+    if (runnable > (long)engaged) {
+        long room = (long)limits->ncpus - (runnable - (long)engaged);
+        if (room < target)
+            target = room;
+    }
+    if (target < 1)
+        target = 1;
+
+    // Shrink at once, to stop thrashing quickly, but grow one worker per
+    // sample, so that a brief drop in load does not oversubscribe the CPUs.
+    uint32_t new_cap =
+        target < (long)cap ? (uint32_t)target
+                           : (target > (long)cap ? cap + 1 : cap);
+    if (new_cap != cap) {
+        atomic_store_explicit(&g->engaged_cap, new_cap, memory_order_relaxed);
+        cilkrts_alert(SCHED, "(cpu_limits_sample) engaged cap %u -> %u",
+                      cap, new_cap);
+    }
+}
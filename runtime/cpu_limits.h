@@ -0,0 +1,35 @@
+#ifndef _CILK_CPU_LIMITS_H
+#define _CILK_CPU_LIMITS_H
+
+#include <stdint.h>
+
+#include "rts-config.h"
+#include "types.h"
+
+// Limits on the CPU time available to the process, beyond its affinity mask.
+struct cpu_limits {
+    // Number of CPUs allowed by the CFS bandwidth quota of the process's
+    // cgroup, rounded up, or 0 if the cgroup has no quota.
+    unsigned int quota_cpus;
+    // Number of CPUs the process may run on.
+    unsigned int ncpus;
+    // Path of the cpu.stat file of the cgroup that sets the quota, used to
+    // detect throttling.  NULL if there is no quota.
+    char *stat_path;
+    // Number of throttled periods when the limits were last sampled.
+    uint64_t nr_throttled;
+};
+
+// Read the CPU quota of the process's cgroup, supporting both cgroup v1 and
+// v2.  ncpus is the number of CPUs in the process's affinity mask.  Never
+// returns NULL.
+CHEETAH_INTERNAL struct cpu_limits *cpu_limits_init(unsigned int ncpus);
+CHEETAH_INTERNAL void cpu_limits_destroy(struct cpu_limits *limits);
+
+// Sample throttling and the system run-queue load, and update the cap on the
+// number of engaged workers, g->engaged_cap.  engaged is the current number of
+// active and sentinel workers.  Called by sentinel thieves; samples are taken
+// at most every ADAPT_SAMPLE_NSEC.
+CHEETAH_INTERNAL void cpu_limits_sample(global_state *g, uint32_t engaged);
+
+#endif /* _CILK_CPU_LIMITS_H */
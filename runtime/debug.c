@@ -38,6 +38,7 @@ typedef struct __alert_level_t {
 static const alert_level_t alert_table[] = {
     {"none", ALERT_NONE},
     {"fiber", ALERT_FIBER},
+    {"fiber_summary", ALERT_FIBER_SUMMARY},
     {"memory", ALERT_MEMORY},
     {"sync", ALERT_SYNC},
     {"sched", ALERT_SCHED},
@@ -3,8 +3,11 @@
 
 #include "rts-config.h"
 
+#include <stdbool.h>
+
 struct __cilkrts_worker;
 struct __cilkrts_stack_frame;
+struct fiber_region;
 
 // Structure inserted at the top of a fiber, to implement fiber-local storage.
 // The stack begins just below this structure.  See sysdep_get_stack_start().
@@ -26,8 +29,22 @@ struct cilk_fiber {
     // constant for the life of this structure.
     char *alloc_low;         // lowest byte of mapped region
     char *stack_low;         // lowest byte of stack region
-
-    // Three unused words remain 64 bit systems with 64 byte cache lines.
+    // Fiber-arena region that the stack was carved from, or NULL if the stack
+    // has a mapping of its own.
+    struct fiber_region *region;
+
+    // Next free slot of the region, while the fiber is free in the arena.
+    struct cilk_fiber *next_free;
+
+    // Whether the stack below its top has been returned to the system since
+    // the fiber last left a pool.  See cilk_fiber_trim().
+    bool trimmed;
+    // Stack class of the fiber, which sets its stack size and the pool it
+    // goes back to.
+    unsigned char stack_class;
+
+    // Part of one word remains unused on 64 bit systems with 64 byte cache
+    // lines.
 
 } __attribute__((aligned(CILK_CACHE_LINE)));
 
@@ -1,6 +1,7 @@
 #include <inttypes.h> /* PRIu32 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cilk-internal.h"
 #include "debug.h"
@@ -31,6 +32,18 @@
 //
 // For now, we don't ever allocate fibers into the global one --- we only use
 // the global one to load balance between per-worker pools.
+//
+// With CILK_FIBER_REBALANCE, a worker whose pool and the global pool are both
+// empty also takes fibers from siblings whose pools hold more than they
+// started with, before it allocates new ones.  Per-worker pools are then
+// shared: their owners lock them too, and siblings only try their locks.
+// With CILK_FIBER_POOL_SHRINK, pools go back to their initial size whenever
+// the runtime goes idle, so that fibers do not pile up in the pools of the
+// workers that happened to free the most.
+//
+// With CILK_STACK_CLASSES, the pools above hold the fibers of stack class 0,
+// and each larger class has one shared pool of its own, which does not grow
+// and is backed directly by the arena of the class.
 //=========================================================================
 
 //=========================================================
@@ -41,23 +54,80 @@ static void fiber_pool_stat_init(struct cilk_fiber_pool *pool) {
     pool->stats.in_use = 0;
     pool->stats.max_in_use = 0;
     pool->stats.max_free = 0;
+    pool->stats.trimmed_bytes = 0;
 }
 
-#define POOL_FMT "size %3u, %4d used %4d max used %4u max free"
+#define POOL_FMT                                                               \
+    "size %3u, %4d used %4d max used %4u max free %8" PRIu64 " KB trimmed"
 
 static void fiber_pool_stat_print_worker(__cilkrts_worker *w, void *data) {
     FILE *fp = (FILE *)data;
     fprintf(fp, "[W%02" PRIu32 "] " POOL_FMT "\n", w->self,
             w->l->fiber_pool.size, w->l->fiber_pool.stats.in_use,
-            w->l->fiber_pool.stats.max_in_use, w->l->fiber_pool.stats.max_free);
+            w->l->fiber_pool.stats.max_in_use, w->l->fiber_pool.stats.max_free,
+            w->l->fiber_pool.stats.trimmed_bytes >> 10);
 }
 
 static void fiber_pool_stat_print(struct global_state *g) {
     fprintf(stderr, "\nFIBER POOL STATS\n[G  ] " POOL_FMT "\n",
             g->fiber_pool.size, g->fiber_pool.stats.in_use,
-            g->fiber_pool.stats.max_in_use, g->fiber_pool.stats.max_free);
+            g->fiber_pool.stats.max_in_use, g->fiber_pool.stats.max_free,
+            g->fiber_pool.stats.trimmed_bytes >> 10);
     for_each_worker(g, &fiber_pool_stat_print_worker, stderr);
+    const struct fiber_arena *arena = &g->fiber_arena;
+    fprintf(stderr,
+            "[G  ] stack syscalls: %" PRIu64 " mmap %" PRIu64
+            " munmap %" PRIu64 " guard, %u arena regions\n",
+            atomic_load_explicit(&arena->mmaps, memory_order_relaxed),
+            atomic_load_explicit(&arena->munmaps, memory_order_relaxed),
+            atomic_load_explicit(&arena->guards, memory_order_relaxed),
+            atomic_load_explicit(&arena->nregions, memory_order_relaxed));
+    for (unsigned int i = 1; i < g->options.nstack_classes; ++i) {
+        const struct cilk_fiber_pool *pool = &g->fiber_classes[i - 1].pool;
+        fprintf(stderr, "[C%u ] " POOL_FMT ", %zu KB stacks, %u regions\n", i,
+                pool->size, pool->stats.in_use, pool->stats.max_in_use,
+                pool->stats.max_free, pool->stats.trimmed_bytes >> 10,
+                pool->stack_size >> 10,
+                atomic_load_explicit(&g->fiber_classes[i - 1].arena.nregions,
+                                     memory_order_relaxed));
+    }
+    fprintf(stderr, "\n");
+}
+
+static void fiber_stack_profile_print(global_state *g, unsigned int cls,
+                                      const struct fiber_arena *arena,
+                                      size_t stacksize) {
+    const struct fiber_stack_profile *profile = &arena->profile;
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < STACK_PROFILE_BUCKETS; ++i)
+        total += atomic_load_explicit(&profile->uses[i], memory_order_relaxed);
+    fprintf(stderr, "\nSTACK PROFILE, class %u, %zu KB stacks\n", cls,
+            stacksize >> 10);
+    if (total == 0) {
+        fprintf(stderr, "no fiber uses measured\n");
+        return;
+    }
+    for (unsigned int i = 0; i < STACK_PROFILE_BUCKETS; ++i) {
+        uint64_t uses =
+            atomic_load_explicit(&profile->uses[i], memory_order_relaxed);
+        if (uses)
+            fprintf(stderr, "<= %7zu KB %12" PRIu64 " uses %6.2f%%\n",
+                    (size_t)4 << i, uses, 100.0 * uses / total);
+    }
+    size_t max_used =
+        atomic_load_explicit(&profile->max_used, memory_order_relaxed);
+    uint64_t full = atomic_load_explicit(&profile->full, memory_order_relaxed);
+    fprintf(stderr, "max %zu KB used in %" PRIu64 " uses", max_used >> 10,
+            total);
+    if (full)
+        fprintf(stderr, ", %" PRIu64 " of which filled the stack", full);
     fprintf(stderr, "\n");
+    size_t recommended = cilk_fiber_recommended_stacksize(max_used);
+    if (g->options.nstack_classes > 1)
+        fprintf(stderr, "recommended size of class %u: %zuK\n", cls,
+                recommended >> 10);
+    else
+        fprintf(stderr, "recommended CILK_STACKSIZE=%zu\n", recommended);
 }
 
 //=========================================================
@@ -65,21 +135,22 @@ static void fiber_pool_stat_print(struct global_state *g) {
 //=========================================================
 
 // forward decl
-static void fiber_pool_allocate_batch(worker_id self,
+static void fiber_pool_allocate_batch(__cilkrts_worker *w,
                                       struct cilk_fiber_pool *pool,
                                       unsigned int num_to_allocate);
 static void fiber_pool_free_batch(worker_id self,
                                   struct cilk_fiber_pool *pool,
                                   unsigned int num_to_free);
 
-/* Helper function for initializing fiber pool */
+/* Helper function for initializing fiber pool.  The caller initializes the
+ * lock. */
 static void fiber_pool_init(struct cilk_fiber_pool *pool, size_t stacksize,
-                            unsigned int bufsize,
+                            struct fiber_arena *arena, unsigned int bufsize,
                             struct cilk_fiber_pool *parent, int is_shared) {
-    cilk_mutex_init(&pool->lock);
     pool->mutex_owner = NO_WORKER;
     pool->shared = is_shared;
     pool->stack_size = stacksize;
+    pool->arena = arena;
     pool->parent = parent;
     pool->capacity = bufsize;
     pool->size = 0;
@@ -155,10 +226,9 @@ static void fiber_pool_increase_capacity(worker_id self,
  * already smaller than the new size, do nothing.  Assume lock acquired upon
  * entry.
  */
-__attribute__((unused)) // unused for now
-static void
-fiber_pool_decrease_capacity(worker_id self, struct cilk_fiber_pool *pool,
-                             unsigned int new_size) {
+static void fiber_pool_decrease_capacity(worker_id self,
+                                         struct cilk_fiber_pool *pool,
+                                         unsigned int new_size) {
 
     fiber_pool_assert_ownership(self, pool);
 
@@ -177,15 +247,88 @@ fiber_pool_decrease_capacity(worker_id self, struct cilk_fiber_pool *pool,
     }
 }
 
+/**
+ * Trim the stacks of the free fibers pool->fibers[from, to).  Assume lock
+ * acquired upon entry.
+ */
+static void fiber_pool_trim(struct cilk_fiber_pool *pool, unsigned int from,
+                            unsigned int to) {
+    for (unsigned int i = from; i < to; ++i)
+        pool->stats.trimmed_bytes +=
+            cilk_fiber_trim(pool->fibers[i], FIBER_TRIM_KEEP_BYTES);
+}
+
+/**
+ * Shrink the pool back to capacity, keeping the fibers a fresh pool of that
+ * capacity starts with.  Assume lock acquired upon entry.
+ */
+static void fiber_pool_shrink(worker_id self, struct cilk_fiber_pool *pool,
+                              unsigned int capacity) {
+    unsigned int target = capacity / BATCH_FRACTION;
+    if (pool->size > target)
+        fiber_pool_free_batch(self, pool, pool->size - target);
+    fiber_pool_decrease_capacity(self, pool, capacity);
+}
+
+/**
+ * Take up to batch_size free fibers into the pool of w from the pools of
+ * other workers that hold more fibers than they started with.  Pools that
+ * are locked are skipped rather than waited for.  Returns the number of
+ * fibers taken.  Assume the lock on the pool of w acquired upon entry.
+ *
+ * A worker frees the fiber it runs on at a sync, just before it leaves the
+ * fiber, so the fibers at the top of a sibling's pool may still be in use.
+ * Take the oldest fibers, from the bottom, and always leave two.
+ */
+static unsigned int fiber_pool_take_from_siblings(__cilkrts_worker *w,
+                                                  struct cilk_fiber_pool *pool,
+                                                  unsigned int batch_size) {
+    global_state *g = w->g;
+    const worker_id self = w->self;
+    const unsigned int nworkers = g->nworkers;
+    unsigned int keep = g->options.fiber_pool_cap / BATCH_FRACTION;
+    if (keep < 2)
+        keep = 2;
+    unsigned int taken = 0;
+
+    for (unsigned int i = 1; i < nworkers && taken < batch_size; ++i) {
+        __cilkrts_worker *v = g->workers[(self + i) % nworkers];
+        if (!worker_is_valid(v, g))
+            continue;
+        struct cilk_fiber_pool *sibling = &v->l->fiber_pool;
+        if (!cilk_mutex_try(&sibling->lock))
+            continue;
+        // A pool joins in once its owner has set it up and marked it shared.
+        if (sibling->shared && sibling->size > keep) {
+            sibling->mutex_owner = self;
+            unsigned int n = sibling->size - keep;
+            if (n > batch_size - taken)
+                n = batch_size - taken;
+            for (unsigned int j = 0; j < n; ++j)
+                pool->fibers[pool->size++] = sibling->fibers[j];
+            sibling->size -= n;
+            memmove(sibling->fibers, sibling->fibers + n,
+                    sibling->size * sizeof(*sibling->fibers));
+            sibling->stats.in_use += n;
+            taken += n;
+            sibling->mutex_owner = NO_WORKER;
+        }
+        cilk_mutex_unlock(&sibling->lock);
+    }
+    return taken;
+}
+
 /**
  * Allocate num_to_allocate number of new fibers into the pool.
  * We will first look into the parent pool, and if the parent pool does not
- * have enough, we then get it from the system.
+ * have enough, into the pools of sibling workers, if rebalancing is on,
+ * and we then get it from the system.
  */
-static void fiber_pool_allocate_batch(worker_id self,
+static void fiber_pool_allocate_batch(__cilkrts_worker *w,
                                       struct cilk_fiber_pool *pool,
                                       const unsigned int batch_size) {
 
+    const worker_id self = w->self;
     fiber_pool_assert_ownership(self, pool);
     fiber_pool_increase_capacity(self, pool, batch_size + pool->size);
 
@@ -204,10 +347,13 @@ static void fiber_pool_allocate_batch(worker_id self,
         }
         fiber_pool_unlock(self, parent);
     }
+    if (batch_size > from_parent && w->g->options.fiber_rebalance)
+        from_parent +=
+            fiber_pool_take_from_siblings(w, pool, batch_size - from_parent);
     if (batch_size > from_parent) { // if we need more still
         for (unsigned int i = from_parent; i < batch_size; i++) {
             pool->fibers[pool->size++] =
-                cilk_fiber_allocate(pool->stack_size);
+                cilk_fiber_allocate(pool->arena, pool->stack_size);
         }
     }
     if (pool->size > pool->stats.max_free) {
@@ -246,7 +392,7 @@ static void fiber_pool_free_batch(worker_id self,
     if ((batch_size - to_parent) > 0) { // still need to free more
         for (unsigned int i = to_parent; i < batch_size; i++) {
             struct cilk_fiber *fiber = pool->fibers[--pool->size];
-            cilk_fiber_deallocate(fiber);
+            cilk_fiber_deallocate(pool->arena, fiber);
         }
     }
 }
@@ -260,10 +406,32 @@ void cilk_fiber_pool_global_init(global_state *g) {
 
     unsigned int bufsize = g->options.nproc * g->options.fiber_pool_cap;
     struct cilk_fiber_pool *pool = &(g->fiber_pool);
-    fiber_pool_init(pool, g->options.stacksize, bufsize, NULL, 1 /*shared*/);
+    cilk_fiber_arena_init(&g->fiber_arena, g->options.stacksize, 0,
+                          g->options.fiber_arena);
+    cilk_mutex_init(&pool->lock);
+    g->fiber_arena.paint = g->options.stack_profile;
+    fiber_pool_init(pool, g->options.stacksize, &g->fiber_arena, bufsize, NULL,
+                    1 /*shared*/);
     CILK_ASSERT(NULL != pool->fibers);
     fiber_pool_stat_init(pool);
     /* let's not preallocate for global fiber pool for now */
+
+    unsigned int nclasses = g->options.nstack_classes;
+    if (nclasses > 1) {
+        g->fiber_classes = calloc(nclasses - 1, sizeof(*g->fiber_classes));
+        for (unsigned int i = 1; i < nclasses; ++i) {
+            struct fiber_class *c = &g->fiber_classes[i - 1];
+            size_t stacksize = g->options.stack_class_size[i];
+            cilk_fiber_arena_init(&c->arena, stacksize, i,
+                                  g->options.fiber_arena);
+            c->arena.paint = g->options.stack_profile;
+            cilk_mutex_init(&c->pool.lock);
+            fiber_pool_init(&c->pool, stacksize, &c->arena,
+                            g->options.fiber_pool_cap, NULL, 1 /*shared*/);
+            CILK_ASSERT(NULL != c->pool.fibers);
+            fiber_pool_stat_init(&c->pool);
+        }
+    }
 }
 
 /* This does not yet destroy the fiber pool; merely collects
@@ -277,13 +445,36 @@ void cilk_fiber_pool_global_terminate(global_state *g) {
         cilk_fiber_deallocate_global(g, fiber);
     }
     cilk_mutex_unlock(&pool->lock);
+    cilk_fiber_arena_release(&g->fiber_arena);
+    for (unsigned int i = 1; i < g->options.nstack_classes; ++i) {
+        struct fiber_class *c = &g->fiber_classes[i - 1];
+        cilk_mutex_lock(&c->pool.lock);
+        while (c->pool.size > 0)
+            cilk_fiber_deallocate(&c->arena, c->pool.fibers[--c->pool.size]);
+        cilk_mutex_unlock(&c->pool.lock);
+        cilk_fiber_arena_release(&c->arena);
+    }
     if (ALERT_ENABLED(FIBER_SUMMARY))
         fiber_pool_stat_print(g);
+    if (g->options.stack_profile) {
+        fiber_stack_profile_print(g, 0, &g->fiber_arena, g->options.stacksize);
+        for (unsigned int i = 1; i < g->options.nstack_classes; ++i)
+            fiber_stack_profile_print(g, i, &g->fiber_classes[i - 1].arena,
+                                      g->options.stack_class_size[i]);
+        fprintf(stderr, "\n");
+    }
 }
 
 /* Global fiber pool clean up. */
 void cilk_fiber_pool_global_destroy(global_state *g) {
     fiber_pool_destroy(&g->fiber_pool); // worker 0 should have freed everything
+    cilk_fiber_arena_destroy(&g->fiber_arena);
+    for (unsigned int i = 1; i < g->options.nstack_classes; ++i) {
+        fiber_pool_destroy(&g->fiber_classes[i - 1].pool);
+        cilk_fiber_arena_destroy(&g->fiber_classes[i - 1].arena);
+    }
+    free(g->fiber_classes);
+    g->fiber_classes = NULL;
 }
 
 /**
@@ -296,8 +487,13 @@ void cilk_fiber_pool_global_destroy(global_state *g) {
  */
 void cilk_fiber_pool_per_worker_zero_init(__cilkrts_worker *w) {
     struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    // Siblings may try the lock of the pool to rebalance from here on.
+    cilk_mutex_init(&pool->lock);
+    pool->mutex_owner = NO_WORKER;
+    pool->shared = 0;
     pool->size = 0;
     pool->fibers = NULL;
+    w->l->class_fiber_freed = NULL;
 }
 
 /**
@@ -309,13 +505,49 @@ void cilk_fiber_pool_per_worker_init(__cilkrts_worker *w) {
     global_state *g = w->g;
     unsigned int bufsize = g->options.fiber_pool_cap;
     struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
-    fiber_pool_init(pool, g->options.stacksize, bufsize, &(g->fiber_pool),
-                    0 /* private */);
+    fiber_pool_init(pool, g->options.stacksize, &g->fiber_arena, bufsize,
+                    &(g->fiber_pool), 0 /* private */);
     CILK_ASSERT(NULL != pool->fibers);
     CILK_ASSERT(g->fiber_pool.stack_size == pool->stack_size);
 
     fiber_pool_stat_init(pool);
-    fiber_pool_allocate_batch(w->self, pool, bufsize / BATCH_FRACTION);
+    fiber_pool_allocate_batch(w, pool, bufsize / BATCH_FRACTION);
+
+    if (g->options.fiber_rebalance) {
+        // Let siblings take fibers from the pool from now on.
+        cilk_mutex_lock(&pool->lock);
+        pool->shared = 1;
+        cilk_mutex_unlock(&pool->lock);
+    }
+}
+
+void cilk_fiber_pool_per_worker_warmup(__cilkrts_worker *w,
+                                       unsigned int nfibers) {
+    struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    if (!pool->fibers)
+        cilk_fiber_pool_per_worker_init(w);
+    fiber_pool_lock(w->self, pool);
+    if (pool->size < nfibers)
+        fiber_pool_allocate_batch(w, pool, nfibers - pool->size);
+    for (unsigned int i = 0; i < pool->size; ++i)
+        cilk_fiber_prefault(pool->fibers[i], WARMUP_PREFAULT_BYTES);
+    fiber_pool_unlock(w->self, pool);
+}
+
+void cilk_fiber_pool_global_warmup(global_state *g, unsigned int nfibers) {
+    struct cilk_fiber_pool *pool = &(g->fiber_pool);
+    cilk_mutex_lock(&pool->lock);
+    if (nfibers > pool->capacity)
+        nfibers = pool->capacity;
+    while (pool->size < nfibers) {
+        struct cilk_fiber *fiber =
+            cilk_fiber_allocate(pool->arena, pool->stack_size);
+        cilk_fiber_prefault(fiber, WARMUP_PREFAULT_BYTES);
+        pool->fibers[pool->size++] = fiber;
+    }
+    if (pool->size > pool->stats.max_free)
+        pool->stats.max_free = pool->size;
+    cilk_mutex_unlock(&pool->lock);
 }
 
 /* This does not yet destroy the fiber pool; merely collects
@@ -323,12 +555,66 @@ void cilk_fiber_pool_per_worker_init(__cilkrts_worker *w) {
  */
 void cilk_fiber_pool_per_worker_terminate(__cilkrts_worker *w) {
     struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    if (w->l->class_fiber_freed) {
+        cilk_fiber_deallocate_class(w->g, w->l->class_fiber_freed);
+        w->l->class_fiber_freed = NULL;
+    }
     while (pool->size > 0) {
         unsigned index = --pool->size;
         struct cilk_fiber *fiber = pool->fibers[index];
         pool->fibers[index] = NULL;
-        cilk_fiber_deallocate(fiber);
+        cilk_fiber_deallocate(pool->arena, fiber);
+    }
+}
+
+void cilk_fiber_pool_per_worker_idle(__cilkrts_worker *w) {
+    global_state *g = w->g;
+    struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    if (!pool->fibers)
+        return;
+    // The worker is off its fibers now.
+    if (w->l->class_fiber_freed) {
+        cilk_fiber_deallocate_class(g, w->l->class_fiber_freed);
+        w->l->class_fiber_freed = NULL;
     }
+    fiber_pool_lock(w->self, pool);
+    if (g->options.fiber_pool_shrink)
+        fiber_pool_shrink(w->self, pool, g->options.fiber_pool_cap);
+    if (g->options.fiber_trim)
+        fiber_pool_trim(pool, 0, pool->size);
+    fiber_pool_unlock(w->self, pool);
+}
+
+void cilk_fiber_pool_global_idle(__cilkrts_worker *w) {
+    global_state *g = w->g;
+    struct cilk_fiber_pool *pool = &(g->fiber_pool);
+    fiber_pool_lock(w->self, pool);
+    if (g->options.fiber_pool_shrink)
+        fiber_pool_shrink(w->self, pool, pool->capacity);
+    if (g->options.fiber_trim)
+        fiber_pool_trim(pool, 0, pool->size);
+    fiber_pool_unlock(w->self, pool);
+
+    // The pools of the larger classes hold the stacks that cost the most
+    // memory, so they are emptied rather than shrunk.
+    for (unsigned int i = 1; i < g->options.nstack_classes; ++i) {
+        pool = &g->fiber_classes[i - 1].pool;
+        fiber_pool_lock(w->self, pool);
+        if (g->options.fiber_pool_shrink && pool->size > 0)
+            fiber_pool_free_batch(w->self, pool, pool->size);
+        if (g->options.fiber_trim)
+            fiber_pool_trim(pool, 0, pool->size);
+        fiber_pool_unlock(w->self, pool);
+    }
+}
+
+void cilk_fiber_pool_trim_fiber(__cilkrts_worker *w,
+                                struct cilk_fiber *fiber) {
+    struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    size_t bytes = cilk_fiber_trim(fiber, FIBER_TRIM_KEEP_BYTES);
+    fiber_pool_lock(w->self, pool);
+    pool->stats.trimmed_bytes += bytes;
+    fiber_pool_unlock(w->self, pool);
 }
 
 /* Per-worker fiber pool clean up. */
@@ -338,24 +624,87 @@ void cilk_fiber_pool_per_worker_destroy(__cilkrts_worker *w) {
     fiber_pool_destroy(pool);
 }
 
+/**
+ * Allocate a fiber of stack class cls from the pool of that class, or from
+ * the system if it is empty.
+ */
+struct cilk_fiber *cilk_fiber_allocate_class(global_state *g,
+                                             unsigned int cls) {
+    if (cls == 0)
+        return cilk_fiber_allocate(&g->fiber_arena, g->options.stacksize);
+    CILK_ASSERT(cls < g->options.nstack_classes);
+    struct cilk_fiber_pool *pool = &g->fiber_classes[cls - 1].pool;
+    struct cilk_fiber *ret = NULL;
+    cilk_mutex_lock(&pool->lock);
+    if (pool->size > 0)
+        ret = pool->fibers[--pool->size];
+    pool->stats.in_use++;
+    if (pool->stats.in_use > pool->stats.max_in_use) {
+        pool->stats.max_in_use = pool->stats.in_use;
+    }
+    cilk_mutex_unlock(&pool->lock);
+    if (!ret)
+        return cilk_fiber_allocate(pool->arena, pool->stack_size);
+    sanitizer_unpoison_fiber(ret);
+    if (pool->arena->paint)
+        cilk_fiber_profile_reuse(pool->arena, ret);
+    init_fiber_header(ret);
+    ret->trimmed = false;
+    return ret;
+}
+
+/**
+ * Free fiber into the pool of its stack class, or to the system if that pool
+ * is full.
+ */
+void cilk_fiber_deallocate_class(global_state *g, struct cilk_fiber *fiber) {
+    if (fiber->stack_class == 0) {
+        cilk_fiber_deallocate_global(g, fiber);
+        return;
+    }
+    struct cilk_fiber_pool *pool =
+        &g->fiber_classes[fiber->stack_class - 1].pool;
+    sanitizer_poison_fiber(fiber);
+    deinit_fiber_header(fiber);
+    cilk_mutex_lock(&pool->lock);
+    pool->stats.in_use--;
+    if (pool->size < pool->capacity) {
+        pool->fibers[pool->size++] = fiber;
+        if (pool->size > pool->stats.max_free) {
+            pool->stats.max_free = pool->size;
+        }
+        fiber = NULL;
+    }
+    cilk_mutex_unlock(&pool->lock);
+    if (fiber)
+        cilk_fiber_deallocate(pool->arena, fiber);
+}
+
 /**
  * Allocate a fiber from this pool; if this pool is empty,
  * allocate a batch of fibers from the parent pool (or system).
  */
-struct cilk_fiber *cilk_fiber_allocate_from_pool(__cilkrts_worker *w) {
+struct cilk_fiber *cilk_fiber_allocate_from_pool(__cilkrts_worker *w,
+                                                 unsigned int stack_class) {
+    if (stack_class != 0)
+        return cilk_fiber_allocate_class(w->g, stack_class);
     struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    fiber_pool_lock(w->self, pool);
     if (pool->size == 0) {
-        fiber_pool_allocate_batch(w->self, pool,
-                                  pool->capacity / BATCH_FRACTION);
+        fiber_pool_allocate_batch(w, pool, pool->capacity / BATCH_FRACTION);
     }
     struct cilk_fiber *ret = pool->fibers[--pool->size];
     pool->stats.in_use++;
     if (pool->stats.in_use > pool->stats.max_in_use) {
         pool->stats.max_in_use = pool->stats.in_use;
     }
+    fiber_pool_unlock(w->self, pool);
     CILK_ASSERT(ret);
     sanitizer_unpoison_fiber(ret);
+    if (pool->arena->paint)
+        cilk_fiber_profile_reuse(pool->arena, ret);
     init_fiber_header(ret);
+    ret->trimmed = false;
     return ret;
 }
 
@@ -365,9 +714,18 @@ struct cilk_fiber *cilk_fiber_allocate_from_pool(__cilkrts_worker *w) {
  */
 void cilk_fiber_deallocate_to_pool(__cilkrts_worker *w,
                                    struct cilk_fiber *fiber_to_return) {
+    if (fiber_to_return && fiber_to_return->stack_class != 0) {
+        // The shared pool would let other workers run on the fiber at once.
+        struct cilk_fiber *prev = w->l->class_fiber_freed;
+        w->l->class_fiber_freed = fiber_to_return;
+        if (prev)
+            cilk_fiber_deallocate_class(w->g, prev);
+        return;
+    }
     if (fiber_to_return)
         sanitizer_poison_fiber(fiber_to_return);
     struct cilk_fiber_pool *pool = &(w->l->fiber_pool);
+    fiber_pool_lock(w->self, pool);
     if (pool->size == pool->capacity) {
         fiber_pool_free_batch(w->self, pool, pool->capacity / BATCH_FRACTION);
         CILK_ASSERT((pool->capacity - pool->size) >=
@@ -381,5 +739,11 @@ void cilk_fiber_deallocate_to_pool(__cilkrts_worker *w,
             pool->stats.max_free = pool->size;
         }
         fiber_to_return = NULL;
+        // The pool reuses its top fibers first.  Trim the fiber that the
+        // new one pushed out of the top FIBER_TRIM_HOT_FIBERS.
+        if (w->g->options.fiber_trim && pool->size > FIBER_TRIM_HOT_FIBERS)
+            fiber_pool_trim(pool, pool->size - FIBER_TRIM_HOT_FIBERS - 1,
+                            pool->size - FIBER_TRIM_HOT_FIBERS);
     }
+    fiber_pool_unlock(w->self, pool);
 }
@@ -3,9 +3,13 @@
 #endif
 
 #include <dlfcn.h> // For dynamically loading ASan functions
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #ifdef __BSD__
 #include <sys/cpuset.h>
 #include <sys/param.h>
@@ -15,6 +19,7 @@
 #include "debug.h"
 #include "fiber.h"
 #include "fiber-header.h"
+#include "global.h"
 #include "init.h"
 
 #include <string.h> /* memset() */
@@ -279,10 +284,8 @@ void sanitizer_poison_fiber(struct cilk_fiber *fiber) {
 // Private helper functions
 //===============================================================
 
-struct cilk_fiber *make_stack(size_t stack_size) {
-    const int page_shift = cheetah_page_shift;
-    const size_t page_size = 1U << page_shift;
-
+static size_t stack_pages_for(size_t stack_size) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
     size_t stack_pages = (stack_size + page_size - 1) >> cheetah_page_shift;
 
     if (stack_pages < MIN_NUM_PAGES_PER_STACK) {
@@ -290,39 +293,290 @@ struct cilk_fiber *make_stack(size_t stack_size) {
     } else if (stack_pages > MAX_NUM_PAGES_PER_STACK) {
         stack_pages = MAX_NUM_PAGES_PER_STACK;
     }
-    char *alloc_low = (char *)mmap(
-        0, stack_pages * page_size, PROT_READ | PROT_WRITE,
-        MAP_STACK_FLAGS, -1, 0);
-    if (MAP_FAILED == alloc_low) {
-        cilkrts_bug(NULL, "Cilk: stack mmap failed");
-        /* Currently unreached.  TODO: Investigate more graceful
-           error handling. */
+    return stack_pages;
+}
+
+/***
+ * Fiber arena.  A region is one mmap of region_slots stack slots.  A slot is
+ * laid out like a stack mapped on its own: a guard page at the low end, then
+ * the stack, then the fiber header.  The guard page is installed with
+ * MADV_GUARD_INSTALL when the slot is first carved, which leaves the mapping
+ * of the region whole, so a slot costs one madvise over its lifetime, and
+ * reusing it costs no system call.  A kernel without MADV_GUARD_INSTALL
+ * could only guard a slot with mprotect, which splits the mapping into two
+ * per slot, so the arena is not used there.
+ *
+ * The regions of an arena are split among FIBER_ARENA_SHARDS shards, each
+ * with its own lock, and a worker takes slots from the shard of its id, so
+ * that workers only contend when one frees a slot that another took.  A
+ * region whose slots are all free is unmapped as soon as another region of
+ * its shard has room, which keeps one region of slack against a region
+ * boundary.
+ ***/
+
+/* A region is not mapped with MAP_STACK_FLAGS, since on FreeBSD and Linux
+   they ask for one stack that grows down.  OpenBSD still needs MAP_STACK to
+   run on the region. */
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#if defined __OpenBSD__ && defined MAP_STACK
+#define ARENA_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK)
+#else
+#define ARENA_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE)
+#endif
+
+/* Linux 6.13 and later; older C libraries do not define it yet. */
+#if defined __linux__ && !defined MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+static inline void count_syscall(_Atomic uint64_t *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+// Whether the kernel installs guard pages without splitting mappings.
+static bool guard_install_works;
+static pthread_once_t guard_install_once = PTHREAD_ONCE_INIT;
+
+static void guard_install_probe(void) {
+#ifdef MADV_GUARD_INSTALL
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    void *p = mmap(0, 2 * page_size, PROT_READ | PROT_WRITE, ARENA_MAP_FLAGS,
+                   -1, 0);
+    if (MAP_FAILED == p)
+        return;
+    guard_install_works = madvise(p, page_size, MADV_GUARD_INSTALL) == 0;
+    (void)munmap(p, 2 * page_size);
+#endif
+}
+
+static inline bool region_has_room(const struct fiber_arena *arena,
+                                   const struct fiber_region *r) {
+    return r->free_list || r->carved < arena->region_slots;
+}
+
+// Map a new region and add it at the front of shard.  Returns NULL if the
+// mapping fails.  The caller holds the lock on shard.
+static struct fiber_region *arena_map_region(struct fiber_arena *arena,
+                                             struct fiber_arena_shard *shard) {
+    char *base = (char *)mmap(0, arena->slot_size * arena->region_slots,
+                              PROT_READ | PROT_WRITE, ARENA_MAP_FLAGS, -1, 0);
+    count_syscall(&arena->mmaps);
+    if (MAP_FAILED == base)
         return NULL;
+    struct fiber_region *r = calloc(1, sizeof(*r));
+    r->arena = arena;
+    r->shard = shard;
+    r->base = base;
+    r->next = shard->regions;
+    shard->regions = r;
+    atomic_fetch_add_explicit(&arena->nregions, 1, memory_order_relaxed);
+    cilkrts_alert(FIBER, "Map fiber region %p [%p--%p]", (void *)r,
+                  (void *)base,
+                  (void *)(base + arena->slot_size * arena->region_slots));
+    return r;
+}
+
+// Unmap region r, which the caller has already unlinked from its shard.
+static void arena_unmap_region(struct fiber_arena *arena,
+                               struct fiber_region *r) {
+    cilkrts_alert(FIBER, "Unmap fiber region %p", (void *)r);
+    if (munmap(r->base, arena->slot_size * arena->region_slots) < 0)
+        cilkrts_bug("Cilk: fiber region munmap failed");
+    count_syscall(&arena->munmaps);
+    atomic_fetch_sub_explicit(&arena->nregions, 1, memory_order_relaxed);
+    free(r);
+}
+
+// Take a slot from the shard of arena that the calling worker uses, carving a
+// new one or mapping a new region if no free slot is left.  Returns the low
+// end of the slot, or NULL if no region can be mapped.
+static char *arena_take_slot(struct fiber_arena *arena,
+                             struct fiber_region **region) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    __cilkrts_worker *w = __cilkrts_tls_worker;
+    struct fiber_arena_shard *shard =
+        &arena->shards[w ? w->self % FIBER_ARENA_SHARDS : 0];
+    char *slot = NULL;
+    bool carved = false;
+
+    cilk_mutex_lock(&shard->lock);
+    struct fiber_region *r = shard->regions;
+    while (r && !region_has_room(arena, r))
+        r = r->next;
+    if (!r)
+        r = arena_map_region(arena, shard);
+    if (r) {
+        struct cilk_fiber *f = r->free_list;
+        if (f) {
+            r->free_list = f->next_free;
+            --r->nfree;
+            slot = f->alloc_low;
+        } else {
+            slot = r->base + (size_t)r->carved++ * arena->slot_size;
+            carved = true;
+        }
+        *region = r;
+    }
+    cilk_mutex_unlock(&shard->lock);
+
+#ifdef MADV_GUARD_INSTALL
+    if (carved) {
+        (void)madvise(slot, page_size, MADV_GUARD_INSTALL);
+        count_syscall(&arena->guards);
+    }
+#else
+    (void)page_size;
+    (void)carved;
+#endif
+    return slot;
+}
+
+// Return the slot of fiber f to its region, and unmap the region if none of
+// its slots is in use and another region of its shard has room.
+static void arena_return_slot(struct cilk_fiber *f) {
+    struct fiber_region *r = f->region;
+    struct fiber_arena *arena = r->arena;
+    struct fiber_arena_shard *shard = r->shard;
+    bool unmap = false;
+
+    cilk_mutex_lock(&shard->lock);
+    f->next_free = r->free_list;
+    r->free_list = f;
+    ++r->nfree;
+    if (r->nfree == r->carved) {
+        struct fiber_region **link = &shard->regions, *spare = NULL;
+        for (struct fiber_region *o = shard->regions; o; o = o->next) {
+            if (o == r)
+                continue;
+            if (region_has_room(arena, o)) {
+                spare = o;
+                break;
+            }
+        }
+        if (spare) {
+            while (*link != r)
+                link = &(*link)->next;
+            *link = r->next;
+            unmap = true;
+        }
+    }
+    cilk_mutex_unlock(&shard->lock);
+
+    if (unmap)
+        arena_unmap_region(arena, r);
+}
+
+/***
+ * Stack profiling.  With CILK_STACK_PROFILE, each stack is painted with
+ * STACK_PAINT_BYTE when it is made.  The lowest byte of the stack that is no
+ * longer painted is its high-water mark.  It is recorded in the profile of
+ * the arena when the fiber leaves a pool to be reused, after which the used
+ * part is painted again, and when the stack goes back to the arena.  Marks
+ * are taken only then, since a worker frees the fiber it runs on to its pool
+ * before it leaves the fiber.  A word at the bottom of a frame that happens to
+ * hold the paint makes a mark one word low.
+ ***/
+
+#define STACK_PAINT_BYTE 0x5a
+#define STACK_PAINT_WORD ((uintptr_t)0x5a5a5a5a5a5a5a5aULL)
+
+static size_t stack_bytes_used(struct cilk_fiber *f) {
+    // Both ends of the stack are word aligned.
+    const uintptr_t *p = (const uintptr_t *)f->stack_low;
+    const uintptr_t *high = (const uintptr_t *)sysdep_get_stack_start(f);
+    while (p < high && *p == STACK_PAINT_WORD)
+        ++p;
+    return (size_t)((const char *)high - (const char *)p);
+}
+
+static void stack_profile_record(struct fiber_stack_profile *profile,
+                                 struct cilk_fiber *f, size_t used) {
+    unsigned int bucket = 0;
+    while (bucket < STACK_PROFILE_BUCKETS - 1 &&
+           used > ((size_t)4096 << bucket))
+        ++bucket;
+    atomic_fetch_add_explicit(&profile->uses[bucket], 1,
+                              memory_order_relaxed);
+    if (used == (size_t)(sysdep_get_stack_start(f) - f->stack_low))
+        atomic_fetch_add_explicit(&profile->full, 1, memory_order_relaxed);
+    size_t max = atomic_load_explicit(&profile->max_used, memory_order_relaxed);
+    while (used > max &&
+           !atomic_compare_exchange_weak_explicit(&profile->max_used, &max,
+                                                  used, memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+struct cilk_fiber *make_stack(struct fiber_arena *arena, size_t stack_size) {
+    const int page_shift = cheetah_page_shift;
+    const size_t page_size = 1U << page_shift;
+
+    size_t stack_pages = stack_pages_for(stack_size);
+
+    // Stacks of another size than the arena's get a mapping of their own.
+    char *alloc_low = NULL;
+    struct fiber_region *region = NULL;
+    if (arena->slot_size == stack_pages * page_size)
+        alloc_low = arena_take_slot(arena, &region);
+    if (!alloc_low) {
+        alloc_low = (char *)mmap(0, stack_pages * page_size,
+                                 PROT_READ | PROT_WRITE, MAP_STACK_FLAGS, -1,
+                                 0);
+        count_syscall(&arena->mmaps);
+        if (MAP_FAILED == alloc_low) {
+            cilkrts_bug(NULL, "Cilk: stack mmap failed");
+            /* Currently unreached.  TODO: Investigate more graceful
+               error handling. */
+            return NULL;
+        }
+#ifndef MAP_STACK
+        (void)mprotect(alloc_low, page_size, PROT_NONE);
+        count_syscall(&arena->guards);
+#endif
     }
     char *alloc_high = alloc_low + stack_pages * page_size;
     char *stack_low = alloc_low + page_size;
     char *stack_high = alloc_high - sizeof(struct cilk_fiber);
-#ifndef MAP_STACK
-    (void)mprotect(alloc_low, page_size, PROT_NONE);
-#endif
     struct cilk_fiber *f = (struct cilk_fiber *)stack_high;
     f->alloc_low = alloc_low;
     f->stack_low = stack_low;
-    if (DEBUG_ENABLED(MEMORY_SLOW))
+    f->region = region;
+    f->next_free = NULL;
+    // A fresh mapping has no resident pages to trim; a reused slot may.
+    f->trimmed = !region;
+    f->stack_class = arena->stack_class;
+    // A reused slot may still be poisoned from its last use.
+    if (region)
+        sanitizer_unpoison_fiber(f);
+    if (arena->paint)
+        memset(stack_low, STACK_PAINT_BYTE, stack_high - stack_low);
+    else if (DEBUG_ENABLED(MEMORY_SLOW))
         memset(stack_low, 0x11, stack_high - stack_low);
     return f;
 }
 
-static void free_stack(struct cilk_fiber *f) {
+static void free_stack(struct fiber_arena *arena, struct cilk_fiber *f) {
+    if (arena->paint) {
+        size_t used = stack_bytes_used(f);
+        if (used > 0)
+            stack_profile_record(&arena->profile, f, used);
+    }
     if (DEBUG_ENABLED(MEMORY_SLOW)) {
         char *stack_low = f->stack_low;
         char *stack_high = sysdep_get_stack_start(f);
         memset(stack_low, 0xbb, stack_high - stack_low);
     }
+    if (f->region) {
+        arena_return_slot(f);
+        return;
+    }
     char *alloc_low = sysdep_get_fiber_start(f);
     char *alloc_high = sysdep_get_fiber_end(f);
     if (munmap(f->alloc_low, alloc_high - alloc_low) < 0)
         cilkrts_bug(NULL, "Cilk: stack munmap failed");
+    count_syscall(&arena->munmaps);
     /* f is now an invalid pointer */
 }
 
@@ -330,8 +584,9 @@ static void free_stack(struct cilk_fiber *f) {
 // Supported public functions
 //===============================================================
 
-struct cilk_fiber *cilk_fiber_allocate(size_t stacksize) {
-    struct cilk_fiber *fiber = make_stack(stacksize);
+struct cilk_fiber *cilk_fiber_allocate(struct fiber_arena *arena,
+                                       size_t stacksize) {
+    struct cilk_fiber *fiber = make_stack(arena, stacksize);
     init_fiber_header(fiber);
     cilkrts_alert(FIBER, "Allocate fiber %p [%p--%p]", (void *)fiber,
                   (void *)fiber->stack_low,
@@ -339,23 +594,179 @@ struct cilk_fiber *cilk_fiber_allocate(size_t stacksize) {
     return fiber;
 }
 
-void cilk_fiber_deallocate(struct cilk_fiber *fiber) {
+void cilk_fiber_deallocate(struct fiber_arena *arena,
+                           struct cilk_fiber *fiber) {
     cilkrts_alert(FIBER, "Deallocate fiber %p [%p--%p]", (void *)fiber,
                   (void *)fiber->stack_low,
                   (void *)sysdep_get_stack_start(fiber));
     if (DEBUG_ENABLED_STATIC(FIBER))
         CILK_ASSERT(!in_fiber(fiber, fiber->current_stack_frame));
-    free_stack(fiber);
+    free_stack(arena, fiber);
 }
 
 void cilk_fiber_deallocate_global(struct global_state *g,
                                   struct cilk_fiber *fiber) {
-    (void)g; // not currently used
-
     cilkrts_alert(FIBER, "Deallocate fiber %p [%p--%p]", (void *)fiber,
                   (void *)fiber->stack_low,
                   (void *)sysdep_get_stack_start(fiber));
-    free_stack(fiber);
+    if (fiber->stack_class)
+        free_stack(&g->fiber_classes[fiber->stack_class - 1].arena, fiber);
+    else
+        free_stack(&g->fiber_arena, fiber);
+}
+
+void cilk_fiber_arena_init(struct fiber_arena *arena, size_t stacksize,
+                           unsigned int stack_class,
+                           unsigned int region_slots) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    if (region_slots) {
+        (void)pthread_once(&guard_install_once, guard_install_probe);
+        if (!guard_install_works) {
+            cilkrts_alert(BOOT, "(cilk_fiber_arena_init) no MADV_GUARD_INSTALL;"
+                                " mapping fiber stacks one by one");
+            region_slots = 0;
+        }
+    }
+    arena->slot_size =
+        region_slots ? stack_pages_for(stacksize) * page_size : 0;
+    arena->stack_class = stack_class;
+    arena->region_slots = region_slots;
+    atomic_store_explicit(&arena->nregions, 0, memory_order_relaxed);
+    atomic_store_explicit(&arena->mmaps, 0, memory_order_relaxed);
+    atomic_store_explicit(&arena->munmaps, 0, memory_order_relaxed);
+    atomic_store_explicit(&arena->guards, 0, memory_order_relaxed);
+    arena->paint = false;
+    memset(&arena->profile, 0, sizeof(arena->profile));
+    for (unsigned int i = 0; i < FIBER_ARENA_SHARDS; ++i) {
+        arena->shards[i].regions = NULL;
+        cilk_mutex_init(&arena->shards[i].lock);
+    }
+}
+
+void cilk_fiber_arena_release(struct fiber_arena *arena) {
+    for (unsigned int i = 0; i < FIBER_ARENA_SHARDS; ++i) {
+        struct fiber_arena_shard *shard = &arena->shards[i];
+        cilk_mutex_lock(&shard->lock);
+        struct fiber_region **link = &shard->regions;
+        while (*link) {
+            struct fiber_region *r = *link;
+            if (r->nfree == r->carved) {
+                *link = r->next;
+                arena_unmap_region(arena, r);
+            } else {
+                link = &r->next;
+            }
+        }
+        cilk_mutex_unlock(&shard->lock);
+    }
+}
+
+void cilk_fiber_arena_destroy(struct fiber_arena *arena) {
+    for (unsigned int i = 0; i < FIBER_ARENA_SHARDS; ++i) {
+        struct fiber_arena_shard *shard = &arena->shards[i];
+        struct fiber_region *r = shard->regions;
+        while (r) {
+            struct fiber_region *next = r->next;
+            arena_unmap_region(arena, r);
+            r = next;
+        }
+        shard->regions = NULL;
+        cilk_mutex_destroy(&shard->lock);
+    }
+}
+
+void cilk_fiber_prefault(struct cilk_fiber *fiber, size_t bytes) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    volatile char *stack_high = sysdep_get_stack_start(fiber);
+    size_t size = stack_high - fiber->stack_low;
+    if (bytes > size)
+        bytes = size;
+    // Write each page, so that it is not left mapped to the zero page.
+    for (size_t off = 1; off <= bytes; off += page_size)
+        stack_high[-(ptrdiff_t)off] = stack_high[-(ptrdiff_t)off];
+}
+
+/* Trimming returns stack pages to the system with MADV_FREE where it exists,
+   which lets the kernel take them lazily, or else with MADV_DONTNEED. */
+#if defined MADV_FREE && FIBER_TRIM_LAZY
+#define FIBER_TRIM_ADVICE MADV_FREE
+#else
+#define FIBER_TRIM_ADVICE MADV_DONTNEED
+#endif
+
+#ifdef __linux__
+typedef unsigned char mincore_vec_t;
+#else
+typedef char mincore_vec_t;
+#endif
+
+// Pages of a stack whose residency one mincore call checks.
+#define TRIM_SCAN_PAGES 256
+
+size_t cilk_fiber_trim(struct cilk_fiber *fiber, size_t keep) {
+    if (fiber->trimmed)
+        return 0;
+    fiber->trimmed = true;
+
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    char *stack_high = sysdep_get_stack_start(fiber);
+    if (keep >= (size_t)(stack_high - fiber->stack_low))
+        return 0;
+    // The top keep bytes hold the frames that every use of the fiber
+    // touches, so they stay.
+    char *cold_high =
+        (char *)((uintptr_t)(stack_high - keep) & ~(uintptr_t)(page_size - 1));
+
+    // Stacks grow down, so the lowest resident page of the stack is its
+    // high-water mark.  The runtime does not see the deepest stack pointer of
+    // plain recursion, so ask the kernel which pages are resident instead.
+    char *low_water = NULL;
+    size_t resident = 0;
+    mincore_vec_t vec[TRIM_SCAN_PAGES];
+    for (char *p = fiber->stack_low; p < cold_high;
+         p += TRIM_SCAN_PAGES * page_size) {
+        size_t npages = (size_t)(cold_high - p) >> cheetah_page_shift;
+        if (npages > TRIM_SCAN_PAGES)
+            npages = TRIM_SCAN_PAGES;
+        if (mincore(p, npages * page_size, vec) < 0) {
+            // Residency is unknown; trim the whole cold part of the stack.
+            low_water = fiber->stack_low;
+            resident = (size_t)(cold_high - low_water) >> cheetah_page_shift;
+            break;
+        }
+        for (size_t i = 0; i < npages; ++i) {
+            if (vec[i] & 1) {
+                if (!low_water)
+                    low_water = p + i * page_size;
+                ++resident;
+            }
+        }
+    }
+    if (!resident)
+        return 0;
+    if (madvise(low_water, cold_high - low_water, FIBER_TRIM_ADVICE) < 0)
+        return 0;
+    cilkrts_alert(FIBER, "Trim fiber %p [%p--%p]", (void *)fiber,
+                  (void *)low_water, (void *)cold_high);
+    return resident * page_size;
+}
+
+void cilk_fiber_profile_reuse(struct fiber_arena *arena,
+                              struct cilk_fiber *fiber) {
+    size_t used = stack_bytes_used(fiber);
+    if (used == 0)
+        return;
+    stack_profile_record(&arena->profile, fiber, used);
+    memset(sysdep_get_stack_start(fiber) - used, STACK_PAINT_BYTE, used);
+}
+
+size_t cilk_fiber_recommended_stacksize(size_t used) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    // CILK_STACKSIZE includes the guard page and the fiber header.
+    size_t size = used + used * STACK_PROFILE_HEADROOM / 100 + page_size +
+                  sizeof(struct cilk_fiber);
+    size = (size + page_size - 1) & ~(page_size - 1);
+    return size < 16384 ? 16384 : size;
 }
 
 int in_fiber(struct cilk_fiber *fiber, void *p) {
@@ -364,3 +775,130 @@ int in_fiber(struct cilk_fiber *fiber, void *p) {
     // One past the end is considered in the fiber.
     return p >= stack_low && p <= stack_high;
 }
+
+/***
+ * Overflow of fiber stacks.  With CILK_OVERFLOW_HANDLER=1, each worker thread
+ * and each thread that runs a cilkified region as the boss handles SIGSEGV
+ * and SIGBUS on an alternate signal stack.  The runtime installs the handler
+ * for the whole process the first time one of these threads starts, and
+ * never removes it.  A fault in the guard page below the stack of the fiber
+ * that the thread runs on prints a message.  With more than one stack class,
+ * it also raises the smallest class that the roots of later regions get,
+ * stack_class_floor, past the class of that fiber.  Regions that are already
+ * running keep their stacks.  Every fault, from a fiber stack or not, is then
+ * passed on to the handler installed before, with that handler's mask and
+ * flags.  If there was none, the fault repeats with the default action.  A
+ * program that recovers from the fault in its own handler, and retries the
+ * failed work in a new cilkified region, runs it on larger stacks.  A program
+ * that installs its own handler after the runtime must chain to the runtime's
+ * handler for overflows to promote later regions.
+ ***/
+
+static pthread_once_t guard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t guard_altstack_key;
+static struct sigaction guard_prev_action[2]; // for SIGSEGV and SIGBUS
+
+// Write msg and the decimal digit of n, where n < 10, to stderr.
+static void guard_message(const char *msg, unsigned int n) {
+    char buf[128];
+    size_t len = strlen(msg);
+    if (len > sizeof(buf) - 2)
+        len = sizeof(buf) - 2;
+    memcpy(buf, msg, len);
+    buf[len++] = '0' + n;
+    buf[len++] = '\n';
+    ssize_t ret = write(STDERR_FILENO, buf, len);
+    (void)ret;
+}
+
+static void guard_handler(int sig, siginfo_t *info, void *ctx) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    struct cilk_fiber *fh = __cilkrts_current_fh;
+    __cilkrts_worker *w = __cilkrts_tls_worker;
+    char *addr = (char *)info->si_addr;
+    // Stacks mapped to grow down fault just below their mapping instead.
+    if (fh && w && w->g && addr + page_size >= fh->alloc_low &&
+        addr < fh->stack_low) {
+        global_state *g = w->g;
+        unsigned int cls = fh->stack_class + 1;
+        if (cls < g->options.nstack_classes) {
+            uint32_t floor = atomic_load_explicit(&g->stack_class_floor,
+                                                  memory_order_relaxed);
+            while (floor < cls &&
+                   !atomic_compare_exchange_weak_explicit(
+                       &g->stack_class_floor, &floor, cls,
+                       memory_order_relaxed, memory_order_relaxed))
+                ;
+            guard_message("Cilk: fiber stack overflow; later regions start "
+                          "on stack class ",
+                          cls);
+        } else {
+            guard_message("Cilk: fiber stack overflow on the largest stack "
+                          "class, ",
+                          fh->stack_class);
+        }
+    }
+
+    // Call the previous handler as the kernel would have.  A fault cannot be
+    // ignored, so SIG_IGN gets the default action too.
+    const struct sigaction *prev = &guard_prev_action[sig == SIGBUS];
+    if (!(prev->sa_flags & SA_SIGINFO) &&
+        (prev->sa_handler == SIG_DFL || prev->sa_handler == SIG_IGN)) {
+        // Returning repeats the fault, which now ends the process.
+        signal(sig, SIG_DFL);
+        return;
+    }
+    sigset_t mask, old_mask;
+    mask = prev->sa_mask;
+    if (!(prev->sa_flags & SA_NODEFER))
+        sigaddset(&mask, sig);
+    (void)pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    if (prev->sa_flags & SA_NODEFER) {
+        sigemptyset(&mask);
+        sigaddset(&mask, sig);
+        (void)pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    }
+    if (prev->sa_flags & SA_RESETHAND)
+        signal(sig, SIG_DFL);
+    if (prev->sa_flags & SA_SIGINFO)
+        prev->sa_sigaction(sig, info, ctx);
+    else
+        prev->sa_handler(sig);
+    (void)pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+static void guard_altstack_free(void *stack) {
+    stack_t ss = {.ss_sp = NULL, .ss_size = 0, .ss_flags = SS_DISABLE};
+    (void)sigaltstack(&ss, NULL);
+    free(stack);
+}
+
+static void guard_install(void) {
+    (void)pthread_key_create(&guard_altstack_key, guard_altstack_free);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = guard_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    (void)sigaction(SIGSEGV, &sa, &guard_prev_action[0]);
+    (void)sigaction(SIGBUS, &sa, &guard_prev_action[1]);
+}
+
+void cilk_fiber_guard_thread_init(void) {
+    (void)pthread_once(&guard_once, guard_install);
+    if (pthread_getspecific(guard_altstack_key))
+        return;
+    // Keep an alternate stack that the thread already has.
+    stack_t old;
+    if (sigaltstack(NULL, &old) == 0 && !(old.ss_flags & SS_DISABLE))
+        return;
+    void *stack = malloc(FIBER_GUARD_ALTSTACK_SIZE);
+    if (!stack)
+        return;
+    stack_t ss = {
+        .ss_sp = stack, .ss_size = FIBER_GUARD_ALTSTACK_SIZE, .ss_flags = 0};
+    if (sigaltstack(&ss, NULL) == 0)
+        (void)pthread_setspecific(guard_altstack_key, stack);
+    else
+        free(stack);
+}
@@ -9,6 +9,7 @@
 #include "rts-config.h"
 #include "types.h"
 
+#include <stdatomic.h>
 #include <stdint.h>
 
 //===============================================================
@@ -20,12 +21,67 @@ struct fiber_pool_stats {
     int in_use;     // number of fibers allocated - freed from / into the pool
     int max_in_use; // high watermark for in_use
     unsigned max_free; // high watermark for number of free fibers in the pool
+    uint64_t trimmed_bytes; // resident stack bytes returned by trimming
+};
+
+// One mapping of a fiber arena, carved into slots of arena->slot_size bytes.
+// Each slot holds a guard page, a stack and the fiber header on top.  Slots
+// are carved in address order as they are first needed, and freed slots are
+// kept on free_list.  The region belongs to one shard of its arena, whose
+// lock guards it.
+struct fiber_region {
+    struct fiber_region *next;
+    struct fiber_arena *arena;
+    struct fiber_arena_shard *shard;
+    char *base;
+    unsigned int carved; // slots handed out at least once
+    unsigned int nfree;  // carved slots now on free_list
+    struct cilk_fiber *free_list;
+};
+
+// Regions of an arena that the workers whose ids are equal modulo
+// FIBER_ARENA_SHARDS take slots from, so that workers rarely contend for a
+// lock.
+struct fiber_arena_shard {
+    struct fiber_region *regions;
+    cilk_mutex lock;
+} __attribute__((aligned(CILK_CACHE_LINE)));
+
+// Stack use of the fibers of an arena, kept with CILK_STACK_PROFILE: the
+// number of uses whose high-water mark fell in each bucket of bytes, where
+// bucket i holds marks up to 4 KB << i, the uses that reached the guard page,
+// and the highest mark.
+#define STACK_PROFILE_BUCKETS 16
+struct fiber_stack_profile {
+    _Atomic uint64_t uses[STACK_PROFILE_BUCKETS];
+    _Atomic uint64_t full;
+    _Atomic size_t max_used;
+};
+
+// Fiber stacks carved from large regions, so that allocating or freeing a
+// fiber takes no system call once its slot exists, and memory goes back to
+// the system a region at a time.  The counts of the system calls that map
+// fiber stacks are kept with or without the arena.
+struct fiber_arena {
+    size_t slot_size;          // 0 if stacks are mapped one by one
+    unsigned int stack_class;  // class of the fibers made here
+    unsigned int region_slots; // slots per region
+    _Atomic uint32_t nregions;
+    _Atomic uint64_t mmaps;
+    _Atomic uint64_t munmaps;
+    _Atomic uint64_t guards; // mprotect or madvise calls for guard pages
+    // Set with CILK_STACK_PROFILE, which paints the stacks to measure them.
+    bool paint;
+    struct fiber_stack_profile profile;
+
+    struct fiber_arena_shard shards[FIBER_ARENA_SHARDS];
 };
 
 struct cilk_fiber_pool {
     worker_id mutex_owner;
     int shared;
     size_t stack_size;              // Size of stacks for fibers in this pool.
+    struct fiber_arena *arena;      // Where new stacks come from.
     struct cilk_fiber_pool *parent; // Parent pool.
                                     // If this pool is empty, get from parent
     // Describes inactive fibers stored in the pool.
@@ -37,6 +93,14 @@ struct cilk_fiber_pool {
     cilk_mutex lock __attribute__((aligned(CILK_CACHE_LINE)));
 };
 
+// Fibers of one stack class above 0.  They are needed much more rarely than
+// the fibers of class 0, so each class has only one shared pool, which does
+// not grow, and an arena of its own.
+struct fiber_class {
+    struct cilk_fiber_pool pool;
+    struct fiber_arena arena;
+};
+
 //===============================================================
 // Supported functions
 //===============================================================
@@ -142,20 +206,80 @@ CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_zero_init(__cilkrts_worker *w);
 CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_init(__cilkrts_worker *w);
 CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_terminate(__cilkrts_worker *w);
 CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_destroy(__cilkrts_worker *w);
+// Fill the pool of worker w, or the global pool of g, with at least nfibers
+// fibers, as far as the global pool's capacity allows, and fault in the top
+// of their stacks.
+CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_warmup(__cilkrts_worker *w,
+                                                        unsigned int nfibers);
+CHEETAH_INTERNAL void cilk_fiber_pool_global_warmup(global_state *g,
+                                                    unsigned int nfibers);
 
-// allocate / deallocate one fiber from / back to OS
+// Set up arena for stacks of stacksize bytes of class stack_class, carved
+// region_slots at a time, or for stacks mapped one by one if region_slots is
+// 0.
+CHEETAH_INTERNAL void cilk_fiber_arena_init(struct fiber_arena *arena,
+                                            size_t stacksize,
+                                            unsigned int stack_class,
+                                            unsigned int region_slots);
+// Return the regions of arena whose slots are all free to the system.
+CHEETAH_INTERNAL void cilk_fiber_arena_release(struct fiber_arena *arena);
+// Return all regions of arena to the system.
+CHEETAH_INTERNAL void cilk_fiber_arena_destroy(struct fiber_arena *arena);
+
+// allocate / deallocate one fiber from / back to arena or OS
 CHEETAH_INTERNAL
-struct cilk_fiber *cilk_fiber_allocate(size_t stacksize);
+struct cilk_fiber *cilk_fiber_allocate(struct fiber_arena *arena,
+                                       size_t stacksize);
 CHEETAH_INTERNAL
-void cilk_fiber_deallocate(struct cilk_fiber *fiber);
+void cilk_fiber_deallocate(struct fiber_arena *arena,
+                           struct cilk_fiber *fiber);
 CHEETAH_INTERNAL
 void cilk_fiber_deallocate_global(global_state *, struct cilk_fiber *fiber);
-// allocate / deallocate one fiber from / back to per-worker pool
+// Fault in the top bytes of the stack of fiber.
+CHEETAH_INTERNAL
+void cilk_fiber_prefault(struct cilk_fiber *fiber, size_t bytes);
+// Return the resident pages of the stack of the free fiber below its top keep
+// bytes to the system, unless that was done since the fiber last left a
+// pool.  Returns the number of resident bytes given back.
 CHEETAH_INTERNAL
-struct cilk_fiber *cilk_fiber_allocate_from_pool(__cilkrts_worker *w);
+size_t cilk_fiber_trim(struct cilk_fiber *fiber, size_t keep);
+// Record the stack use of fiber since its stack was last painted in the
+// profile of arena, and paint the used part again.  Called as the fiber
+// leaves a pool to be reused, when it surely runs nowhere.
+CHEETAH_INTERNAL
+void cilk_fiber_profile_reuse(struct fiber_arena *arena,
+                              struct cilk_fiber *fiber);
+// The stack size, as CILK_STACKSIZE counts it, whose stack fits used bytes
+// with STACK_PROFILE_HEADROOM percent to spare.
+CHEETAH_INTERNAL size_t cilk_fiber_recommended_stacksize(size_t used);
+// Shrink the per-worker pool of w, or the global pool, back to its initial
+// size and trim its free fibers, as CILK_FIBER_POOL_SHRINK and
+// CILK_FIBER_TRIM ask, when the runtime goes idle.  The global pool is
+// handled by the boss, whose worker is w.
+CHEETAH_INTERNAL void cilk_fiber_pool_per_worker_idle(__cilkrts_worker *w);
+CHEETAH_INTERNAL void cilk_fiber_pool_global_idle(__cilkrts_worker *w);
+// Trim fiber, which is idle outside any pool, and count it with the pool of w.
+CHEETAH_INTERNAL void cilk_fiber_pool_trim_fiber(__cilkrts_worker *w,
+                                                 struct cilk_fiber *fiber);
+// allocate / deallocate one fiber from / back to per-worker pool, or to the
+// pool of its class if its stack class is not 0
+CHEETAH_INTERNAL
+struct cilk_fiber *cilk_fiber_allocate_from_pool(__cilkrts_worker *w,
+                                                 unsigned int stack_class);
 CHEETAH_INTERNAL
 void cilk_fiber_deallocate_to_pool(__cilkrts_worker *w,
                                    struct cilk_fiber *fiber);
+// allocate / deallocate one fiber of a stack class without a worker, as for
+// the root closure of a cilkified region
+CHEETAH_INTERNAL
+struct cilk_fiber *cilk_fiber_allocate_class(global_state *g,
+                                             unsigned int stack_class);
+CHEETAH_INTERNAL
+void cilk_fiber_deallocate_class(global_state *g, struct cilk_fiber *fiber);
+// Catch overflows of fiber stacks on the calling thread, so that they promote
+// later cilkified regions to a larger stack class.  Only called with
+// CILK_OVERFLOW_HANDLER.  See fiber.c.
+CHEETAH_INTERNAL void cilk_fiber_guard_thread_init(void);
 
 CHEETAH_INTERNAL int in_fiber(struct cilk_fiber *, void *);
 
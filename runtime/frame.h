@@ -78,6 +78,12 @@ struct __cilkrts_stack_frame {
 //       function.
 #define CILK_FRAME_SYNC_READY        0x200
 
+/* The fiber stack class that stolen continuations of this frame, and the
+   strands stolen below them, run on.  Set by
+   __cilkrts_set_frame_stack_class. */
+#define CILK_FRAME_STACK_CLASS_SHIFT 10
+#define CILK_FRAME_STACK_CLASS       (0x3 << CILK_FRAME_STACK_CLASS_SHIFT)
+
 static const uint32_t frame_magic =
     (((((((((((__CILKRTS_ABI_VERSION * 13) +
               offsetof(struct __cilkrts_stack_frame, ctx)) *
@@ -134,4 +140,17 @@ static inline int __cilkrts_throwing(struct __cilkrts_stack_frame *sf) {
     return (sf->flags & CILK_FRAME_THROWING);
 }
 
+/* Returns the fiber stack class that the frame asks for. */
+static inline unsigned int
+__cilkrts_frame_stack_class(struct __cilkrts_stack_frame *sf) {
+    return (sf->flags & CILK_FRAME_STACK_CLASS) >> CILK_FRAME_STACK_CLASS_SHIFT;
+}
+
+static inline void
+__cilkrts_set_frame_stack_class_bits(struct __cilkrts_stack_frame *sf,
+                                     unsigned int cls) {
+    sf->flags = (sf->flags & ~CILK_FRAME_STACK_CLASS) |
+                (cls << CILK_FRAME_STACK_CLASS_SHIFT);
+}
+
 #endif /* _CILK_FRAME_H */
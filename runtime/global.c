@@ -12,10 +12,12 @@
 #include <string.h>
 #include <unistd.h> /* _SC_NPROCESSORS_ONLN */
 
+#include "cpu_limits.h"
 #include "debug.h"
 #include "global.h"
 #include "init.h"
 #include "readydeque.h"
+#include "topology.h"
 
 #if defined __FreeBSD__ && __FreeBSD__ < 13
 typedef cpuset_t cpu_set_t;
@@ -38,6 +40,9 @@ local_state default_worker_local_state;
 
 // A global used to calculate grain size.
 unsigned __cilkrts_nproc = 0;
+// Number of arenas.  While there are none, every thread runs in the default
+// runtime, whose worker count is __cilkrts_nproc.
+unsigned __cilkrts_narenas = 0;
 
 static void set_alert_debug_level() {
     /* Only the bits also set in ALERT_LVL are used. */
@@ -62,6 +67,13 @@ static global_state *global_state_allocate() {
     // TODO: Convert to cilk_* equivalents
     pthread_mutex_init(&g->cilkified_lock, NULL);
     pthread_cond_init(&g->cilkified_cond_var, NULL);
+    pthread_cond_init(&g->guest_done_cond_var, NULL);
+
+    pthread_mutex_init(&g->roots_lock, NULL);
+    pthread_cond_init(&g->roots_cond_var, NULL);
+    pthread_mutex_init(&g->ready_waiters_lock, NULL);
+    pthread_mutex_init(&g->resize_lock, NULL);
+    pthread_cond_init(&g->resize_cond_var, NULL);
 
     pthread_mutex_init(&g->disengaged_lock, NULL);
     pthread_cond_init(&g->disengaged_cond_var, NULL);
@@ -75,6 +87,34 @@ static void set_stacksize(global_state *g, size_t stacksize) {
     CILK_ASSERT(stacksize >= 16384);
     CILK_ASSERT(stacksize <= 100 * 1024 * 1024);
     g->options.stacksize = stacksize;
+    g->options.stack_class_size[0] = stacksize;
+}
+
+// Set the fiber stack classes from CILK_STACK_CLASSES, a list of up to
+// STACK_CLASS_MAX increasing stack sizes with optional K, M or G suffixes,
+// such as "64K,1M,8M".  The first class sets the default stack size.
+static void set_stack_classes(global_state *g, const char *classes) {
+    CILK_ASSERT(!g->workers_started);
+    unsigned int n = 0;
+    const char *p = classes;
+    while (*p) {
+        char *end;
+        unsigned long long size = strtoull(p, &end, 0);
+        static const char suffixes[] = "kKmMgG";
+        const char *suffix = *end ? strchr(suffixes, *end) : NULL;
+        if (suffix) {
+            size <<= 10 * (1 + (suffix - suffixes) / 2);
+            ++end;
+        }
+        if (end == p || (*end && *end != ',') || n == STACK_CLASS_MAX ||
+            size < 16384 || size > 100 * 1024 * 1024 ||
+            (n > 0 && size <= g->options.stack_class_size[n - 1]))
+            cilkrts_bug("Cilk: invalid CILK_STACK_CLASSES \"%s\"", classes);
+        g->options.stack_class_size[n++] = size;
+        p = *end ? end + 1 : end;
+    }
+    set_stacksize(g, g->options.stack_class_size[0]);
+    g->options.nstack_classes = n;
 }
 
 static void set_deqdepth(global_state *g, unsigned int deqdepth) {
@@ -93,13 +133,216 @@ static void set_fiber_pool_cap(global_state *g, unsigned int fiber_pool_cap) {
     g->options.fiber_pool_cap = fiber_pool_cap;
 }
 
+static void set_steal_hierarchy(global_state *g, unsigned int hierarchy,
+                                unsigned int escalate) {
+    CILK_ASSERT(!g->workers_started);
+    CILK_ASSERT(escalate <= 999999);
+    g->options.steal_hierarchy = hierarchy;
+    if (escalate > 0)
+        g->options.steal_escalate = escalate;
+}
+
+static void set_steal_summary(global_state *g, unsigned int steal_summary) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.steal_summary = steal_summary;
+}
+
+static void set_steal_batch(global_state *g, unsigned int steal_batch) {
+    CILK_ASSERT(!g->workers_started);
+    CILK_ASSERT(steal_batch >= 1);
+    if (steal_batch > MAX_STEAL_BATCH)
+        steal_batch = MAX_STEAL_BATCH;
+    g->options.steal_batch = steal_batch;
+}
+
+static void set_leapfrog(global_state *g, unsigned int leapfrog) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.leapfrog = leapfrog;
+}
+
+static void set_targeted_wake(global_state *g, unsigned int targeted_wake) {
+    CILK_ASSERT(!g->workers_started);
+    // Wake slots are implemented only on top of futexes.
+    g->options.targeted_wake = USE_FUTEX ? targeted_wake : 0;
+}
+
+static void set_wake_fanout(global_state *g, unsigned int wake_fanout) {
+    CILK_ASSERT(!g->workers_started);
+    if (wake_fanout > MAX_WAKE_FANOUT)
+        wake_fanout = MAX_WAKE_FANOUT;
+    // Tree-structured wakeup is implemented only on top of futexes.
+    g->options.wake_fanout = USE_FUTEX ? wake_fanout : 0;
+}
+
+static void set_warmup(global_state *g, unsigned int warmup) {
+    CILK_ASSERT(!g->workers_started);
+    CILK_ASSERT(warmup <= 999999);
+    g->options.warmup = warmup;
+}
+
+static void set_fiber_arena(global_state *g, unsigned int region_stacks) {
+    CILK_ASSERT(!g->workers_started);
+    CILK_ASSERT(region_stacks <= 1024);
+    g->options.fiber_arena = region_stacks;
+}
+
+static void set_fiber_trim(global_state *g, bool fiber_trim) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.fiber_trim = fiber_trim;
+}
+
+static void set_stack_profile(global_state *g, bool stack_profile) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.stack_profile = stack_profile;
+    // The profile reads the paint left on the stacks, which trimmed pages
+    // lose.
+    if (stack_profile)
+        g->options.fiber_trim = 0;
+}
+
+static void set_overflow_handler(global_state *g, bool overflow_handler) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.overflow_handler = overflow_handler;
+}
+
+static void set_fiber_pool_balance(global_state *g, bool shrink,
+                                   bool rebalance) {
+    CILK_ASSERT(!g->workers_started);
+    g->options.fiber_pool_shrink = shrink;
+    g->options.fiber_rebalance = rebalance;
+}
+
+static void set_adapt_nworkers(global_state *g, unsigned int adapt_nworkers) {
+    CILK_ASSERT(!g->workers_started);
+    // Engaged workers are capped by the sentinel logic, which exists only if
+    // thieves can sleep.
+    g->options.adapt_nworkers = ENABLE_THIEF_SLEEP ? adapt_nworkers : 0;
+}
+
+#define PIN_MAX_CPUS 4096
+
+// Set the worker pinning policy from CILK_PIN, which names a policy or lists
+// the CPUs to pin to, such as "0-7,16-23".  The numbers 1, 2 and 3 keep their
+// meaning from the old compile-time pinning: spread the workers, pack them,
+// or do not pin.
+static void set_pin_policy(global_state *g, const char *pin) {
+    CILK_ASSERT(!g->workers_started);
+    static const struct {
+        const char *name;
+        enum pin_policy policy;
+    } policies[] = {
+        {"none", PIN_NONE},  {"0", PIN_NONE},        {"compact", PIN_COMPACT},
+        {"2", PIN_COMPACT},  {"scatter", PIN_SCATTER}, {"1", PIN_SCATTER},
+        {"core", PIN_CORE},  {"3", PIN_NONE},
+    };
+    for (size_t i = 0; i < sizeof policies / sizeof policies[0]; ++i) {
+        if (strcmp(pin, policies[i].name) == 0) {
+            g->options.pin = policies[i].policy;
+            return;
+        }
+    }
+    unsigned int *cpus = malloc(PIN_MAX_CPUS * sizeof(unsigned int));
+    int ncpus = cilk_cpulist_parse(pin, cpus, PIN_MAX_CPUS);
+    if (ncpus <= 0)
+        cilkrts_bug("Cilk: invalid CILK_PIN \"%s\"", pin);
+    g->options.pin = PIN_LIST;
+    g->pin_ncpus = ncpus;
+    g->pin_cpus = cpus;
+}
+
+// Scheduling profiles.  "throughput" is the built-in tuning.  "latency" keeps
+// idle workers spinning and engaged longer, also between cilkified regions,
+// and steals more eagerly, to react quickly to new work.  "shared-host" backs
+// off sooner and sleeps longer, to leave CPUs to other processes.
+static const struct {
+    const char *name;
+    struct sched_tuning tuning;
+} sched_profiles[] = {
+    {"throughput",
+     {NAP_NSEC, SLEEP_NSEC, AS_RATIO, DEFAULT_HISTORY_THRESHOLD,
+      (BUSY_LOOP_SPIN), 0, 100, false}},
+    {"latency",
+     {NAP_NSEC / 2, SLEEP_NSEC / 2, 2 * AS_RATIO, DEFAULT_HISTORY_THRESHOLD + 4,
+      8 * (BUSY_LOOP_SPIN), IDLE_SPIN_NSEC, 50, false}},
+    {"shared-host",
+     {2 * NAP_NSEC, 4 * SLEEP_NSEC, 1, DEFAULT_HISTORY_THRESHOLD - 8,
+      (BUSY_LOOP_SPIN) / 8, 0, 200, false}},
+};
+
+_Static_assert(sizeof sched_profiles / sizeof sched_profiles[0] ==
+                   NUM_SCHED_PROFILES,
+               "NUM_SCHED_PROFILES must match the profile table");
+
+// Return the index of the named scheduling profile, or -1 if there is no such
+// profile.
+int find_sched_profile(const char *name) {
+    for (size_t i = 0; i < sizeof sched_profiles / sizeof sched_profiles[0];
+         ++i) {
+        if (strcmp(name, sched_profiles[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Select scheduling profile i.  The tuning sets do not change after init, so
+// this only publishes a pointer, and workers may keep stealing meanwhile.
+void apply_sched_profile(global_state *g, unsigned int i) {
+    CILK_ASSERT(i < NUM_SCHED_PROFILES);
+    const struct sched_tuning *tuning = &g->tunings[i];
+    atomic_store_explicit(&g->steal_delay_scale,
+                          tuning->steal_delay_pct * STEAL_DELAY_SCALE_ONE / 100,
+                          memory_order_relaxed);
+    atomic_store_explicit(&g->tuning, tuning, memory_order_release);
+}
+
+// Set up the tuning of every scheduling profile, select the profile named by
+// the environment, and apply the individual tuning overrides from the
+// environment to that profile.  Self-tuning applies to every profile.
+static void parse_sched_tuning(global_state *g) {
+    bool self_tune = env_get_int("CILK_SELF_TUNE") > 0;
+    for (unsigned int i = 0; i < NUM_SCHED_PROFILES; ++i) {
+        g->tunings[i] = sched_profiles[i].tuning;
+        g->tunings[i].self_tune = self_tune;
+    }
+
+    int i = find_sched_profile("throughput");
+    const char *profile = getenv("CILK_SCHED_PROFILE");
+    if (profile && (i = find_sched_profile(profile)) < 0)
+        cilkrts_bug("Cilk: unknown CILK_SCHED_PROFILE \"%s\"", profile);
+    struct sched_tuning *tuning = &g->tunings[i];
+
+    long val;
+    if ((val = env_get_int("CILK_NAP_NSEC")) > 0)
+        tuning->nap_nsec = val < 999999999 ? val : 999999999;
+    if ((val = env_get_int("CILK_SLEEP_NSEC")) > 0)
+        tuning->sleep_nsec = val < 999999999 ? val : 999999999;
+    if ((val = env_get_int("CILK_AS_RATIO")) > 0)
+        tuning->as_ratio = val < 64 ? val : 64;
+    if ((val = env_get_int("CILK_HISTORY_THRESHOLD")) > 0)
+        tuning->history_threshold = val < 31 ? val : 31;
+    if ((val = env_get_int("CILK_BUSY_SPIN")) > 0)
+        tuning->busy_loop_spin = val < (1L << 24) ? val : (1L << 24);
+    // 0 disables spinning between regions, so check for the variable.
+    if (getenv("CILK_IDLE_SPIN_NSEC")) {
+        val = env_get_int("CILK_IDLE_SPIN_NSEC");
+        tuning->idle_spin_nsec =
+            val < 0 ? 0 : (val < 999999999 ? val : 999999999);
+    }
+    if ((val = env_get_int("CILK_STEAL_DELAY")) > 0)
+        tuning->steal_delay_pct = val < 10000 ? val : 10000;
+    apply_sched_profile(g, i);
+}
+
 // not marked as static as it's called by __cilkrts_internal_set_nworkers
 // used by Cilksan to set nworker to 1 
 void set_nworkers(global_state *g, unsigned int nworkers) {
-    CILK_ASSERT(!g->workers_started);
+    CILK_ASSERT(!g->workers_started ||
+                atomic_load_explicit(&g->resizing, memory_order_relaxed));
     CILK_ASSERT(nworkers <= g->options.nproc);
     CILK_ASSERT(nworkers > 0);
     g->nworkers = nworkers;
+    if (g->topology)
+        cilk_topology_set_nworkers(g->topology, nworkers);
 }
 
 // Set global RTS options from environment variables.
@@ -107,45 +350,122 @@ static void parse_rts_environment(global_state *g) {
     size_t stacksize = env_get_int("CILK_STACKSIZE");
     if (stacksize > 0)
         set_stacksize(g, stacksize);
+    const char *stack_classes = getenv("CILK_STACK_CLASSES");
+    if (stack_classes && *stack_classes)
+        set_stack_classes(g, stack_classes);
     unsigned int deqdepth = env_get_int("CILK_DEQDEPTH");
     if (deqdepth > 0)
         set_deqdepth(g, deqdepth);
     unsigned int fiber_pool_cap = env_get_int("CILK_FIBER_POOL");
     if (fiber_pool_cap > 0)
         set_fiber_pool_cap(g, fiber_pool_cap);
+    // CILK_FIBER_ARENA=0 turns the arena off, so only an unset variable keeps
+    // the default.
+    if (getenv("CILK_FIBER_ARENA")) {
+        long fiber_arena = env_get_int("CILK_FIBER_ARENA");
+        set_fiber_arena(g, fiber_arena < 0      ? 0
+                           : fiber_arena > 1024 ? 1024
+                                                : fiber_arena);
+    }
+    set_fiber_trim(g, env_get_int("CILK_FIBER_TRIM") > 0);
+    set_stack_profile(g, env_get_int("CILK_STACK_PROFILE") > 0);
+    set_overflow_handler(g, env_get_int("CILK_OVERFLOW_HANDLER") > 0);
+    set_fiber_pool_balance(g, env_get_int("CILK_FIBER_POOL_SHRINK") > 0,
+                           env_get_int("CILK_FIBER_REBALANCE") > 0);
+    set_steal_hierarchy(g, env_get_int("CILK_STEAL_HIERARCHY") > 0,
+                        env_get_int("CILK_STEAL_ESCALATE"));
+    set_steal_summary(g, env_get_int("CILK_STEAL_SUMMARY") > 0);
+    unsigned int steal_batch = env_get_int("CILK_STEAL_BATCH");
+    if (steal_batch > 0)
+        set_steal_batch(g, steal_batch);
+    set_leapfrog(g, env_get_int("CILK_LEAPFROG") > 0);
+    set_targeted_wake(g, env_get_int("CILK_TARGETED_WAKE") > 0);
+    set_wake_fanout(g, env_get_int("CILK_WAKE_FANOUT"));
+    parse_sched_tuning(g);
+
+    set_adapt_nworkers(g, env_get_int("CILK_ADAPT_NWORKERS") > 0);
+    long warmup = env_get_int("CILK_WARMUP");
+    if (warmup > 0)
+        set_warmup(g, warmup < 999999 ? warmup : 999999);
+    const char *pin = getenv("CILK_PIN");
+    if (pin && *pin)
+        set_pin_policy(g, pin);
 
     long proc_override = env_get_int("CILK_NWORKERS");
-    if (g->options.nproc == 0) {
-        // use the number of cores online right now
-        int available_cores = 0;
+    // use the number of cores online right now
+    int available_cores = 0;
 #ifdef CPU_SETSIZE
-        cpu_set_t process_mask;
-        // get the mask from the parent thread (master thread)
-        int err = pthread_getaffinity_np(pthread_self(), sizeof(process_mask),
-                                         &process_mask);
-        if (0 == err) {
-            // Get the number of available cores (copied from os-unix.c)
-            available_cores = CPU_COUNT(&process_mask);
-        }
+    cpu_set_t process_mask;
+    // get the mask from the parent thread (master thread)
+    int err = pthread_getaffinity_np(pthread_self(), sizeof(process_mask),
+                                     &process_mask);
+    if (0 == err) {
+        // Get the number of available cores (copied from os-unix.c)
+        available_cores = CPU_COUNT(&process_mask);
+    }
 #endif
+#ifdef _SC_NPROCESSORS_ONLN
+    if (available_cores == 0) {
+        long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nproc > 0)
+            available_cores = nproc;
+    }
+#endif
+    struct cpu_limits *limits = cpu_limits_init(available_cores);
+
+    if (g->options.nproc == 0) {
         if (proc_override > 0)
             g->options.nproc = proc_override;
-        else if (available_cores > 0)
+        else if (available_cores > 0) {
             g->options.nproc = available_cores;
-#ifdef _SC_NPROCESSORS_ONLN
-        else if (available_cores == 0) {
-            long nproc = sysconf(_SC_NPROCESSORS_ONLN);
-            if (nproc > 0) {
-                g->options.nproc = nproc;
+            // Don't create more workers than the cgroup's CPU quota can run
+            // at once.
+            if (limits->quota_cpus > 0 &&
+                limits->quota_cpus < g->options.nproc) {
+                cilkrts_alert(BOOT,
+                              "(parse_rts_environment) limiting %d workers to "
+                              "cgroup quota of %u cpus",
+                              available_cores, limits->quota_cpus);
+                g->options.nproc = limits->quota_cpus;
             }
         }
-#endif
     } else {
         CILK_ASSERT(g->options.nproc < 10000);
     }
+
+    if (g->options.adapt_nworkers)
+        g->cpu_limits = limits;
+    else
+        cpu_limits_destroy(limits);
+}
+
+// Find the core classes of a hybrid machine, from sysfs, or from the cpulist
+// of fast CPUs in CILK_FAST_CPUS, which overrides sysfs for testing.
+static void init_core_classes(global_state *g) {
+    const char *fast = getenv("CILK_FAST_CPUS");
+    if (fast && *fast) {
+        unsigned int *cpus = malloc(SLOW_CPU_BITS * sizeof(unsigned int));
+        int ncpus = cilk_cpulist_parse(fast, cpus, SLOW_CPU_BITS);
+        if (ncpus <= 0)
+            cilkrts_bug("Cilk: invalid CILK_FAST_CPUS \"%s\"", fast);
+        g->slow_cpus = cilk_slow_cpus(cpus, ncpus);
+        free(cpus);
+    } else {
+        g->slow_cpus = cilk_slow_cpus(NULL, 0);
+    }
+    if (!g->slow_cpus)
+        return;
+    unsigned int words = (g->options.nproc + 63) / 64;
+    size_t size =
+        round_size_to_alignment(CILK_CACHE_LINE, words * sizeof(uint64_t));
+    g->slow_workers = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+    memset((void *)g->slow_workers, 0, size);
+    g->slow_workers_words = words;
 }
 
-global_state *global_state_init(int argc, char *argv[]) {
+// Create a global state.  If nproc is nonzero, it sets the number of workers
+// instead of CILK_NWORKERS.
+global_state *global_state_init(int argc, char *argv[], unsigned int nproc) {
     cilkrts_alert(BOOT, "(global_state_init) Initializing global state");
 
     (void)argc; // not currently used
@@ -160,17 +480,20 @@ global_state *global_state_init(int argc, char *argv[]) {
 
     g->options = (struct rts_options)DEFAULT_OPTIONS;
     parse_rts_environment(g);
+    if (nproc > 0)
+        g->options.nproc = nproc;
 
     unsigned active_size = g->options.nproc;
     CILK_ASSERT(active_size > 0);
     g->nworkers = active_size;
-    __cilkrts_nproc = active_size;
 
     g->workers_started = false;
     g->root_closure_initialized = false;
     atomic_store_explicit(&g->done, 0, memory_order_relaxed);
     atomic_store_explicit(&g->cilkified, 0, memory_order_relaxed);
     atomic_store_explicit(&g->disengaged_sentinel, 0, memory_order_relaxed);
+    atomic_store_explicit(&g->engaged_cap, active_size, memory_order_relaxed);
+    atomic_store_explicit(&g->next_cpu_sample, 0, memory_order_relaxed);
 
     g->terminate = false;
 
@@ -187,6 +510,26 @@ global_state *global_state_init(int argc, char *argv[]) {
     cilk_fiber_pool_global_init(g);
     cilk_global_sched_stats_init(&(g->stats));
 
+    if (g->options.steal_hierarchy || g->options.targeted_wake ||
+        g->options.pin != PIN_NONE)
+        g->topology = cilk_topology_init(active_size, g->options.pin,
+                                         g->pin_cpus, g->pin_ncpus, NULL, 0);
+    if (g->options.steal_summary) {
+        // Pack the summary into as few cache lines as possible.
+        unsigned int words = (active_size + 63) / 64;
+        size_t size = round_size_to_alignment(CILK_CACHE_LINE,
+                                              words * sizeof(uint64_t));
+        g->steal_summary = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+        memset((void *)g->steal_summary, 0, size);
+        g->steal_summary_words = words;
+    }
+    if (g->options.targeted_wake) {
+        size_t size = active_size * sizeof(struct wake_slot);
+        g->wake_slots = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+        memset((void *)g->wake_slots, 0, size);
+    }
+    init_core_classes(g);
+
     return g;
 }
 
@@ -18,9 +18,12 @@
 #include "worker.h"
 
 extern unsigned __cilkrts_nproc;
+extern unsigned __cilkrts_narenas;
 
 struct __cilkrts_worker;
 struct Closure;
+struct cilk_topology;
+struct cpu_limits;
 
 // clang-format off
 #define DEFAULT_OPTIONS                                            \
@@ -28,27 +31,138 @@ struct Closure;
         DEFAULT_STACK_SIZE,     /* stack size to use for fiber */  \
         DEFAULT_NPROC,          /* num of workers to create */     \
         DEFAULT_DEQ_DEPTH,      /* num of entries in deque */      \
-        DEFAULT_FIBER_POOL_CAP  /* alloc_batch_size */             \
+        DEFAULT_FIBER_POOL_CAP, /* alloc_batch_size */             \
+        0,                      /* hierarchical victim selection */ \
+        DEFAULT_STEAL_ESCALATE, /* failed steals before escalating */ \
+        0,                      /* stealable-work summary */       \
+        1,                      /* frames taken per steal */       \
+        0,                      /* steal back at failed syncs */   \
+        0,                      /* per-worker wake slots */        \
+        0,                      /* tree wakeup fanout, 0 = all */  \
+        0,                      /* adapt engaged workers to load */ \
+        0,                      /* worker pinning policy, PIN_NONE */ \
+        0,                      /* fibers per worker to warm up */ \
+        FIBER_ARENA_REGION_STACKS, /* fiber stacks per arena region */ \
+        0,                      /* trim idle fiber stacks */       \
+        0,                      /* shrink fiber pools when idle */ \
+        0,                      /* take fibers from sibling pools */ \
+        1,                      /* fiber stack classes */          \
+        {DEFAULT_STACK_SIZE},   /* stack size of each class */     \
+        0,                      /* profile fiber stack use */      \
+        0                       /* handle fiber stack overflows */ \
     }
 // clang-format on
 
 struct rts_options {
     size_t stacksize;            /* can be set via env variable CILK_STACKSIZE */
-    unsigned int nproc;          /* can be set via env variable CILK_NWORKERS */
-    unsigned int deqdepth;       /* can be set via env variable CILK_DEQDEPTH */
+    unsigned int nproc;          /* can be set via env variable CILK_NWORKERS;
+                                    grows with __cilkrts_set_nworkers */
+    unsigned int deqdepth;       /* can be set via env variable CILK_DEQDEPTH;
+                                    minimum shadow stack reservation */
     unsigned int fiber_pool_cap; /* can be set via env variable CILK_FIBER_POOL */
+    unsigned int steal_hierarchy; /* can be set via env variable CILK_STEAL_HIERARCHY */
+    unsigned int steal_escalate; /* can be set via env variable CILK_STEAL_ESCALATE */
+    unsigned int steal_summary; /* can be set via env variable CILK_STEAL_SUMMARY */
+    unsigned int steal_batch;   /* can be set via env variable CILK_STEAL_BATCH */
+    unsigned int leapfrog;      /* can be set via env variable CILK_LEAPFROG */
+    unsigned int targeted_wake; /* can be set via env variable CILK_TARGETED_WAKE */
+    unsigned int wake_fanout;   /* can be set via env variable CILK_WAKE_FANOUT */
+    unsigned int adapt_nworkers; /* can be set via env variable CILK_ADAPT_NWORKERS */
+    unsigned int pin;           /* enum pin_policy; can be set via env
+                                   variable CILK_PIN */
+    unsigned int warmup;        /* can be set via env variable CILK_WARMUP */
+    unsigned int fiber_arena;   /* can be set via env variable CILK_FIBER_ARENA;
+                                   0 maps fiber stacks one by one */
+    unsigned int fiber_trim;    /* can be set via env variable CILK_FIBER_TRIM */
+    unsigned int fiber_pool_shrink; /* can be set via env variable
+                                       CILK_FIBER_POOL_SHRINK */
+    unsigned int fiber_rebalance; /* can be set via env variable
+                                     CILK_FIBER_REBALANCE */
+    unsigned int nstack_classes; /* can be set via env variable
+                                    CILK_STACK_CLASSES */
+    size_t stack_class_size[STACK_CLASS_MAX]; /* class 0 is stacksize */
+    unsigned int stack_profile; /* can be set via env variable
+                                   CILK_STACK_PROFILE */
+    unsigned int overflow_handler; /* can be set via env variable
+                                      CILK_OVERFLOW_HANDLER */
 };
 
+// Tuning parameters of the work-stealing loop and of worker sleep, selected as
+// a profile by CILK_SCHED_PROFILE or __cilkrts_set_sched_profile.
+#define NUM_SCHED_PROFILES 3
+struct sched_tuning {
+    uint32_t nap_nsec;    /* nap of a sentinel that does not disengage */
+    uint32_t sleep_nsec;  /* sleep after many consecutive failed steals */
+    uint32_t as_ratio;    /* target ratio of active workers to sentinels */
+    uint32_t history_threshold; /* samples to reengage/disengage workers */
+    uint32_t busy_loop_spin;    /* spins before waiting on a futex */
+    uint32_t idle_spin_nsec;    /* longest spin between cilkified regions */
+    uint32_t steal_delay_pct;   /* delay between rounds of steal attempts,
+                                   in percent of the built-in delay */
+    bool self_tune; /* adapt the steal delay to the steal success rate */
+};
+
+// Scale of the steal delay, in 1/256ths, limited by self-tuning to this range
+// around the scale set by the profile.
+#define STEAL_DELAY_SCALE_ONE 256
+#define STEAL_DELAY_SCALE_RANGE 4
+// Average work per successful steal, in gettime_fast ticks (cycles on x86-64),
+// below which self-tuning considers the steals to find little work.  It is the
+// unit of work that get_scaled_elapsed trades for SENTINEL_THRESHOLD failed
+// steal attempts.
+#define STEAL_DELAY_SMALL_WORK 65536
+
+// Slot on which a thief that disengages inside the work-stealing loop waits,
+// when targeted wakeup is enabled.  See worker_coord.h.
+struct wake_slot {
+    _Atomic uint32_t state;
+} __attribute__((aligned(CILK_CACHE_LINE)));
+
 struct worker_args {
     worker_id id;
     global_state *g;
 };
 
+// Root of a cilkified region started by an application thread while the boss
+// role (worker 0) belongs to another thread.  The workers pick up the root
+// closure from g->guest_roots, and the thread waits on done until a worker
+// finishes the region.
+//
+// A task submitted with __cilkrts_submit is a guest region with no thread
+// behind it: fn is not NULL, and the region is rooted at task_frame, which
+// the workers enter through task_root_run.  A detached task has no handle,
+// so the worker that finishes it recycles the root.
+struct guest_root {
+    struct Closure *closure;
+    struct __cilkrts_stack_frame *sf;
+    void *orig_rsp;
+    bool pending; /* not yet picked up by a worker */
+    bool detached;
+    _Atomic uint32_t done;
+    global_state *g;
+    void (*fn)(void *);
+    void *arg;
+    struct __cilkrts_stack_frame task_frame;
+    struct guest_root *next;
+};
+
 struct global_state {
     /* globally-visible options (read-only after init) */
     struct rts_options options;
+    /* scheduler tuning, one set per profile (read-only after init) */
+    struct sched_tuning tunings[NUM_SCHED_PROFILES];
+    /* the set in use; read it through sched_tuning() */
+    _Atomic(const struct sched_tuning *) tuning;
+
+    // Set for a runtime instance created by __cilkrts_arena_create, rather
+    // than the default one.  An arena's worker threads run only on the
+    // arena_ncpus CPUs in arena_cpus, if there are any.
+    bool arena;
+    unsigned int arena_ncpus;
+    unsigned int *arena_cpus;
 
-    unsigned int nworkers; /* size of next 4 arrays */
+    unsigned int nworkers; /* number of workers in use; the next 4 arrays
+                              have options.nproc entries */
     struct worker_args *worker_args;
     struct __cilkrts_worker **workers;
     /* dynamically-allocated array of deques, one per processor */
@@ -57,6 +171,13 @@ struct global_state {
     struct Closure *root_closure;
 
     struct cilk_fiber_pool fiber_pool __attribute__((aligned(CILK_CACHE_LINE)));
+    struct fiber_arena fiber_arena __attribute__((aligned(CILK_CACHE_LINE)));
+    // Pools and arenas of the fiber stack classes above 0, with
+    // options.nstack_classes - 1 entries, or NULL if there is only one class.
+    struct fiber_class *fiber_classes;
+    // Smallest stack class of the root fibers of new cilkified regions,
+    // raised by overflows of fiber stacks.
+    _Atomic uint32_t stack_class_floor;
     struct global_im_pool im_pool __attribute__((aligned(CILK_CACHE_LINE)));
     struct cilk_im_desc im_desc __attribute__((aligned(CILK_CACHE_LINE)));
     cilk_mutex im_lock; // lock for accessing global im_desc
@@ -66,6 +187,43 @@ struct global_state {
     jmpbuf boss_ctx __attribute__((aligned(CILK_CACHE_LINE)));
     void *orig_rsp;
     bool workers_started;
+    bool boss_initialized;
+
+    // Reducer views and extension of the boss's region, left by the worker
+    // that finished it for the boss thread to pick up.
+    struct local_hyper_table *exit_hyper_table;
+    void *exit_extension;
+
+    // Fibers that each worker thread puts in its pool, with the top of their
+    // stacks faulted in, when it starts, as asked by __cilkrts_warmup.
+    // warmed_up counts the worker threads that have done so.
+    unsigned int warmup_fibers;
+    _Atomic uint32_t warmed_up;
+
+    // Number of worker threads whose pthread_t is stored in threads.  Worker
+    // threads create each other, so the boss waits for all of them before it
+    // joins them.
+    _Atomic uint32_t threads_created;
+
+    // Worker threads, with ids 1 through nthreads, that the boss has started
+    // and that wait out resizes of the worker pool, if they are surplus, until
+    // the pool grows again or the workers stop.  While the boss resizes the
+    // pool, it sets resizing and waits on resize_cond_var until all
+    // threads_paused of these threads wait there, under resize_lock.
+    unsigned int nthreads;
+    unsigned int threads_paused;
+    _Atomic uint32_t resizing;
+    pthread_mutex_t resize_lock;
+    pthread_cond_t resize_cond_var;
+
+    // Number of workers to use from the next cilkified region on, as set by
+    // __cilkrts_set_nworkers, or 0 if unchanged.
+    _Atomic uint32_t pending_nworkers;
+
+    // One more than the index of the scheduling profile to use from the next
+    // cilkified region on, as set by __cilkrts_set_sched_profile, or 0 if
+    // unchanged.
+    _Atomic uint32_t pending_profile;
 
     // These fields are shared between the boss thread and a couple workers.
 
@@ -75,9 +233,43 @@ struct global_state {
     // optimization would improve performance.
     _Atomic uint32_t cilkified_futex __attribute__((aligned(CILK_CACHE_LINE)));
     atomic_bool cilkified;
+    // Set while the boss sleeps on cilkified_futex, so that the worker that
+    // ends the region can skip the futex wake otherwise.
+    _Atomic uint32_t cilkified_sleeping;
 
     pthread_mutex_t cilkified_lock;
     pthread_cond_t cilkified_cond_var;
+    pthread_cond_t guest_done_cond_var; /* signals the ends of guest regions */
+
+    // Concurrent cilkified regions.  The first thread to cilkify takes the
+    // boss role and runs its region on worker 0; threads that cilkify while
+    // the boss role is taken start guest regions.  The workers keep stealing
+    // until the last active region is done.  Protected by roots_lock, except
+    // that pending_roots is read without it.  The boss sets workers_changing
+    // while it starts or resizes the workers without holding roots_lock.
+    // roots_cond_var signals that the boss role is free, that the workers
+    // are ready, or that the last active region is done.
+    pthread_mutex_t roots_lock;
+    pthread_cond_t roots_cond_var;
+    unsigned int active_regions;
+    bool boss_active;
+    bool workers_changing;
+    struct guest_root *guest_roots; /* active guest regions */
+    struct guest_root *free_roots;
+    _Atomic uint32_t pending_roots;
+    // Strands parked on a __cilkrts_mutex that were handed the mutex, in the
+    // order they are to resume.  Protected by ready_waiters_lock, except that
+    // pending_waiters is read without it.
+    pthread_mutex_t ready_waiters_lock;
+    struct __cilkrts_mutex_waiter *ready_waiters;
+    struct __cilkrts_mutex_waiter *ready_waiters_tail;
+    _Atomic uint32_t pending_waiters;
+    // Time at which the last active region ended, and the moving average of
+    // the gap from there to the start of the next region, in nanoseconds.
+    // Thieves spin through gaps like this one.  Updated only if
+    // tuning.idle_spin_nsec is nonzero.
+    _Atomic uint64_t region_end_nsec;
+    _Atomic uint64_t region_gap_nsec;
 
     // These fields are shared among all workers in the work-stealing loop.
 
@@ -89,6 +281,29 @@ struct global_state {
     worker_id *worker_to_index;
     cilk_mutex index_lock;
 
+    // Machine topology, per-worker placement and steal peers, used for
+    // hierarchical victim selection, targeted wakeup and worker pinning.
+    // NULL if none of these is enabled.
+    struct cilk_topology *topology;
+    // The CPUs listed in CILK_PIN, for the PIN_LIST policy.
+    unsigned int pin_ncpus;
+    unsigned int *pin_cpus;
+
+    // Summary of which workers may have stealable work, one bit per worker.
+    // A worker sets its bit when it adds a closure to its empty ready deque,
+    // and a thief clears the bit when it finds that deque empty.  Both happen
+    // under the deque lock, so a worker whose deque holds a closure, and thus
+    // any frames, always has its bit set.  NULL if disabled.
+    _Atomic uint64_t *steal_summary;
+    unsigned int steal_summary_words;
+
+    // On a hybrid machine, the CPUs of the slower class, as a bitmap of
+    // SLOW_CPU_BITS bits, and which workers run on them, one bit per worker,
+    // as last seen by each worker.  NULL if all CPUs are of one class.
+    uint64_t *slow_cpus;
+    _Atomic uint64_t *slow_workers;
+    unsigned int slow_workers_words;
+
     // Count of number of disengaged and sentinel workers.  Upper 32 bits count
     // the disengaged workers.  Lower 32 bits count the sentinel workers.  These
     // two counts are stored in a single word to make it easier to update both
@@ -98,7 +313,26 @@ struct global_state {
 #define GET_SENTINEL(D) ((D) & 0xffffffff)
 #define DISENGAGED_SENTINEL(A, B) (((uint64_t)(A) << 32) | (uint32_t)(B))
 
+    // Current scale of the steal delay, set by the profile and adjusted by
+    // self-tuning.
+    _Atomic uint32_t steal_delay_scale __attribute__((aligned(CILK_CACHE_LINE)));
+
+    // Cap on the number of active and sentinel workers, which sentinels
+    // lower when the cgroup is throttled or other processes load the CPUs, and
+    // the time of the next sample of that load.  Used only if
+    // CILK_ADAPT_NWORKERS is set, in which case cpu_limits is non-NULL.
+    _Atomic uint32_t engaged_cap __attribute__((aligned(CILK_CACHE_LINE)));
+    _Atomic uint64_t next_cpu_sample;
+    struct cpu_limits *cpu_limits;
+
     _Atomic uint32_t disengaged_thieves_futex __attribute__((aligned(CILK_CACHE_LINE)));
+    // Number of thieves sleeping on disengaged_thieves_futex.  Waking the
+    // thieves for a new region needs no syscall while it is 0.
+    _Atomic uint32_t disengaged_sleepers;
+
+    // Per-worker wake slots, which let a worker that finds work wake specific
+    // disengaged thieves near it.  NULL if targeted wakeup is disabled.
+    struct wake_slot *wake_slots;
 
     pthread_mutex_t disengaged_lock;
     pthread_cond_t disengaged_cond_var;
@@ -122,7 +356,10 @@ CHEETAH_INTERNAL extern __cilkrts_worker default_worker;
 CHEETAH_INTERNAL
 __cilkrts_worker *__cilkrts_init_tls_worker(worker_id i, global_state *g);
 CHEETAH_INTERNAL void set_nworkers(global_state *g, unsigned int nworkers);
-CHEETAH_INTERNAL global_state *global_state_init(int argc, char *argv[]);
+CHEETAH_INTERNAL int find_sched_profile(const char *name);
+CHEETAH_INTERNAL void apply_sched_profile(global_state *g, unsigned int i);
+CHEETAH_INTERNAL global_state *global_state_init(int argc, char *argv[],
+                                                 unsigned int nproc);
 CHEETAH_INTERNAL void for_each_worker(global_state *,
                                       void (*)(__cilkrts_worker *, void *),
                                       void *data);
@@ -143,4 +380,10 @@ inline static bool worker_is_valid(const __cilkrts_worker *w,
     return w != &g->dummy_worker;
 }
 
+// The scheduling tuning in use.  The boss may switch it to another profile at
+// the start of a region while workers run, so load it once per decision.
+inline static const struct sched_tuning *sched_tuning(global_state *g) {
+    return atomic_load_explicit(&g->tuning, memory_order_acquire);
+}
+
 #endif /* _CILK_GLOBAL_H */
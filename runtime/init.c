@@ -3,6 +3,7 @@
 #include <stdatomic.h>
 #endif
 #include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -12,6 +13,7 @@
 #endif
 #include <stdlib.h>
 #include <string.h> /* strerror */
+#include <sys/mman.h>
 #ifdef __linux__
 #include <sys/sysinfo.h>
 #endif
@@ -21,7 +23,9 @@
 #include <unistd.h>
 
 #include "cilk-internal.h"
+#include "cpu_limits.h"
 #include "debug.h"
+#include "fiber-header.h"
 #include "fiber.h"
 #include "global.h"
 #include "init.h"
@@ -29,6 +33,7 @@
 #include "readydeque.h"
 #include "sched_stats.h"
 #include "scheduler.h"
+#include "topology.h"
 #include "worker_coord.h"
 
 #if defined __FreeBSD__ && __FreeBSD__ < 13
@@ -37,9 +42,56 @@ typedef cpuset_t cpu_set_t;
 
 extern local_state default_worker_local_state;
 
-static local_state *worker_local_init(local_state *l, global_state *g) {
-    l->shadow_stack = (__cilkrts_stack_frame **)calloc(
-        g->options.deqdepth, sizeof(struct __cilkrts_stack_frame *));
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+// Reserve the shadow stack of a worker in virtual memory, followed by an
+// inaccessible guard page.  The kernel commits pages of the reservation as the
+// worker's spawn chains first reach them, so a deep chain no longer requires a
+// large CILK_DEQDEPTH on every worker, and an overflow faults on the guard page
+// instead of corrupting memory.
+static void shadow_stack_reserve(local_state *l, global_state *g) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    size_t depth = g->options.deqdepth;
+    if (depth < SHADOW_STACK_RESERVE_DEPTH)
+        depth = SHADOW_STACK_RESERVE_DEPTH;
+    size_t bytes = depth * sizeof(struct __cilkrts_stack_frame *);
+    bytes = (bytes + page_size - 1) & ~(page_size - 1);
+
+    char *mem = mmap(NULL, bytes + page_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == mem)
+        cilkrts_bug("Cilk: shadow stack mmap failed");
+    if (mprotect(mem + bytes, page_size, PROT_NONE) < 0)
+        cilkrts_bug("Cilk: shadow stack guard page mprotect failed");
+
+    l->shadow_stack = (__cilkrts_stack_frame **)mem;
+    l->shadow_stack_depth = bytes / sizeof(struct __cilkrts_stack_frame *);
+}
+
+static void shadow_stack_release(local_state *l) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    size_t bytes = l->shadow_stack_depth * sizeof(struct __cilkrts_stack_frame *);
+    if (munmap(l->shadow_stack, bytes + page_size) < 0)
+        cilkrts_bug("Cilk: shadow stack munmap failed");
+    l->shadow_stack = NULL;
+    l->shadow_stack_depth = 0;
+}
+
+// Fault in the base of the shadow stack, where spawn chains start.
+static void shadow_stack_prefault(local_state *l) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    volatile char *mem = (volatile char *)l->shadow_stack;
+    size_t bytes =
+        l->shadow_stack_depth * sizeof(struct __cilkrts_stack_frame *);
+    if (bytes > WARMUP_PREFAULT_BYTES)
+        bytes = WARMUP_PREFAULT_BYTES;
+    for (size_t off = 0; off < bytes; off += page_size)
+        mem[off] = mem[off];
+}
+
+static void worker_local_reset(local_state *l) {
     for (int i = 0; i < JMPBUF_SIZE; i++) {
         l->rts_ctx[i] = NULL;
     }
@@ -47,8 +99,16 @@ static local_state *worker_local_init(local_state *l, global_state *g) {
     l->provably_good_steal = false;
     l->exiting = false;
     l->returning = false;
+    l->parked = false;
+    l->start_task = false;
     l->rand_next = 0; /* will be reset in scheduler loop */
     l->wake_val = 0;
+    l->leapfrog_count = 0;
+}
+
+static local_state *worker_local_init(local_state *l, global_state *g) {
+    shadow_stack_reserve(l, g);
+    worker_local_reset(l);
     cilk_sched_stats_init(&(l->stats));
 
     return l;
@@ -60,18 +120,45 @@ static void worker_local_destroy(local_state *l, global_state *g) {
     /* currently nothing to do here */
 }
 
-static void deques_init(global_state *g) {
+// A worker and its local state share a mapping of fresh pages, rather than
+// memory from malloc that another thread may have touched, so that the pages
+// are placed on the NUMA node of the worker thread that first writes them.
+#define WORKER_LOCAL_OFFSET                                                    \
+    round_size_to_alignment(2 * __alignof__(__cilkrts_worker),                 \
+                            sizeof(__cilkrts_worker))
+
+static size_t worker_mem_size(void) {
+    const size_t page_size = (size_t)1 << cheetah_page_shift;
+    size_t bytes = WORKER_LOCAL_OFFSET + sizeof(local_state);
+    return (bytes + page_size - 1) & ~(page_size - 1);
+}
+
+static void *worker_mem_alloc(void) {
+    void *mem = mmap(NULL, worker_mem_size(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mem)
+        cilkrts_bug("Cilk: worker mmap failed");
+    return mem;
+}
+
+static void worker_mem_free(void *mem) {
+    if (munmap(mem, worker_mem_size()) < 0)
+        cilkrts_bug("Cilk: worker munmap failed");
+}
+
+static void deques_init(global_state *g, unsigned int start) {
     cilkrts_alert(BOOT, "(deques_init) Initializing deques");
-    for (unsigned int i = 0; i < g->options.nproc; i++) {
+    for (unsigned int i = start; i < g->options.nproc; i++) {
         g->deques[i].top = NULL;
         g->deques[i].bottom = NULL;
+        g->deques[i].num_ready = 0;
         g->deques[i].mutex_owner = NO_WORKER;
     }
 }
 
-static void workers_init(global_state *g) {
+static void workers_init(global_state *g, unsigned int start) {
     cilkrts_alert(BOOT, "(workers_init) Initializing workers");
-    for (unsigned int i = 0; i < g->options.nproc; i++) {
+    for (unsigned int i = start; i < g->options.nproc; i++) {
         if (i == 0) {
             // Initialize worker 0, so we always have a worker structure to fall
             // back on.
@@ -96,21 +183,24 @@ static void workers_init(global_state *g) {
 __cilkrts_worker *__cilkrts_init_tls_worker(worker_id i, global_state *g) {
     cilkrts_alert(BOOT, "(workers_init) Initializing worker %u", i);
     __cilkrts_worker *w;
-    if (i == 0) {
-        // Use default_worker structure for worker 0.
+    bool reused = false;
+    if (i == 0 && !g->arena) {
+        // Use default_worker structure for worker 0 of the default runtime.
         w = &default_worker;
         *(struct local_state **)(&w->l) =
             worker_local_init(&default_worker_local_state, g);
         __cilkrts_set_tls_worker(w);
+    } else if (g->workers[i] && worker_is_valid(g->workers[i], g)) {
+        // Reuse the structure of a worker parked by a resize of the worker
+        // pool, which keeps its statistics and internal-malloc accounting.
+        w = g->workers[i];
+        worker_local_reset(w->l);
+        reused = true;
     } else {
-        size_t alignment = 2 * __alignof__(__cilkrts_worker);
-        void *mem = cilk_aligned_alloc(
-            alignment,
-            round_size_to_alignment(alignment, sizeof(__cilkrts_worker) +
-                                                   sizeof(local_state)));
+        char *mem = worker_mem_alloc();
         w = (__cilkrts_worker *)mem;
         *(struct local_state **)(&w->l) =
-            worker_local_init(mem + sizeof(__cilkrts_worker), g);
+            worker_local_init((local_state *)(mem + WORKER_LOCAL_OFFSET), g);
     }
     *(worker_id *)(&w->self) = i;
     w->extension = NULL;
@@ -118,110 +208,80 @@ __cilkrts_worker *__cilkrts_init_tls_worker(worker_id i, global_state *g) {
     *(struct global_state **)(&w->g) = g;
 
     *(struct __cilkrts_stack_frame ***)(&w->ltq_limit) =
-        w->l->shadow_stack + g->options.deqdepth;
+        w->l->shadow_stack + w->l->shadow_stack_depth;
+    // Other workers may look into the fiber pool of a worker they can see.
+    if (!reused)
+        cilk_fiber_pool_per_worker_zero_init(w);
     g->workers[i] = w;
     __cilkrts_stack_frame **init = w->l->shadow_stack + 1;
     atomic_store_explicit(&w->tail, init, memory_order_relaxed);
     atomic_store_explicit(&w->head, init, memory_order_relaxed);
     atomic_store_explicit(&w->exc, init, memory_order_relaxed);
-    if (i != 0) {
+    if (w != &default_worker) {
         w->hyper_table = NULL;
     }
-    // initialize internal malloc first
-    cilk_internal_malloc_per_worker_init(w);
-    // zero-initialize the worker's fiber pool.
-    cilk_fiber_pool_per_worker_zero_init(w);
+    if (!reused) {
+        // initialize internal malloc
+        cilk_internal_malloc_per_worker_init(w);
+    }
 
     return w;
 }
 
-#if ENABLE_WORKER_PINNING
+// Restrict the threads created with attr to the CPUs of the arena of g.
+// Threads they create inherit the restriction.
+static void arena_bind_attr(global_state *g, pthread_attr_t *attr) {
 #ifdef CPU_SETSIZE
-
-/**
- * Move the <code>cpu<\code> bit from the <code>cpu_set_t<\code>
- * <code>from<\code> to the <code>cpu_set_t<\code> <code>to<\code>, iff the bit
- * is set in <code>from<\code>.
- *
- * @param cpu  the id of the cpu to move
- * @param to   the set to move the cpu into
- * @param from the set to move the cpu out of
- */
-static void move_bit(int cpu, cpu_set_t *to, cpu_set_t *from) {
-    if (CPU_ISSET(cpu, from)) {
-        CPU_CLR(cpu, from);
-        CPU_SET(cpu, to);
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (unsigned int i = 0; i < g->arena_ncpus; ++i) {
+        if (g->arena_cpus[i] < CPU_SETSIZE)
+            CPU_SET(g->arena_cpus[i], &mask);
     }
+    int err = pthread_attr_setaffinity_np(attr, sizeof(mask), &mask);
+    if (err != 0)
+        cilkrts_alert(BOOT, "(arena_bind_attr) cannot bind to CPUs: %s",
+                      strerror(err));
+#else
+    (void)g;
+    (void)attr;
+#endif
 }
 
-/**
- * Fill in the passed in <code>worker_mask<\code> to contain all the cpus in
- * the next group of cpus, as defined by <code>group_size<\code>,
- * <code>step_in<\code>, and <code>step_out<\code>. The
- * <code>unassigned_mask<\code> is cleared of these bits to avoid reusing cpus
- * for different workers.
- *
- * @param worker_mask     (output) the processor mask that will store the set
- *                        of all cpu ids to assigne to worker <code>w_id<\code>
- * @param w_id            the id of the worker that will be pinned using the
- *                        <code>worker_mask<\code> (used for debug messages)
- * @param cpu_start       the cpu id from which to start searching in the
- *                        <code>unassigned_mask<\code> for an available cpu
- * @param unassigned_mask the set of cores in the process that are unassigned
- *                        to any workers
- * @param group_size      the number of cpus to allow <code>w_id<\code> to use
- * @param step_in         the offset between cpus in the same group
- * @param step_out        the offset between the start of one group and the
- *                        next
- * @param available_cores the total number of cores available to the process
- *                        (used for debug messages)
- *
- * @return                the first possible cpu id for the next group (not
- *                        guaranteed to be available in the
- *                        <code>unassigned_mask<\code>)
- */
-static inline int fill_worker_mask_and_get_next_cpu(
-    cpu_set_t *const worker_mask, int const w_id, int const cpu_start,
-    cpu_set_t *const unassigned_mask, int const group_size, int const step_in,
-    int const step_out, int const available_cores) {
-    int cpu = cpu_start;
-
-    while (!CPU_ISSET(cpu, unassigned_mask)) {
-        ++cpu;
-    }
-
-    CPU_CLR(cpu, unassigned_mask);
-
-    CPU_ZERO(worker_mask);
-    CPU_SET(cpu, worker_mask);
-    for (int off = 1; off < group_size; ++off) {
-        move_bit(cpu + off * step_in, worker_mask, unassigned_mask);
-        cilkrts_alert(BOOT, NULL, "Bind worker %u to core %d of %d", w_id,
-                      cpu + off * step_in, available_cores);
-    }
-    cpu += step_out;
-
-    return cpu;
+void *init_threads_and_enter_scheduler(void *args);
+
+// Create the thread of worker w.
+static void create_worker_thread(global_state *g, worker_id w) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (g->arena_ncpus > 0)
+        arena_bind_attr(g, &attr);
+    int status = pthread_create(&g->threads[w], &attr,
+                                init_threads_and_enter_scheduler,
+                                &g->worker_args[w]);
+    pthread_attr_destroy(&attr);
+    if (status != 0)
+        cilkrts_bug("Cilk: thread creation (%u) failed: %s", w,
+                    strerror(status));
+    atomic_fetch_add_explicit(&g->threads_created, 1, memory_order_release);
 }
 
-/**
- * Pins the passed in thread to the set of cpus in the <code>worker_mask<\code>.
- *
- * @param thread_id   the id of the thread that should be pinned
- * @param worker_mask the set of cpus to which the thread should be pinned
- */
-static inline void pin_thread(pthread_t const thread_id,
-                              cpu_set_t *const worker_mask) {
-    int const err =
-        pthread_setaffinity_np(thread_id, sizeof(*worker_mask), worker_mask);
-    CILK_ASSERT_G(err == 0);
+// Return the worker whose thread creates the thread of worker w in the tree
+// of worker threads, or 0 for the boss.
+static inline worker_id startup_parent(worker_id w) {
+    return w < 2 ? 0 : (w - 2) / STARTUP_FANOUT + 1;
 }
-#endif
-#endif // ENABLE_WORKER_PINNING
 
 /**
- * Initializes all other threads in the runtime, and then enters the
- * scheduling loop.
+ * Creates this worker's children in the tree of worker threads, and then
+ * enters the scheduling loop.  Worker 1 is the root of the tree, and the
+ * children of worker w are workers (w - 1) * STARTUP_FANOUT + 2 through
+ * w * STARTUP_FANOUT + 1, so that startup takes a logarithmic number of
+ * rounds of thread creation.  When the worker pool grows, the boss creates
+ * the threads of the new workers whose parents already run, and the rest
+ * come from their new parents as before.  Each worker thread pins itself
+ * before scheduler_thread_proc allocates its worker structures, so that
+ * their pages are first touched on the worker's NUMA node.
  *
  * @param args the arguments to be used by this worker in
  *             <code>scheduler_thread_proc<\code>
@@ -231,175 +291,86 @@ static inline void pin_thread(pthread_t const thread_id,
 void *init_threads_and_enter_scheduler(void *args) {
     struct worker_args *w_arg = (struct worker_args *)args;
     struct global_state *g = w_arg->g;
+    worker_id self = w_arg->id;
 
-    int const worker_start = 2;
-
-    /* TODO: Mac OS has a better interface allowing the application
-       to request that two threads run as far apart as possible by
-       giving them distinct "affinity tags". */
-#if ENABLE_WORKER_PINNING
-#ifdef CPU_SETSIZE
-    int const my_id = worker_start - 1;
-
-    // Affinity setting, from cilkplus-rts
-    cpu_set_t process_mask;
-    int available_cores = 0;
-    // Get the mask from the parent thread (master thread)
-    if (0 == pthread_getaffinity_np(pthread_self(), sizeof(process_mask),
-                                    &process_mask)) {
-        available_cores = CPU_COUNT(&process_mask);
-    }
-
-    /* pin_strategy controls how threads are spread over cpu numbers.
-       Based on very limited testing FreeBSD groups hyperthreads of a
-       core together (consecutive IDs) and Linux separates them.
-       This is not guaranteed and may not even be consistent.
-       The order is influenced by board firmware.
-       When sysfs is enabled, Linux offers
-       /sys/devices/system/cpu/cpu0/topology/core_siblings
-       which is in a format compatible with cpulist_parse().
-       FreeBSD exports sysctl kern.sched.topology_spec, an XML representation
-       of the processor topology. */
-    /* TODO: Fix pinning strategy to better utilize cpu architecture.  For
-       example, we probably do not want to pin a worker to cpus on different
-       NUMA nodes. */
-#ifdef __FreeBSD__
-    int pin_strategy = 1; /* (0, 1), (2, 3), ... */
-#else
-    int pin_strategy = 0; /* (0, N/2), (1, N/2 + 1), ... */
-#endif
-
-    switch (env_get_int("CILK_PIN")) {
-    case 1:
-        pin_strategy = 0;
-        break;
-    case 2:
-        pin_strategy = 1;
-        break;
-    case 3:
-        available_cores = 0;
-        break;
-    }
-#endif
-#endif // ENABLE_WORKER_PINNING
-    int n_threads = g->nworkers;
-    CILK_ASSERT(n_threads > 0);
+    // The boss sets nworkers before it creates any thread of the tree, and
+    // changes it again only once every thread waits for the resize.
+    unsigned int n_threads = g->nworkers;
+    CILK_ASSERT(n_threads > 1);
 
     /* TODO: Apple supports thread affinity using a different interface. */
 
-    cilkrts_alert(BOOT, "(threads_init) Setting up threads");
-
-#if ENABLE_WORKER_PINNING
-#ifdef CPU_SETSIZE
-    cpu_set_t my_worker_mask;
-
-    /* Three cases: core count at least twice worker count, allocate
-       groups of floor(worker count / core count) CPUs.
-       Core count greater than worker count, do not bind workers to CPUs.
-       Otherwise, bind workers to single CPUs. */
-    int cpu = 0;
-    int group_size = 1;
-    int step_in = 1, step_out = 1;
-
-    /* If cores are overallocated it doesn't make sense to pin threads. */
-    if (n_threads > available_cores) {
-        available_cores = 0;
-    } else {
-        group_size = available_cores / n_threads;
-        if (pin_strategy != 0) {
-            step_in = 1;
-            step_out = group_size;
-        } else {
-            step_out = 1;
-            step_in = n_threads;
-        }
-
-        // Get my CPU first, but don't pin yet; special OS permissions are
-        // required to pin a thread to a cpu not in the current thread's
-        // cpu affinity set
-        cpu = fill_worker_mask_and_get_next_cpu(
-            &my_worker_mask, my_id, cpu, &process_mask, group_size, step_in,
-            step_out, available_cores);
-    }
-#endif
-#endif // ENABLE_WORKER_PINNING
+    cilkrts_alert(BOOT, "(threads_init) Setting up threads of worker %u",
+                  self);
 
-    for (int w = worker_start; w < n_threads; w++) {
-        int status = pthread_create(&g->threads[w], NULL, scheduler_thread_proc,
-                                    &g->worker_args[w]);
+    unsigned int first_child = (self - 1) * STARTUP_FANOUT + 2;
+    for (unsigned int w = first_child;
+         w < first_child + STARTUP_FANOUT && w < n_threads; w++)
+        create_worker_thread(g, w);
 
-        if (status != 0) {
-            cilkrts_bug(NULL, "Cilk: thread creation (%u) failed: %s", w,
-                        strerror(status));
-        }
-
-#if ENABLE_WORKER_PINNING
-#ifdef CPU_SETSIZE
-        if (available_cores > 0) {
-            cpu_set_t worker_mask;
-            /* Skip to the next active CPU ID.  */
-            cpu = fill_worker_mask_and_get_next_cpu(
-                &worker_mask, w, cpu, &process_mask, group_size, step_in,
-                step_out, available_cores);
-            pin_thread(g->threads[w], &worker_mask);
-        }
-#endif
-#endif // ENABLE_WORKER_PINNING
-    }
-
-#if ENABLE_WORKER_PINNING
-#ifdef CPU_SETSIZE
-    if (available_cores > 0) {
-        pin_thread(g->threads[my_id], &my_worker_mask);
-    }
-#endif
-#endif
+    // Pin the workers as CILK_PIN asks.  The topology of an arena with a CPU
+    // list covers only those CPUs.  An arena without one would pin its workers
+    // to the CPUs of the default runtime's, so it does not pin.  Worker 0 runs
+    // on the thread that entered the runtime, which belongs to the
+    // application, so it keeps its affinity; its CPU is left free.  Pin this
+    // thread after creating its children, so that they do not inherit its
+    // single CPU.
+    if ((!g->arena || g->arena_ncpus > 0) && g->topology)
+        cilk_topology_pin_thread(g->topology, self, pthread_self());
 
     return scheduler_thread_proc(args);
 }
 
 static void threads_init(global_state *g) {
-    int const worker_start = 1;
-
+    atomic_store_explicit(&g->threads_created, 0, memory_order_relaxed);
+    g->nthreads = g->nworkers - 1;
     // Make sure we are supposed to create worker threads
-    if (worker_start < (int)g->nworkers) {
-        int status = pthread_create(&g->threads[worker_start], NULL,
-                                    init_threads_and_enter_scheduler,
-                                    &g->worker_args[worker_start]);
-
-        if (status != 0) {
-            cilkrts_bug(NULL, "Cilk: thread creation (%u) failed: %s",
-                        worker_start, strerror(status));
-        }
-    }
+    if (g->nworkers > 1)
+        create_worker_thread(g, 1);
 }
 
-global_state *__cilkrts_startup(int argc, char *argv[]) {
-    cilkrts_alert(BOOT, "(__cilkrts_startup) argc %d", argc);
-    global_state *g = global_state_init(argc, argv);
-    workers_init(g);
-    deques_init(g);
+// Create a runtime instance.  If nproc is nonzero, it sets the number of
+// workers instead of CILK_NWORKERS.
+static global_state *runtime_startup(int argc, char *argv[],
+                                     unsigned int nproc, bool arena) {
+    global_state *g = global_state_init(argc, argv, nproc);
+    g->arena = arena;
+    workers_init(g, 0);
+    deques_init(g, 0);
 
     // Create the root closure and a fiber to go with it.  Use worker 0 to
     // allocate the closure and fiber.
     __cilkrts_worker *w0 = g->workers[0];
     Closure *t = Closure_create(w0, NULL);
-    struct cilk_fiber *fiber = cilk_fiber_allocate(g->options.stacksize);
+    struct cilk_fiber *fiber =
+        cilk_fiber_allocate(&g->fiber_arena, g->options.stacksize);
     t->fiber = fiber;
+    t->is_root = true;
     g->root_closure = t;
 
     return g;
 }
 
+global_state *__cilkrts_startup(int argc, char *argv[]) {
+    cilkrts_alert(BOOT, "(__cilkrts_startup) argc %d", argc);
+    return runtime_startup(argc, argv, 0, false);
+}
+
+static void runtime_warmup(global_state *g, unsigned int nfibers);
+
 // Global constructor for starting up the default cilkrts.
 __attribute__((constructor)) void __default_cilkrts_startup() {
     default_cilkrts = __cilkrts_startup(0, NULL);
+    __cilkrts_nproc = default_cilkrts->nworkers;
 
     for (unsigned i = 0; i < cilkrts_callbacks.last_init; ++i)
         cilkrts_callbacks.init[i]();
 
     /* Any attempt to register more initializers should fail. */
     cilkrts_callbacks.after_init = true;
+
+    if (default_cilkrts->options.warmup > 0)
+        runtime_warmup(default_cilkrts, default_cilkrts->options.warmup);
 }
 
 void __cilkrts_internal_set_nworkers(unsigned int nworkers) {
@@ -413,6 +384,95 @@ static void __cilkrts_start_workers(global_state *g) {
     g->workers_started = true;
 }
 
+// Wait, with g->roots_lock held, while the boss starts or resizes the workers.
+static void wait_for_workers(global_state *g) {
+    while (g->workers_changing)
+        pthread_cond_wait(&g->roots_cond_var, &g->roots_lock);
+}
+
+// Fill the fiber pool of worker w and fault in its shadow stack, as asked by
+// __cilkrts_warmup.  Called by each worker thread as it starts.
+void worker_warmup(__cilkrts_worker *w) {
+    global_state *g = w->g;
+    cilk_fiber_pool_per_worker_warmup(w, g->warmup_fibers);
+    shadow_stack_prefault(w->l);
+    atomic_fetch_add_explicit(&g->warmed_up, 1, memory_order_release);
+}
+
+// Set up worker 0 of g for the boss thread, the first time a thread takes
+// the boss role.
+static void boss_init(global_state *g) {
+    if (g->boss_initialized)
+        return;
+    __cilkrts_worker *w0 = g->workers[0];
+    cilk_fiber_pool_per_worker_init(w0);
+    w0->l->rand_next = 162347;
+    if (USE_EXTENSION) {
+        g->root_closure->ext_fiber =
+            cilk_fiber_allocate(&g->fiber_arena, g->options.stacksize);
+    }
+    g->boss_initialized = true;
+}
+
+// Start the workers of g, if they have not started, and have each fill its
+// fiber pool with nfibers fibers whose stacks are faulted in, so that the
+// first cilkified region does not pay for thread creation and page faults.
+// Returns when the workers are warm.
+static void runtime_warmup(global_state *g, unsigned int nfibers) {
+    cilkrts_alert(BOOT, "(runtime_warmup) %u fibers per worker", nfibers);
+    // Within a cilkified region, worker 0 is in use.
+    bool in_region = !__cilkrts_need_to_cilkify;
+    pthread_mutex_lock(&g->roots_lock);
+    wait_for_workers(g);
+    g->warmup_fibers = nfibers;
+    bool start = !g->workers_started && g->nworkers > 1;
+    if (start) {
+        atomic_store_explicit(&g->warmed_up, 0, memory_order_relaxed);
+        __cilkrts_start_workers(g);
+    }
+    unsigned int nworkers = g->nworkers;
+    // Take the boss role, so that no region uses worker 0 while this thread
+    // fills its pool.  Regions that start meanwhile run as guests.
+    if (!in_region) {
+        while (g->boss_active)
+            pthread_cond_wait(&g->roots_cond_var, &g->roots_lock);
+        g->boss_active = true;
+    }
+    pthread_mutex_unlock(&g->roots_lock);
+
+    // Workers that start now fill their own pools.  Workers that were already
+    // running take fibers from the global pool as they run out.
+    if (!start)
+        cilk_fiber_pool_global_warmup(g, nfibers * (nworkers - !in_region));
+    if (!in_region) {
+        __cilkrts_worker *w0 = g->workers[0];
+        boss_init(g);
+        cilk_fiber_pool_per_worker_warmup(w0, nfibers);
+        shadow_stack_prefault(w0->l);
+        pthread_mutex_lock(&g->roots_lock);
+        g->boss_active = false;
+        pthread_cond_broadcast(&g->roots_cond_var);
+        pthread_mutex_unlock(&g->roots_lock);
+    }
+
+    // Workers only warm up, and count themselves as warm, if there are
+    // fibers to fault in.
+    if (start && nfibers > 0) {
+        while (atomic_load_explicit(&g->warmed_up, memory_order_acquire) <
+               nworkers - 1)
+            sched_yield();
+    }
+}
+
+int __cilkrts_warmup(unsigned nfibers) {
+    __cilkrts_worker *w = __cilkrts_get_tls_worker();
+    global_state *g = w ? w->g : default_cilkrts;
+    if (!g || nfibers > 999999)
+        return -1;
+    runtime_warmup(g, nfibers);
+    return 0;
+}
+
 // Stop the Cilk workers in g, for example, by joining their underlying
 // Pthreads.
 static void __cilkrts_stop_workers(global_state *g) {
@@ -428,19 +488,203 @@ static void __cilkrts_stop_workers(global_state *g) {
     // terminate all thieves, whether they're disengaged inside or outside the
     // work-stealing loop.
     wake_all_disengaged(g);
-
-    // Join the worker pthreads
-    unsigned int worker_start = 1;
-    for (unsigned int i = worker_start; i < g->nworkers; i++) {
+    // Also release the threads of surplus workers from worker_wait_resize.
+    pthread_mutex_lock(&g->resize_lock);
+    pthread_cond_broadcast(&g->resize_cond_var);
+    pthread_mutex_unlock(&g->resize_lock);
+
+    // Join the worker pthreads, once they all exist.
+    while (atomic_load_explicit(&g->threads_created, memory_order_acquire) <
+           g->nthreads)
+        sched_yield();
+    for (unsigned int i = 1; i <= g->nthreads; i++) {
         int status = pthread_join(g->threads[i], NULL);
         if (status != 0)
             cilkrts_bug(NULL, "Cilk runtime error: thread join (%u) failed: %s",
                         i, strerror(status));
     }
     cilkrts_alert(BOOT, "(threads_join) All workers joined!");
+    g->nthreads = 0;
     g->workers_started = false;
 }
 
+bool worker_wait_resize(__cilkrts_worker *w) {
+    global_state *g = w->g;
+    pthread_mutex_lock(&g->resize_lock);
+    ++g->threads_paused;
+    pthread_cond_broadcast(&g->resize_cond_var);
+    while (!g->terminate &&
+           (atomic_load_explicit(&g->resizing, memory_order_relaxed) ||
+            w->self >= g->nworkers))
+        pthread_cond_wait(&g->resize_cond_var, &g->resize_lock);
+    --g->threads_paused;
+    bool terminate = g->terminate;
+    pthread_mutex_unlock(&g->resize_lock);
+    return !terminate;
+}
+
+// Have all worker threads of g wait in worker_wait_resize.  The workers must
+// be between cilkified regions.
+static void workers_pause(global_state *g) {
+    pthread_mutex_lock(&g->resize_lock);
+    atomic_store_explicit(&g->resizing, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&g->resize_lock);
+    // Wake the thieves as __cilkrts_stop_workers does.  They find no region
+    // to run and go on to worker_wait_resize.
+    wake_all_disengaged(g);
+    pthread_mutex_lock(&g->resize_lock);
+    while (g->threads_paused < g->nthreads)
+        pthread_cond_wait(&g->resize_cond_var, &g->resize_lock);
+    pthread_mutex_unlock(&g->resize_lock);
+}
+
+// Let the worker threads of g that have a worker in the pool go on from
+// worker_wait_resize.
+static void workers_resume(global_state *g) {
+    pthread_mutex_lock(&g->resize_lock);
+    atomic_store_explicit(&g->resizing, 0, memory_order_relaxed);
+    pthread_cond_broadcast(&g->resize_cond_var);
+    pthread_mutex_unlock(&g->resize_lock);
+}
+
+// Grow the per-worker arrays of g to hold nworkers workers.  The workers must
+// be stopped or paused in worker_wait_resize, which uses none of the arrays.
+static void worker_arrays_grow(global_state *g, unsigned int nworkers) {
+    unsigned int old_size = g->options.nproc;
+    CILK_ASSERT(nworkers > old_size);
+
+    g->worker_args = (struct worker_args *)realloc(
+        g->worker_args, nworkers * sizeof(struct worker_args));
+    g->workers = (__cilkrts_worker **)realloc(
+        g->workers, nworkers * sizeof(__cilkrts_worker *));
+    g->threads = (pthread_t *)realloc(g->threads, nworkers * sizeof(pthread_t));
+    g->index_to_worker = (worker_id *)realloc(g->index_to_worker,
+                                              nworkers * sizeof(worker_id));
+    g->worker_to_index = (worker_id *)realloc(g->worker_to_index,
+                                              nworkers * sizeof(worker_id));
+    // No worker holds a deque lock between cilkified regions, so the deques
+    // can be moved.
+    ReadyDeque *deques = (ReadyDeque *)cilk_aligned_alloc(
+        __alignof__(ReadyDeque), nworkers * sizeof(ReadyDeque));
+    memcpy(deques, g->deques, old_size * sizeof(ReadyDeque));
+    free(g->deques);
+    g->deques = deques;
+
+    if (g->steal_summary) {
+        // Keep the bits of the existing workers, whose deques may not be
+        // empty.
+        unsigned int words = (nworkers + 63) / 64;
+        size_t size = round_size_to_alignment(CILK_CACHE_LINE,
+                                              words * sizeof(uint64_t));
+        _Atomic uint64_t *summary = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+        memset((void *)summary, 0, size);
+        memcpy((void *)summary, (void *)g->steal_summary,
+               g->steal_summary_words * sizeof(uint64_t));
+        free((void *)g->steal_summary);
+        g->steal_summary = summary;
+        g->steal_summary_words = words;
+    }
+    if (g->slow_workers) {
+        // Workers set their bits again as they next look at their CPU.
+        unsigned int words = (nworkers + 63) / 64;
+        size_t size = round_size_to_alignment(CILK_CACHE_LINE,
+                                              words * sizeof(uint64_t));
+        free((void *)g->slow_workers);
+        g->slow_workers = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+        memset((void *)g->slow_workers, 0, size);
+        g->slow_workers_words = words;
+    }
+    if (g->wake_slots) {
+        size_t size = nworkers * sizeof(struct wake_slot);
+        free(g->wake_slots);
+        g->wake_slots = cilk_aligned_alloc(CILK_CACHE_LINE, size);
+        memset((void *)g->wake_slots, 0, size);
+    }
+
+    g->options.nproc = nworkers;
+    workers_init(g, old_size);
+    deques_init(g, old_size);
+}
+
+// Release the memory that worker w holds while a resize of the worker pool
+// leaves it without a thread.  The worker structure itself is kept, so that
+// its statistics survive and it can be reused if the pool grows again.
+static void worker_park(__cilkrts_worker *w) {
+    cilkrts_alert(BOOT, "(worker_park) Parking worker %u", w->self);
+    cilk_fiber_pool_per_worker_terminate(w);
+    hyper_table *ht = w->hyper_table;
+    if (ht) {
+        local_hyper_table_free(ht);
+        w->hyper_table = NULL;
+    }
+    cilk_internal_malloc_per_worker_terminate(w);
+    // Return the touched pages of the shadow stack to the kernel but keep the
+    // reservation.
+    local_state *l = w->l;
+    madvise(l->shadow_stack,
+            l->shadow_stack_depth * sizeof(struct __cilkrts_stack_frame *),
+            MADV_DONTNEED);
+    l->leapfrog_count = 0;
+    l->parked = true;
+}
+
+// Change the number of workers in g to nworkers.  Executed by the boss
+// between cilkified regions, without roots_lock and with g->workers_changing
+// set.  The worker threads wait in worker_wait_resize while the boss parks the
+// surplus workers, whose threads keep waiting there, and reinstates parked
+// workers whose threads still exist.  The boss then creates threads only for
+// workers that never had one.
+static void workers_resize(global_state *g, unsigned int nworkers) {
+    unsigned int old_nworkers = g->nworkers;
+    cilkrts_alert(BOOT, "(workers_resize) %u -> %u workers", old_nworkers,
+                  nworkers);
+    if (g->workers_started)
+        workers_pause(g);
+    // Every thread that is left is engaged.
+    reset_disengaged_var(g);
+    atomic_store_explicit(&g->disengaged_sentinel, 0, memory_order_relaxed);
+
+    if (nworkers > g->options.nproc)
+        worker_arrays_grow(g, nworkers);
+    for (unsigned int i = nworkers; i < old_nworkers; ++i) {
+        if (worker_is_valid(g->workers[i], g))
+            worker_park(g->workers[i]);
+    }
+    for (unsigned int i = old_nworkers; i < nworkers && i <= g->nthreads; ++i)
+        __cilkrts_init_tls_worker(i, g);
+    // Disengaging and reengaging workers permutes the index maps.  Start the
+    // next region from the identity.
+    for (unsigned int i = 0; i < g->options.nproc; ++i) {
+        g->index_to_worker[i] = i;
+        g->worker_to_index[i] = i;
+    }
+    g->workers[0]->l->leapfrog_count = 0;
+
+    set_nworkers(g, nworkers);
+    atomic_store_explicit(&g->engaged_cap, nworkers, memory_order_relaxed);
+    if (!g->arena)
+        __cilkrts_nproc = nworkers;
+    if (!g->workers_started)
+        return;
+
+    // Repin the running threads for the new worker count.
+    if ((!g->arena || g->arena_ncpus > 0) && g->topology) {
+        for (unsigned int i = 1; i < nworkers && i <= g->nthreads; ++i)
+            cilk_topology_pin_thread(g->topology, i, g->threads[i]);
+    }
+    // Start the threads of new workers whose parents in the tree of worker
+    // threads already run.  The threads of the other new workers come from
+    // those.
+    unsigned int nthreads = g->nthreads;
+    for (unsigned int i = nthreads + 1; i < nworkers; ++i) {
+        if (startup_parent(i) <= nthreads)
+            create_worker_thread(g, i);
+    }
+    if (nworkers - 1 > nthreads)
+        g->nthreads = nworkers - 1;
+    workers_resume(g);
+}
+
 // Block until signaled the Cilkified region is done.  Executed by the Cilkfying
 // thread.
 static inline void wait_until_cilk_done(global_state *g) {
@@ -471,9 +715,195 @@ static inline __attribute__((noinline)) void boss_wait_helper(void) {
 
     CILK_BOSS_STOP_TIMING(g);
 
+    // Take back the reducer views of the region from the worker that finished
+    // it, then give up the boss role.  The next thread to cilkify may take
+    // over worker 0 and the root closure from here on.
+    __cilkrts_worker *w0 = g->workers[0];
+    if (g->options.fiber_pool_shrink || g->options.fiber_trim) {
+        // Shrink and trim the pools of worker 0 and the global pool, which no
+        // worker does when it goes idle.  Also trim the root closure's fiber,
+        // which the region ran on without taking it from a pool.
+        if (g->options.fiber_trim) {
+            struct cilk_fiber *root_fiber = g->root_closure->fiber;
+            root_fiber->trimmed = false;
+            cilk_fiber_pool_trim_fiber(w0, root_fiber);
+        }
+        cilk_fiber_pool_per_worker_idle(w0);
+        cilk_fiber_pool_global_idle(w0);
+    }
+    w0->hyper_table = g->exit_hyper_table;
+    g->exit_hyper_table = NULL;
+    w0->extension = g->exit_extension;
+    g->exit_extension = NULL;
+    void *orig_rsp = g->orig_rsp;
+    pthread_mutex_lock(&g->roots_lock);
+    g->boss_active = false;
+    pthread_cond_broadcast(&g->roots_cond_var);
+    pthread_mutex_unlock(&g->roots_lock);
+
     // Restore the boss's original rsp, so the boss completes the Cilk
     // function on its original stack.
-    SP(sf) = g->orig_rsp;
+    SP(sf) = orig_rsp;
+    sysdep_restore_fp_state(sf);
+    sanitizer_start_switch_fiber(NULL);
+    __builtin_longjmp(sf->ctx, 1);
+}
+
+// Stack class that the calling thread asks for the cilkified regions it
+// starts, as set by __cilkrts_set_region_stack_class.
+static __thread unsigned int region_stack_class;
+
+// Give the root closure t of a region that the calling thread starts a fiber
+// of the stack class that the thread asks for, or of the class that overflows
+// of fiber stacks have raised the floor to, whichever is larger.  The fiber
+// of t must not be in use.
+static void root_set_stack_class(global_state *g, Closure *t) {
+    unsigned int nclasses = g->options.nstack_classes;
+    if (nclasses == 1)
+        return;
+    unsigned int cls = atomic_load_explicit(&g->stack_class_floor,
+                                            memory_order_relaxed);
+    if (region_stack_class > cls)
+        cls = region_stack_class;
+    if (cls >= nclasses)
+        cls = nclasses - 1;
+    if (t->fiber->stack_class == cls)
+        return;
+    cilk_fiber_deallocate_class(g, t->fiber);
+    t->fiber = cilk_fiber_allocate_class(g, cls);
+}
+
+int __cilkrts_set_region_stack_class(unsigned cls) {
+    __cilkrts_worker *w = __cilkrts_get_tls_worker();
+    global_state *g = w ? w->g : default_cilkrts;
+    if (!g || cls >= g->options.nstack_classes)
+        return -1;
+    region_stack_class = cls;
+    return 0;
+}
+
+int __cilkrts_set_frame_stack_class(unsigned cls) {
+    __cilkrts_worker *w = __cilkrts_get_tls_worker();
+    struct cilk_fiber *fh = __cilkrts_current_fh;
+    if (__cilkrts_need_to_cilkify || !w || !fh || !fh->current_stack_frame ||
+        cls >= w->g->options.nstack_classes)
+        return -1;
+    // Thieves set the flags of the frames they steal from w while they hold
+    // the deque of w.
+    deque_lock_self(w->g->deques, w->self);
+    __cilkrts_set_frame_stack_class_bits(fh->current_stack_frame, cls);
+    deque_unlock_self(w->g->deques, w->self);
+    return 0;
+}
+
+static struct guest_root *guest_root_create(global_state *g) {
+    struct guest_root *root = calloc(1, sizeof(*root));
+    Closure *t = cilk_aligned_alloc(__alignof__(Closure), sizeof(Closure));
+    Closure_init(t, NULL);
+    t->fiber = cilk_fiber_allocate(&g->fiber_arena, g->options.stacksize);
+    if (USE_EXTENSION)
+        t->ext_fiber =
+            cilk_fiber_allocate(&g->fiber_arena, g->options.stacksize);
+    t->is_root = true;
+    root->closure = t;
+    root->g = g;
+    return root;
+}
+
+// Take a guest root from the free list of g, or make a new one.
+static struct guest_root *guest_root_get(global_state *g) {
+    pthread_mutex_lock(&g->roots_lock);
+    struct guest_root *root = g->free_roots;
+    if (root)
+        g->free_roots = root->next;
+    pthread_mutex_unlock(&g->roots_lock);
+    if (!root)
+        root = guest_root_create(g);
+    return root;
+}
+
+void guest_root_free(global_state *g, struct guest_root *root) {
+    pthread_mutex_lock(&g->roots_lock);
+    root->next = g->free_roots;
+    g->free_roots = root;
+    pthread_mutex_unlock(&g->roots_lock);
+}
+
+// Make the guest region of root visible to the workers, and get a worker to
+// start it.  If start_pool, no other region is active, and the workers may be
+// waiting for one to start.
+static void guest_root_publish(global_state *g, struct guest_root *root,
+                               bool start_pool) {
+    atomic_store_explicit(&root->done, 0, memory_order_relaxed);
+    pthread_mutex_lock(&g->roots_lock);
+    root->pending = true;
+    root->next = g->guest_roots;
+    g->guest_roots = root;
+    atomic_fetch_add_explicit(&g->pending_roots, 1, memory_order_release);
+    pthread_mutex_unlock(&g->roots_lock);
+
+    if (start_pool) {
+        note_region_start(g);
+        atomic_store_explicit(&g->done, 0, memory_order_release);
+        wake_thieves(g);
+    } else {
+        request_more_thieves(g, 0, 1);
+    }
+}
+
+static void guest_roots_destroy(global_state *g) {
+    CILK_ASSERT_NULL(g->guest_roots);
+    struct guest_root *root = g->free_roots;
+    while (root) {
+        struct guest_root *next = root->next;
+        Closure *t = root->closure;
+        cilk_fiber_deallocate_global(g, t->fiber);
+        if (USE_EXTENSION)
+            cilk_fiber_deallocate_global(g, t->ext_fiber);
+        t->status = CLOSURE_POST_INVALID;
+        free(t);
+        free(root);
+        root = next;
+    }
+    g->free_roots = NULL;
+}
+
+// Run the cilkified region rooted at sf as a guest region, because another
+// thread holds the boss role.  The workers start the region from its own root
+// closure, and this thread waits for them to finish it.  If start_pool, no
+// other region is active, and the workers may be waiting for one to start.
+static __attribute__((noreturn)) void
+invoke_guest_root(global_state *g, __cilkrts_stack_frame *sf, bool start_pool) {
+    CILK_ASSERT(g->workers_started);
+
+    struct guest_root *root = guest_root_get(g);
+    root->fn = NULL;
+    root->detached = false;
+
+    // Set up the root closure like the boss's, except that the worker that
+    // starts the region moves sf to the closure's fiber.
+    Closure *t = root->closure;
+    Closure_make_ready(t);
+    root_set_stack_class(g, t);
+    root->sf = sf;
+    root->orig_rsp = SP(sf);
+    if (USE_EXTENSION)
+        sf->extension = NULL;
+    sf->flags |= CILK_FRAME_LAST;
+    __cilkrts_set_stolen(sf);
+    Closure_clear_frame(t);
+    Closure_set_frame(t, sf);
+
+    guest_root_publish(g, root, start_pool);
+    wait_for_guest_done(g, root);
+
+    // The worker that finished the region removed the root from the active
+    // regions.  Recycle it, and complete the Cilk function on this thread's
+    // stack.
+    void *orig_rsp = root->orig_rsp;
+    guest_root_free(g, root);
+
+    SP(sf) = orig_rsp;
     sysdep_restore_fp_state(sf);
     sanitizer_start_switch_fiber(NULL);
     __builtin_longjmp(sf->ctx, 1);
@@ -482,20 +912,51 @@ static inline __attribute__((noinline)) void boss_wait_helper(void) {
 // Setup runtime structures to start a new Cilkified region.  Executed by the
 // Cilkifying thread in cilkify().
 void __cilkrts_internal_invoke_cilkified_root(__cilkrts_stack_frame *sf) {
-    global_state *g = default_cilkrts;
+    // Outside of cilkified regions, the worker of the calling thread is worker
+    // 0 of the runtime instance that the thread runs in.
+    global_state *g = __cilkrts_tls_worker->g;
 
-    // Initialize the boss thread's runtime structures, if necessary.
-    static bool boss_initialized = false;
-    if (!boss_initialized) {
-        __cilkrts_worker *w0 = g->workers[0];
-        cilk_fiber_pool_per_worker_init(w0);
-        w0->l->rand_next = 162347;
-        if (USE_EXTENSION) {
-            g->root_closure->ext_fiber =
-                cilk_fiber_allocate(g->options.stacksize);
+    // Count the new region, and take the boss role unless another thread
+    // holds it.  Without worker threads, no one could run a guest region, so
+    // wait for the boss role instead.
+    pthread_mutex_lock(&g->roots_lock);
+    while (g->workers_changing || (g->boss_active && g->nworkers == 1))
+        pthread_cond_wait(&g->roots_cond_var, &g->roots_lock);
+    bool start_pool = g->active_regions++ == 0;
+    bool is_boss = !g->boss_active;
+    unsigned int nworkers = 0;
+    if (is_boss) {
+        g->boss_active = true;
+        // Apply a change to the number of workers or to the scheduling
+        // profile requested since the last region.  Only possible while no
+        // other region uses the workers.
+        if (start_pool) {
+            nworkers = atomic_exchange_explicit(&g->pending_nworkers, 0,
+                                                memory_order_relaxed);
+            // Workers pick up the new tuning as they next load it.
+            uint32_t pending_profile = atomic_exchange_explicit(
+                &g->pending_profile, 0, memory_order_relaxed);
+            if (pending_profile)
+                apply_sched_profile(g, pending_profile - 1);
         }
-        boss_initialized = true;
+        if (nworkers == g->nworkers)
+            nworkers = 0;
+        // Guests, submitters, and __cilkrts_warmup wait for the workers to be
+        // started or resized.
+        g->workers_changing = nworkers != 0 || !g->workers_started;
     }
+    bool workers_changing = is_boss && g->workers_changing;
+    pthread_mutex_unlock(&g->roots_lock);
+    if (!is_boss)
+        invoke_guest_root(g, sf, start_pool);
+
+    // Resize the worker pool without roots_lock, which the exiting workers
+    // may need.
+    if (__builtin_expect(nworkers != 0, false))
+        workers_resize(g, nworkers);
+
+    // Initialize the boss thread's runtime structures, if necessary.
+    boss_init(g);
 
     __cilkrts_need_to_cilkify = false;
 
@@ -519,6 +980,14 @@ void __cilkrts_internal_invoke_cilkified_root(__cilkrts_stack_frame *sf) {
     // Mark the root closure as ready
     Closure_make_ready(g->root_closure);
 
+    // Give the root closure a fiber of the region's stack class, and let
+    // overflows of fiber stacks on this thread promote later regions, if
+    // CILK_OVERFLOW_HANDLER asks for it.
+    if (g->options.nstack_classes > 1)
+        root_set_stack_class(g, root_closure);
+    if (g->options.overflow_handler)
+        cilk_fiber_guard_thread_init();
+
     // Setup the stack pointer to point at the root closure's fiber.
     g->orig_rsp = SP(sf);
     void *new_rsp =
@@ -539,29 +1008,38 @@ void __cilkrts_internal_invoke_cilkified_root(__cilkrts_stack_frame *sf) {
     // flags.
 
     /* reset_disengaged_var(g); */
-    if (__builtin_expect(
-            atomic_load_explicit(&g->cilkified, memory_order_relaxed), false)) {
-        cilkrts_bug(
-            NULL,
-            "ERROR: OpenCilk runtime already executing a Cilk computation.\n");
-    }
     set_cilkified(g);
 
-    // Set g->done = 0, so Cilk workers will continue trying to steal.
-    atomic_store_explicit(&g->done, 0, memory_order_release);
-
-    // Wake up the thieves, to allow them to begin work stealing.
-    //
-    // NOTE: We might want to wake thieves gradually, as successful steals
-    // occur, rather than all at once.  Initial testing of this approach did not
-    // seem to perform well, however.  One possible reason why could be because
-    // of the extra kernel interactions involved in waking workers gradually.
-    wake_thieves(g);
-    /* request_more_thieves(g, g->nworkers); */
+    if (start_pool) {
+        note_region_start(g);
+        // Set g->done = 0, so Cilk workers will continue trying to steal.
+        atomic_store_explicit(&g->done, 0, memory_order_release);
+
+        // Wake up the thieves, to allow them to begin work stealing.
+        //
+        // NOTE: We might want to wake thieves gradually, as successful steals
+        // occur, rather than all at once.  Initial testing of this approach
+        // did not seem to perform well, however.  One possible reason why
+        // could be because of the extra kernel interactions involved in waking
+        // workers gradually.  CILK_WAKE_FANOUT instead spreads those kernel
+        // interactions over the woken workers, so the boss only wakes the
+        // first few.
+        wake_thieves(g);
+    } else {
+        // Guest regions keep the workers stealing; ask for one more thief
+        // for this region.
+        request_more_thieves(g, 0, 1);
+    }
 
-    // Start the workers if necessary
-    if (__builtin_expect(!g->workers_started, false)) {
-        __cilkrts_start_workers(g);
+    // Start the workers if necessary, and let the threads waiting for them
+    // go on.
+    if (__builtin_expect(workers_changing, false)) {
+        if (!g->workers_started)
+            __cilkrts_start_workers(g);
+        pthread_mutex_lock(&g->roots_lock);
+        g->workers_changing = false;
+        pthread_cond_broadcast(&g->roots_cond_var);
+        pthread_mutex_unlock(&g->roots_lock);
     }
 
     if (__builtin_setjmp(g->boss_ctx) == 0) {
@@ -585,24 +1063,51 @@ void __cilkrts_internal_exit_cilkified_root(global_state *g,
     CILK_SWITCH_TIMING(w, INTERVAL_WORK, INTERVAL_CILKIFY_EXIT);
 
     worker_id self = w->self;
-    const bool is_boss = (0 == self);
     ReadyDeque *deques = g->deques;
 
-    // Mark the computation as done.  Also "sleep" the workers: update global
-    // flags so workers who exit the work-stealing loop will return to waiting
-    // for the start of the next Cilkified region.
-    sleep_thieves(g);
-
-    atomic_store_explicit(&g->done, 1, memory_order_release);
+    // Mark the region as done, and find whether sf roots a guest region.  If
+    // this was the last active region, mark the computation as done.  Also
+    // "sleep" the workers: update global flags so workers who exit the
+    // work-stealing loop will return to waiting for the start of the next
+    // Cilkified region.
+    pthread_mutex_lock(&g->roots_lock);
+    struct guest_root *root = NULL;
+    for (struct guest_root **p = &g->guest_roots; *p; p = &(*p)->next) {
+        if ((*p)->sf == sf) {
+            root = *p;
+            *p = root->next;
+            break;
+        }
+    }
+    if (--g->active_regions == 0) {
+        note_region_end(g);
+        sleep_thieves(g);
+        atomic_store_explicit(&g->done, 1, memory_order_release);
+        // Let __cilkrts_shutdown go on.
+        pthread_cond_broadcast(&g->roots_cond_var);
+    }
+    pthread_mutex_unlock(&g->roots_lock);
     /* wake_all_disengaged(g); */
 
-    if (!is_boss) {
-        w->l->exiting = true;
-        __cilkrts_worker **workers = g->workers;
-        __cilkrts_worker *w0 = workers[0];
-        w0->hyper_table = w->hyper_table;
+    const bool is_boss = !root && 0 == self;
+    Closure *root_closure = root ? root->closure : g->root_closure;
+    USE_UNUSED(root_closure);
+
+    if (root) {
+        // No later region continues from the views of a guest region, so
+        // reduce them into the reducers now.
+        reduce_ht_into_keys(w->hyper_table);
         w->hyper_table = NULL;
-        w0->extension = w->extension;
+        w->extension = NULL;
+        w->l->exiting_root = root;
+    } else {
+        // Leave the views of the boss's region for boss_wait_helper to hand
+        // back to worker 0.
+        if (!is_boss)
+            w->l->exiting = true;
+        g->exit_hyper_table = w->hyper_table;
+        w->hyper_table = NULL;
+        g->exit_extension = w->extension;
         w->extension = NULL;
     }
 
@@ -614,7 +1119,7 @@ void __cilkrts_internal_exit_cilkified_root(global_state *g,
     deque_lock_self(deques, self);
     deques[self].bottom = (Closure *)NULL;
     deques[self].top = (Closure *)NULL;
-    WHEN_CILK_DEBUG(g->root_closure->owner_ready_deque = NO_WORKER);
+    WHEN_CILK_DEBUG(root_closure->owner_ready_deque = NO_WORKER);
     deque_unlock_self(deques, self);
 
     // Clear the flags in sf.  This routine runs before leave_frame in a Cilk
@@ -626,19 +1131,14 @@ void __cilkrts_internal_exit_cilkified_root(global_state *g,
 
     CILK_STOP_TIMING(w, INTERVAL_CILKIFY_EXIT);
     if (is_boss) {
-        // We finished the computation on the boss thread.  No need to jump to
-        // the runtime in this case; just return normally.
+        // We finished the computation on the boss thread.  No need to wait
+        // for another worker in this case, but leave the root closure's fiber
+        // through boss_ctx, so that the boss gives up its role only once it
+        // is back on its original stack.
         local_state *l = w->l;
         atomic_store_explicit(&g->cilkified, 0, memory_order_relaxed);
         l->state = WORKER_IDLE;
-        __cilkrts_need_to_cilkify = true;
-
-        // Restore the boss's original rsp, so the boss completes the Cilk
-        // function on its original stack.
-        SP(sf) = g->orig_rsp;
-        sysdep_restore_fp_state(sf);
-        sanitizer_start_switch_fiber(NULL);
-        __builtin_longjmp(sf->ctx, 1);
+        __builtin_longjmp(g->boss_ctx, 1);
     } else {
         // done; go back to runtime
         CILK_START_TIMING(w, INTERVAL_WORK);
@@ -662,10 +1162,30 @@ static void global_state_deinit(global_state *g) {
     // TODO: Convert to cilk_* equivalents
     pthread_mutex_destroy(&g->cilkified_lock);
     pthread_cond_destroy(&g->cilkified_cond_var);
+    pthread_cond_destroy(&g->guest_done_cond_var);
+    pthread_mutex_destroy(&g->roots_lock);
+    pthread_cond_destroy(&g->roots_cond_var);
+    pthread_mutex_destroy(&g->ready_waiters_lock);
+    pthread_mutex_destroy(&g->resize_lock);
+    pthread_cond_destroy(&g->resize_cond_var);
     /* pthread_mutex_destroy(&g->start_thieves_lock); */
     /* pthread_cond_destroy(&g->start_thieves_cond_var); */
     pthread_mutex_destroy(&g->disengaged_lock);
     pthread_cond_destroy(&g->disengaged_cond_var);
+    cilk_topology_destroy(g->topology);
+    g->topology = NULL;
+    free(g->pin_cpus);
+    g->pin_cpus = NULL;
+    cpu_limits_destroy(g->cpu_limits);
+    g->cpu_limits = NULL;
+    free((void *)g->steal_summary);
+    g->steal_summary = NULL;
+    free(g->slow_cpus);
+    g->slow_cpus = NULL;
+    free((void *)g->slow_workers);
+    g->slow_workers = NULL;
+    free(g->wake_slots);
+    g->wake_slots = NULL;
     free(g->worker_args);
     g->worker_args = NULL;
     free(g->workers);
@@ -679,6 +1199,8 @@ static void global_state_deinit(global_state *g) {
     g->index_to_worker = NULL;
     free(g->worker_to_index);
     g->worker_to_index = NULL;
+    free(g->arena_cpus);
+    g->arena_cpus = NULL;
     free(g);
 }
 
@@ -692,6 +1214,11 @@ static void deques_deinit(global_state *g) {
 static void worker_terminate(__cilkrts_worker *w, void *data) {
     (void)data; // not currently used
 
+    // worker_park already released what a parked worker held.
+    if (w->l->parked) {
+        worker_local_destroy(w->l, w->g);
+        return;
+    }
     cilk_fiber_pool_per_worker_terminate(w);
     hyper_table *ht = w->hyper_table;
     if (ht) {
@@ -739,11 +1266,10 @@ static void workers_deinit(global_state *g) {
         if (!worker_is_valid(w, g))
             continue;
         cilk_internal_malloc_per_worker_destroy(w); // internal malloc last
-        free(w->l->shadow_stack);
-        w->l->shadow_stack = NULL;
+        shadow_stack_release(w->l);
         *(struct local_state **)(&w->l) = NULL;
-        if (i != 0)
-            free(w);
+        if (w != &default_worker)
+            worker_mem_free(w);
     }
 
     /* TODO: Export initial reducer map */
@@ -751,14 +1277,23 @@ static void workers_deinit(global_state *g) {
 
 CHEETAH_INTERNAL void __cilkrts_shutdown(global_state *g) {
     CILK_ASSERT_NULL(exception_reducer.exn);
+    // Let submitted tasks finish.
+    pthread_mutex_lock(&g->roots_lock);
+    while (g->active_regions > 0)
+        pthread_cond_wait(&g->roots_cond_var, &g->roots_lock);
+    pthread_mutex_unlock(&g->roots_lock);
+
     // If the workers are still running, stop them now.
     if (g->workers_started)
         __cilkrts_stop_workers(g);
 
-    for (unsigned i = cilkrts_callbacks.last_exit; i > 0;)
-        cilkrts_callbacks.exit[--i]();
+    if (!g->arena) {
+        for (unsigned i = cilkrts_callbacks.last_exit; i > 0;)
+            cilkrts_callbacks.exit[--i]();
+    }
 
-    // Deallocate the root closure and its fiber
+    // Deallocate the root closures and their fibers
+    guest_roots_destroy(g);
     cilk_fiber_deallocate_global(g, g->root_closure->fiber);
     if (USE_EXTENSION)
         cilk_fiber_deallocate_global(g, g->root_closure->ext_fiber);
@@ -786,3 +1321,180 @@ CHEETAH_INTERNAL void __cilkrts_shutdown(global_state *g) {
 __attribute__((destructor)) void __default_cilkrts_shutdown() {
     __cilkrts_shutdown(default_cilkrts);
 }
+
+//=========================================================
+// Arenas: runtime instances besides the default one, each with its own
+// workers, deques, fiber pool, sleep accounting, and statistics.
+//=========================================================
+
+#define ARENA_MAX_CPUS 4096
+
+__cilkrts_arena *__cilkrts_arena_create(unsigned nworkers, const char *cpus) {
+    if (!default_cilkrts || nworkers >= 10000)
+        return NULL;
+
+    unsigned int *cpu_list = NULL;
+    int ncpus = 0;
+    if (cpus) {
+        cpu_list = malloc(ARENA_MAX_CPUS * sizeof(unsigned int));
+        ncpus = cilk_cpulist_parse(cpus, cpu_list, ARENA_MAX_CPUS);
+        if (ncpus <= 0) {
+            free(cpu_list);
+            return NULL;
+        }
+    }
+
+    // By default, run one worker per CPU of the arena.
+    if (nworkers == 0 && ncpus > 0 && !getenv("CILK_NWORKERS"))
+        nworkers = ncpus;
+    global_state *g = runtime_startup(0, NULL, nworkers, true);
+    g->arena_ncpus = ncpus;
+    g->arena_cpus = cpu_list;
+    if (g->topology && cpu_list) {
+        // Place the workers, for stealing and pinning, on the arena's CPUs.
+        cilk_topology_destroy(g->topology);
+        g->topology =
+            cilk_topology_init(g->nworkers, g->options.pin, g->pin_cpus,
+                               g->pin_ncpus, cpu_list, (unsigned int)ncpus);
+    }
+    __atomic_fetch_add(&__cilkrts_narenas, 1, __ATOMIC_RELAXED);
+    cilkrts_alert(BOOT, "(__cilkrts_arena_create) %u workers on %d cpus",
+                  g->nworkers, ncpus);
+    return (__cilkrts_arena *)g;
+}
+
+void __cilkrts_arena_run(__cilkrts_arena *arena, void (*fn)(void *),
+                         void *arg) {
+    global_state *g = (global_state *)arena;
+    __cilkrts_worker *w = __cilkrts_tls_worker;
+    bool need_to_cilkify = __cilkrts_need_to_cilkify;
+
+    // A worker of the arena can just run fn as part of its region.
+    if (!need_to_cilkify && w->g == g) {
+        fn(arg);
+        return;
+    }
+
+    // Otherwise, this thread cilkifies into the arena, as worker 0 or as a
+    // guest.  It may be a worker of another runtime instance, blocked until fn
+    // returns, so save and restore its state.  As with the default runtime,
+    // all threads outside the arena's regions share its worker 0.
+    struct cilk_fiber *fh = __cilkrts_current_fh;
+    __cilkrts_set_tls_worker(g->workers[0]);
+    __cilkrts_need_to_cilkify = true;
+    fn(arg);
+    __cilkrts_set_tls_worker(w);
+    __cilkrts_current_fh = fh;
+    __cilkrts_need_to_cilkify = need_to_cilkify;
+}
+
+void __cilkrts_arena_destroy(__cilkrts_arena *arena) {
+    if (arena) {
+        __cilkrts_shutdown((global_state *)arena);
+        __atomic_fetch_sub(&__cilkrts_narenas, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//=========================================================
+// Task submission: guest regions that no thread waits in.
+//=========================================================
+
+// Run the task rooted at the current frame.  A worker enters this function
+// from task_root_start, on the fiber of the task's root closure, and the
+// function leaves through the exit of the region.
+static __attribute__((noinline, noreturn)) void task_root_run(void) {
+    sanitizer_finish_switch_fiber();
+    __cilkrts_stack_frame *sf = __cilkrts_current_fh->current_stack_frame;
+    struct guest_root *root =
+        (struct guest_root *)((char *)sf -
+                              offsetof(struct guest_root, task_frame));
+    root->fn(root->arg);
+
+    // If fn was stolen from, it may have returned on another worker.  That
+    // worker now holds the root closure, and finishes the region.
+    __cilkrts_worker *w = __cilkrts_get_tls_worker();
+    sf->fh->current_stack_frame = NULL;
+    __cilkrts_internal_exit_cilkified_root(w->g, sf);
+    __builtin_unreachable();
+}
+
+// Save the context of the task's root frame here, on the worker's stack, and
+// jump to it on the fiber of t, as the boss does with the root frame of its
+// region.  This frame stays live until task_root_run is entered, which the
+// code after the setjmp needs.
+void task_root_start(__cilkrts_worker *w, Closure *t) {
+    __cilkrts_stack_frame *sf = t->frame;
+    if (__builtin_setjmp(sf->ctx) == 0) {
+        sysdep_save_fp_ctrl_state(sf);
+        longjmp_to_user_code(w, t);
+    }
+    task_root_run();
+}
+
+int __cilkrts_submit(void (*fn)(void *), void *arg, __cilkrts_task **handle) {
+    if (!fn)
+        return -1;
+    global_state *g = __cilkrts_tls_worker->g;
+
+    // Count the task as an active region, so the workers keep stealing until
+    // it is done.  Without worker threads, no one could take the task, so run
+    // it here.
+    pthread_mutex_lock(&g->roots_lock);
+    wait_for_workers(g);
+    bool run_here = g->nworkers == 1;
+    bool start_pool = false;
+    if (!run_here) {
+        start_pool = g->active_regions++ == 0;
+        if (!g->workers_started)
+            __cilkrts_start_workers(g);
+    }
+    pthread_mutex_unlock(&g->roots_lock);
+
+    struct guest_root *root = guest_root_get(g);
+    root->fn = fn;
+    root->arg = arg;
+    root->detached = !handle;
+    if (handle)
+        *handle = (__cilkrts_task *)root;
+
+    if (run_here) {
+        fn(arg);
+        atomic_store_explicit(&root->done, 1, memory_order_release);
+        if (!handle)
+            guest_root_free(g, root);
+        return 0;
+    }
+
+    // Set up the root closure like that of a guest region, with task_frame as
+    // its frame.
+    Closure *t = root->closure;
+    Closure_make_ready(t);
+    root_set_stack_class(g, t);
+    __cilkrts_stack_frame *sf = &root->task_frame;
+    sf->flags = CILK_FRAME_LAST;
+    sf->magic = frame_magic;
+    sf->call_parent = NULL;
+    if (USE_EXTENSION)
+        sf->extension = NULL;
+    __cilkrts_set_stolen(sf);
+    root->sf = sf;
+    root->orig_rsp = NULL;
+    Closure_clear_frame(t);
+    Closure_set_frame(t, sf);
+
+    cilkrts_alert(SCHED, "(__cilkrts_submit) task %p", (void *)root);
+    guest_root_publish(g, root, start_pool);
+    return 0;
+}
+
+int __cilkrts_task_done(__cilkrts_task *task) {
+    struct guest_root *root = (struct guest_root *)task;
+    return atomic_load_explicit(&root->done, memory_order_acquire) != 0;
+}
+
+void __cilkrts_task_wait(__cilkrts_task *task) {
+    struct guest_root *root = (struct guest_root *)task;
+    global_state *g = root->g;
+    wait_for_guest_done(g, root);
+    guest_root_free(g, root);
+}
@@ -3,10 +3,27 @@
 
 #include "cilk-internal.h"
 
+struct guest_root;
+
 // For invoke, the global state is implied.
 void __cilkrts_internal_invoke_cilkified_root(__cilkrts_stack_frame *sf);
 void __cilkrts_internal_exit_cilkified_root(global_state *g, __cilkrts_stack_frame *sf);
 
+// Warm up worker w as it starts, if __cilkrts_warmup asked for it.
+CHEETAH_INTERNAL void worker_warmup(__cilkrts_worker *w);
+
+// Wait while the boss resizes the worker pool, and for as long as the resize
+// leaves w out of the pool.  Returns false if the workers stop instead.
+CHEETAH_INTERNAL bool worker_wait_resize(__cilkrts_worker *w);
+
+// Return a guest root to the free list of g.
+CHEETAH_INTERNAL void guest_root_free(global_state *g,
+                                      struct guest_root *root);
+
+// Enter the submitted task rooted at closure t, which is set up to run on w.
+CHEETAH_INTERNAL __attribute__((noreturn)) void
+task_root_start(__cilkrts_worker *w, struct Closure *t);
+
 // Used by Cilksan to set nworkers to 1 and force reduction
 void __cilkrts_internal_set_nworkers(unsigned int nworkers);
 
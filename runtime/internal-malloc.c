@@ -123,9 +123,9 @@ static long wasted_bytes(struct cilk_im_desc *desc) {
 static size_t workers_used_and_free(global_state *g) {
     size_t worker_free = 0;
     long worker_used = 0, worker_wasted = 0;
-    for (unsigned int i = 0; i < g->nworkers; i++) {
+    for (unsigned int i = 0; i < g->options.nproc; i++) {
         __cilkrts_worker *w = g->workers[i];
-        if (!w)
+        if (!w || !worker_is_valid(w, g))
             continue; /* starting up or shutting down */
         local_state *l = w->l;
         worker_free += free_bytes(&l->im_desc);
@@ -150,9 +150,9 @@ void dump_memory_state(FILE *out, global_state *g) {
             g->im_pool.wasted, g->im_desc.used, available, global_free,
             g->im_desc.used + available + global_free);
     dump_buckets(out, &g->im_desc);
-    for (unsigned int i = 0; i < g->nworkers; i++) {
+    for (unsigned int i = 0; i < g->options.nproc; i++) {
         __cilkrts_worker *w = g->workers[i];
-        if (!w)
+        if (!w || !worker_is_valid(w, g))
             continue;
         fprintf(out, "Worker %u:\n", i);
         dump_buckets(out, &w->l->im_desc);
@@ -173,9 +173,9 @@ void internal_malloc_global_check(global_state *g) {
     for (int i = 0; i < IM_NUM_TAGS; ++i)
         total_malloc[i] = d->num_malloc[i];
 
-    for (unsigned int i = 0; i < g->nworkers; i++) {
+    for (unsigned int i = 0; i < g->options.nproc; i++) {
         __cilkrts_worker *w = g->workers[i];
-        if (!w)
+        if (!w || !worker_is_valid(w, g))
             continue; /* starting up or shutting down */
         local_state *l = w->l;
         for (int i = 0; i < IM_NUM_TAGS; ++i)
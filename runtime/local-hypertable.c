@@ -448,3 +448,27 @@ hyper_table *merge_two_hts(hyper_table *restrict left,
 
     return dst;
 }
+
+void reduce_ht_into_keys(hyper_table *table) {
+    if (!table)
+        return;
+
+    int32_t capacity = (table->capacity < MIN_HT_CAPACITY) ? table->occupancy
+                                                           : table->capacity;
+    struct bucket *buckets = table->buckets;
+    for (int32_t i = 0; i < capacity; ++i) {
+        struct bucket b = buckets[i];
+        if (!is_valid(b.key))
+            continue;
+
+        // A reducer registered in this region maps its key to itself.  Any
+        // other view is to the right of the key.
+        void *key = (void *)b.key;
+        if (b.value.view != key) {
+            b.value.reduce_fn(key, b.value.view);
+            free(b.value.view);
+        }
+    }
+
+    local_hyper_table_free(table);
+}
@@ -49,6 +49,11 @@ CHEETAH_INTERNAL
 hyper_table *merge_two_hts(hyper_table *restrict left,
                            hyper_table *restrict right);
 
+// Reduce each view in table into the leftmost view of its reducer, which is
+// the reducer itself, and free the table.
+CHEETAH_INTERNAL
+void reduce_ht_into_keys(hyper_table *table);
+
 #ifndef MOCK_HASH
 // Data type for indexing the hash table.  This type is used for
 // hashes as well as the table's capacity.
@@ -4,19 +4,40 @@
 #include <stdbool.h>
 
 #include "internal-malloc-impl.h" /* for cilk_im_desc */
+#include "rts-config.h"
 
 struct local_state {
     struct __cilkrts_stack_frame **shadow_stack;
+    size_t shadow_stack_depth; /* entries usable before the guard page */
 
     unsigned short state; /* __cilkrts_worker_state */
     bool provably_good_steal;
     bool exiting;
     bool returning;
+    /* Torn down by a resize of the worker pool that left it threadless. */
+    bool parked;
+    /* Guest region this worker just finished, to signal once off its fiber. */
+    struct guest_root *exiting_root;
+    /* Mutex whose waiter list this worker keeps locked, after parking a strand
+       on it, until it is off the strand's fiber. */
+    struct __cilkrts_mutex *parked_on;
+    /* Parked strand to jump back into when entering the closure just taken. */
+    struct __cilkrts_mutex_waiter *resume_waiter;
+    /* Submitted task to start when entering the closure just taken. */
+    bool start_task;
     unsigned int rand_next;
     uint32_t wake_val;
+    /* Workers running descendants of the closure suspended at this worker's
+       last failed sync, to try stealing from first. */
+    unsigned int leapfrog_count;
+    worker_id leapfrog_victims[LEAPFROG_MAX_VICTIMS];
 
     jmpbuf rts_ctx;
     struct cilk_fiber_pool fiber_pool;
+    // Fiber of a stack class above 0 that the worker freed last.  It goes
+    // back to the shared pool of its class only at the worker's next such
+    // free, since the worker may still run on it when it frees it.
+    struct cilk_fiber *class_fiber_freed;
     struct cilk_im_desc im_desc;
     struct sched_stats stats;
 };
@@ -17,10 +17,35 @@ typedef struct ReadyDeque ReadyDeque;
 #include "global.h"
 #include "local.h"
 
+/*
+ * PROTOCOLS
+ *
+ * Each ReadyDeque is a doubly linked list of closures protected by the spin
+ * lock mutex_owner.  Closures are locked with Closure_lock.
+ *
+ * A. A worker that holds a closure lock must not acquire a deque lock.  Lock
+ *    the deque first, or unlock the closure before locking the deque.
+ * D. A worker that holds both a deque lock and a closure lock must unlock the
+ *    closure before the deque.
+ * P. Every deque operation requires the deque lock, including the owner's.
+ *    The owner pushes onto its deque only from the scheduler, or from a
+ *    strand parking on a mutex once it has promoted all its THE-protected
+ *    frames, but that does not make its deque private: a thief in
+ *    promote_child can empty the victim's deque with Closure_suspend_victim
+ *    and refill it with the new spawn child, and thieves take READY closures
+ *    parked by a batched steal or a parking strand off the top.  Only
+ *    num_ready is read without the lock, as a hint.
+ */
+
 // Actual declaration
 struct ReadyDeque {
     Closure *bottom;
     Closure *top __attribute__((aligned(CILK_CACHE_LINE)));
+    // Number of READY closures parked at the top of this deque by a batched
+    // steal, or by a strand that parks on a mutex.  Thieves read this count in
+    // their fast test, next to top.  It is only modified while holding the
+    // deque lock.
+    _Atomic(uint32_t) num_ready;
     _Atomic(worker_id) mutex_owner __attribute__((aligned(CILK_CACHE_LINE)));
 } __attribute__((aligned(CILK_CACHE_LINE)));
 
@@ -142,10 +167,10 @@ static inline Closure *deque_peek_top(ReadyDeque *deques,
     if (cl) {
         // If w is stealing, then it may peek the top of the deque of the worker
         // who is in the midst of exiting a Cilkified region.  In that case, cl
-        // will be the root closure, and cl->owner_ready_deque is not
+        // will be a root closure, and cl->owner_ready_deque is not
         // necessarily pn.  The steal will subsequently fail do_dekker_on.
         CILK_ASSERT(cl->owner_ready_deque == pn ||
-                           (self != pn && cl == w->g->root_closure));
+                           (self != pn && cl->is_root));
     } else {
         CILK_ASSERT_NULL(deques[pn].bottom);
     }
@@ -199,6 +224,55 @@ deque_peek_bottom(ReadyDeque *deques, worker_id self, worker_id pn) {
     return cl;
 }
 
+/*
+ * Unlink every closure above the bottom of worker pn's deque, leaving the
+ * bottom closure alone on it.  Returns the top closure of the unlinked ones,
+ * which stay linked to each other through next_ready, or NULL if there are
+ * none.  Put them back with deque_add_above.
+ */
+static inline Closure *deque_xtract_above_bottom(ReadyDeque *deques,
+                                                 worker_id self,
+                                                 worker_id pn) {
+
+    deque_assert_ownership(deques, self, pn);
+
+    Closure *bottom = deques[pn].bottom;
+    Closure *top = deques[pn].top;
+    if (!bottom || bottom == top)
+        return (Closure *)NULL;
+
+    CILK_ASSERT(bottom->prev_ready);
+    (bottom->prev_ready)->next_ready = (Closure *)NULL;
+    bottom->prev_ready = (Closure *)NULL;
+    deques[pn].top = bottom;
+    return top;
+}
+
+/*
+ * Link the closures that deque_xtract_above_bottom unlinked from worker pn's
+ * deque, starting at top, back on top of it in the same order.
+ */
+static inline void deque_add_above(ReadyDeque *deques, Closure *top,
+                                   worker_id self, worker_id pn) {
+
+    deque_assert_ownership(deques, self, pn);
+    CILK_ASSERT(top && !top->prev_ready);
+
+    Closure *last = top;
+    while (last->next_ready) {
+        CILK_ASSERT(last->owner_ready_deque == pn);
+        last = last->next_ready;
+    }
+
+    last->next_ready = deques[pn].top;
+    if (deques[pn].top) {
+        (deques[pn].top)->prev_ready = last;
+    } else {
+        deques[pn].bottom = last;
+    }
+    deques[pn].top = top;
+}
+
 /*
  * ANGE: this allow w -> self to append Closure cl onto worker pn's ready
  *       deque (i.e. make cl the new bottom).
@@ -46,10 +46,58 @@
 #define BUSY_PAUSE 1
 #endif
 
+// Longest time that idle workers of the "latency" profile spin between
+// cilkified regions before sleeping, in nanoseconds.
+#ifndef IDLE_SPIN_NSEC
+#define IDLE_SPIN_NSEC 200000
+#endif
+
+#ifndef IDLE_SPIN_CHECK
+// Polls between reads of the clock while spinning between regions.
+#define IDLE_SPIN_CHECK 64
+#endif
+
 #ifndef BUSY_LOOP_SPIN
 #define BUSY_LOOP_SPIN 4096 / BUSY_PAUSE
 #endif
 
+// Defaults of the "throughput" scheduling profile.  The profile can be changed
+// at run time with CILK_SCHED_PROFILE or __cilkrts_set_sched_profile, and each
+// value can be overridden individually through the environment.
+
+#ifndef NAP_NSEC
+// Nanoseconds that a sentinel worker should sleep if it reaches the disengage
+// threshold but does not disengage.
+#define NAP_NSEC 25000
+#endif
+
+#ifndef SLEEP_NSEC
+#define SLEEP_NSEC NAP_NSEC
+#endif
+
+#ifndef AS_RATIO
+// Ratio of active workers over sentinels that the system aims to maintain.
+#define AS_RATIO 2
+#endif
+
+#ifndef DEFAULT_HISTORY_THRESHOLD
+// Amount of the 32-sample history that must be efficient/inefficient to
+// reengage/disengage workers.
+#define DEFAULT_HISTORY_THRESHOLD 24
+#endif
+
+#ifndef SELF_TUNE_WINDOW
+// Rounds of steal attempts between adjustments of the steal delay when
+// self-tuning is enabled (CILK_SELF_TUNE).
+#define SELF_TUNE_WINDOW 1024
+#endif
+
+#ifndef ADAPT_SAMPLE_NSEC
+// Minimum time between samples of CPU throttling and load when the number of
+// engaged workers adapts to them (CILK_ADAPT_NWORKERS).
+#define ADAPT_SAMPLE_NSEC 10000000
+#endif
+
 #ifndef ENABLE_THIEF_SLEEP
 #define ENABLE_THIEF_SLEEP 1
 #endif
@@ -58,10 +106,6 @@
 #define ENABLE_EXTENSION 1
 #endif
 
-#ifndef ENABLE_WORKER_PINNING
-#define ENABLE_WORKER_PINNING 0
-#endif
-
 #ifndef MIN_NUM_PAGES_PER_STACK
 #define MIN_NUM_PAGES_PER_STACK 4 // must be greater than 1
 #endif
@@ -82,6 +126,44 @@ _Static_assert(MAX_NUM_PAGES_PER_STACK >= MIN_NUM_PAGES_PER_STACK, "Invalid Chee
 #define DEFAULT_DEQ_DEPTH 1024
 #endif
 
+#ifndef SHADOW_STACK_RESERVE_DEPTH
+// Entries of virtual memory reserved for each worker's shadow stack.  Pages of
+// the reservation are only committed when a spawn chain first reaches them, so
+// the reservation costs little resident memory.  CILK_DEQDEPTH can raise it.
+#define SHADOW_STACK_RESERVE_DEPTH (1U << 20)
+#endif
+
+#ifndef LEAPFROG_MAX_VICTIMS
+// Maximum number of workers that a worker blocked at a sync records to steal
+// back from when leapfrogging (CILK_LEAPFROG).
+#define LEAPFROG_MAX_VICTIMS 4
+#endif
+
+#ifndef MAX_WAKE_FANOUT
+// Maximum number of workers that each woken worker wakes in turn with
+// tree-structured wakeup (CILK_WAKE_FANOUT).
+#define MAX_WAKE_FANOUT 64
+#endif
+
+#ifndef STARTUP_FANOUT
+// Number of worker threads that each worker thread creates at startup.  The
+// threads are created as a tree, so that starting many workers does not wait
+// on one thread's pthread_create calls.
+#define STARTUP_FANOUT 4
+#endif
+
+#ifndef WARMUP_PREFAULT_BYTES
+// Bytes at the top of each fiber stack, and at the base of each shadow stack,
+// that warm-up (__cilkrts_warmup, CILK_WARMUP) faults in ahead of time.
+#define WARMUP_PREFAULT_BYTES (64 * 1024)
+#endif
+
+#ifndef MUTEX_SPIN_PAUSES
+// Pauses that a thread waiting on a __cilkrts_mutex without parking spins for
+// before it starts yielding the CPU between attempts.
+#define MUTEX_SPIN_PAUSES 128
+#endif
+
 #ifndef LG_STACK_SIZE
 #define LG_STACK_SIZE 20 // 1 MBytes
 #endif
@@ -94,6 +176,74 @@ _Static_assert(MAX_NUM_PAGES_PER_STACK >= MIN_NUM_PAGES_PER_STACK, "Invalid Chee
 #define DEFAULT_FIBER_POOL_CAP 8 // initial per-worker fiber pool capacity
 #endif
 
+#ifndef FIBER_TRIM_HOT_FIBERS
+// Free fibers at the top of each fiber pool, which are reused first, that
+// CILK_FIBER_TRIM leaves whole while the pool is in use.
+#define FIBER_TRIM_HOT_FIBERS 2
+#endif
+
+#ifndef FIBER_TRIM_KEEP_BYTES
+// Bytes at the top of each fiber stack that trimming keeps resident.
+#define FIBER_TRIM_KEEP_BYTES (64 * 1024)
+#endif
+
+#ifndef FIBER_TRIM_LAZY
+// Trim with MADV_FREE, which lets the kernel reclaim the pages when it needs
+// them, where available.  Set to 0 to use MADV_DONTNEED, which drops them
+// from RSS at once.
+#define FIBER_TRIM_LAZY 1
+#endif
+
+#ifndef FIBER_ARENA_REGION_STACKS
+// Fiber stacks carved from each mapping of the fiber arena, by default.
+// CILK_FIBER_ARENA=0 maps every fiber stack on its own instead, as does a
+// kernel that cannot guard a slot without splitting its mapping.
+#define FIBER_ARENA_REGION_STACKS 64
+#endif
+
+#ifndef FIBER_ARENA_SHARDS
+// Shards of the fiber arena, each with its own regions and lock.  Worker w
+// takes fiber stacks from shard w % FIBER_ARENA_SHARDS.
+#define FIBER_ARENA_SHARDS 16
+#endif
+_Static_assert(FIBER_ARENA_SHARDS >= 1, "Invalid Cheetah RTS config: FIBER_ARENA_SHARDS must be positive");
+
+#ifndef STACK_PROFILE_HEADROOM
+// Percentage above the deepest stack use seen that the stack size recommended
+// by CILK_STACK_PROFILE leaves to spare.
+#define STACK_PROFILE_HEADROOM 50
+#endif
+
+#ifndef STACK_CLASS_MAX
+// Fiber stack classes that CILK_STACK_CLASSES may list.  A frame records its
+// class in two bits of its flags, so this is at most 4.
+#define STACK_CLASS_MAX 4
+#endif
+_Static_assert(STACK_CLASS_MAX >= 1 && STACK_CLASS_MAX <= 4, "Invalid Cheetah RTS config: STACK_CLASS_MAX must be between 1 and 4");
+
+#ifndef FIBER_GUARD_ALTSTACK_SIZE
+// Size of the alternate signal stack on which a thread handles an overflow of
+// a fiber stack, with CILK_OVERFLOW_HANDLER.
+#define FIBER_GUARD_ALTSTACK_SIZE (64 * 1024)
+#endif
+
+#ifndef DEFAULT_STEAL_ESCALATE
+// Consecutive failed steal attempts at one level of the machine hierarchy
+// before a thief using hierarchical victim selection moves to the next level.
+#define DEFAULT_STEAL_ESCALATE 8
+#endif
+
+#ifndef MAX_STEAL_BATCH
+// Maximum number of frames a thief may take from a victim in one steal.
+#define MAX_STEAL_BATCH 16
+#endif
+
+#ifndef HYBRID_FAST_STAY
+// On a hybrid machine, a sentinel on a fast core disengages only at this many
+// times the surplus of sentinels that disengages a sentinel on a slow core.
+#define HYBRID_FAST_STAY 2
+#endif
+
 #ifndef MAX_CALLBACKS
 #define MAX_CALLBACKS 32 // Maximum number of init or exit callbacks
 #endif
@@ -8,6 +8,7 @@
 #include "internal-malloc-impl.h"
 #include "local.h"
 #include "sched_stats.h"
+#include "topology.h"
 #include "types.h"
 
 #if SCHED_STATS
@@ -63,6 +64,14 @@ void cilk_global_sched_stats_init(struct global_sched_stats *s) {
     s->repos = 0;
     s->reeng_rqsts = 0;
     s->onesen_rqsts = 0;
+    s->steal_fails = 0;
+    s->summary_skips = 0;
+    s->summary_clears = 0;
+    s->batch_steals = 0;
+    s->leapfrog_attempts = 0;
+    s->leapfrog_hits = 0;
+    s->slow_steal_attempts = 0;
+    s->mutex_parks = 0;
     for (int i = 0; i < NUMBER_OF_STATS; ++i) {
         s->time[i] = 0.0;
         s->count[i] = 0;
@@ -80,6 +89,14 @@ void cilk_sched_stats_init(struct sched_stats *s) {
     s->repos = 0;
     s->reeng_rqsts = 0;
     s->onesen_rqsts = 0;
+    s->steal_fails = 0;
+    s->summary_skips = 0;
+    s->summary_clears = 0;
+    s->batch_steals = 0;
+    s->leapfrog_attempts = 0;
+    s->leapfrog_hits = 0;
+    s->slow_steal_attempts = 0;
+    s->mutex_parks = 0;
 }
 
 void cilk_start_timing(__cilkrts_worker *w, enum timing_type t) {
@@ -167,6 +184,14 @@ static void sched_stats_reset_worker(__cilkrts_worker *w,
     l->stats.repos = 0;
     l->stats.reeng_rqsts = 0;
     l->stats.onesen_rqsts = 0;
+    l->stats.steal_fails = 0;
+    l->stats.summary_skips = 0;
+    l->stats.summary_clears = 0;
+    l->stats.batch_steals = 0;
+    l->stats.leapfrog_attempts = 0;
+    l->stats.leapfrog_hits = 0;
+    l->stats.slow_steal_attempts = 0;
+    l->stats.mutex_parks = 0;
 }
 
 #define COL_DESC "%15s"
@@ -192,11 +217,35 @@ static void sched_stats_print_worker(__cilkrts_worker *w, void *data) {
     g->stats.repos += l->stats.repos;
     g->stats.reeng_rqsts += l->stats.reeng_rqsts;
     g->stats.onesen_rqsts += l->stats.onesen_rqsts;
+    g->stats.steal_fails += l->stats.steal_fails;
+    g->stats.summary_skips += l->stats.summary_skips;
+    g->stats.summary_clears += l->stats.summary_clears;
+    g->stats.batch_steals += l->stats.batch_steals;
+    g->stats.leapfrog_attempts += l->stats.leapfrog_attempts;
+    g->stats.leapfrog_hits += l->stats.leapfrog_hits;
+    g->stats.slow_steal_attempts += l->stats.slow_steal_attempts;
+    g->stats.mutex_parks += l->stats.mutex_parks;
 
     fprintf(stderr, COUNT_DESC, l->stats.steals);
     fprintf(stderr, COUNT_DESC, l->stats.repos);
     fprintf(stderr, COUNT_DESC, l->stats.reeng_rqsts);
     fprintf(stderr, COUNT_DESC, l->stats.onesen_rqsts);
+    fprintf(stderr, COUNT_DESC, l->stats.steal_fails);
+    fprintf(stderr, COUNT_DESC, l->stats.summary_skips);
+    fprintf(stderr, COUNT_DESC, l->stats.summary_clears);
+    fprintf(stderr, COUNT_DESC, l->stats.batch_steals);
+    fprintf(stderr, COUNT_DESC, l->stats.leapfrog_attempts);
+    fprintf(stderr, COUNT_DESC, l->stats.leapfrog_hits);
+    fprintf(stderr, COUNT_DESC, l->stats.slow_steal_attempts);
+    fprintf(stderr, COUNT_DESC, l->stats.mutex_parks);
+    // Worker 0 runs on an application thread, which is never pinned.
+    if (g->topology && g->topology->pinned && !g->arena) {
+        if (w->self == 0)
+            fprintf(stderr, COUNT_HDR_DESC, "-");
+        else
+            fprintf(stderr, "%10d",
+                    topo_worker_place(g->topology, w->self)->cpu);
+    }
     fprintf(fp, "\n");
 }
 
@@ -209,6 +258,14 @@ void cilk_sched_stats_print(struct global_state *g) {
     g->stats.repos = 0;
     g->stats.reeng_rqsts = 0;
     g->stats.onesen_rqsts = 0;
+    g->stats.steal_fails = 0;
+    g->stats.summary_skips = 0;
+    g->stats.summary_clears = 0;
+    g->stats.batch_steals = 0;
+    g->stats.leapfrog_attempts = 0;
+    g->stats.leapfrog_hits = 0;
+    g->stats.slow_steal_attempts = 0;
+    g->stats.mutex_parks = 0;
 
     fprintf(stderr, "\nSCHEDULING STATS (SECONDS):\n");
     {
@@ -227,6 +284,16 @@ void cilk_sched_stats_print(struct global_state *g) {
     fprintf(stderr, COUNT_HDR_DESC, "reposses");
     fprintf(stderr, COUNT_HDR_DESC, "reengs");
     fprintf(stderr, COUNT_HDR_DESC, "onesen");
+    fprintf(stderr, COUNT_HDR_DESC, "fails");
+    fprintf(stderr, COUNT_HDR_DESC, "sumskips");
+    fprintf(stderr, COUNT_HDR_DESC, "sumclear");
+    fprintf(stderr, COUNT_HDR_DESC, "batched");
+    fprintf(stderr, COUNT_HDR_DESC, "lfprobe");
+    fprintf(stderr, COUNT_HDR_DESC, "lfhits");
+    fprintf(stderr, COUNT_HDR_DESC, "slowvict");
+    fprintf(stderr, COUNT_HDR_DESC, "parks");
+    if (g->topology && g->topology->pinned && !g->arena)
+        fprintf(stderr, COUNT_HDR_DESC, "cpu");
     fprintf(stderr, "\n");
 
     for_each_worker(g, &sched_stats_print_worker, stderr);
@@ -239,6 +306,14 @@ void cilk_sched_stats_print(struct global_state *g) {
     fprintf(stderr, COUNT_DESC, g->stats.repos);
     fprintf(stderr, COUNT_DESC, g->stats.reeng_rqsts);
     fprintf(stderr, COUNT_DESC, g->stats.onesen_rqsts);
+    fprintf(stderr, COUNT_DESC, g->stats.steal_fails);
+    fprintf(stderr, COUNT_DESC, g->stats.summary_skips);
+    fprintf(stderr, COUNT_DESC, g->stats.summary_clears);
+    fprintf(stderr, COUNT_DESC, g->stats.batch_steals);
+    fprintf(stderr, COUNT_DESC, g->stats.leapfrog_attempts);
+    fprintf(stderr, COUNT_DESC, g->stats.leapfrog_hits);
+    fprintf(stderr, COUNT_DESC, g->stats.slow_steal_attempts);
+    fprintf(stderr, COUNT_DESC, g->stats.mutex_parks);
     fprintf(stderr, "\n");
 
     for_each_worker(g, &sched_stats_reset_worker, NULL);
@@ -29,6 +29,14 @@ struct sched_stats {
     uint64_t repos;
     uint64_t reeng_rqsts;
     uint64_t onesen_rqsts;
+    uint64_t steal_fails;
+    uint64_t summary_skips;
+    uint64_t summary_clears;
+    uint64_t batch_steals;
+    uint64_t leapfrog_attempts;
+    uint64_t leapfrog_hits;
+    uint64_t slow_steal_attempts;
+    uint64_t mutex_parks;
 };
 
 struct global_sched_stats {
@@ -42,6 +50,14 @@ struct global_sched_stats {
     uint64_t repos;
     uint64_t reeng_rqsts;
     uint64_t onesen_rqsts;
+    uint64_t steal_fails;
+    uint64_t summary_skips;
+    uint64_t summary_clears;
+    uint64_t batch_steals;
+    uint64_t leapfrog_attempts;
+    uint64_t leapfrog_hits;
+    uint64_t slow_steal_attempts;
+    uint64_t mutex_parks;
     double time[NUMBER_OF_STATS]; // Total time measured for all stats
     uint64_t count[NUMBER_OF_STATS];
 };
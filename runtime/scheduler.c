@@ -21,11 +21,14 @@
 #include "fiber.h"
 #include "frame.h"
 #include "global.h"
+#include "init.h"
 #include "jmpbuf.h"
 #include "local-hypertable.h"
 #include "local.h"
 #include "readydeque.h"
 #include "scheduler.h"
+#include "strand-mutex.h"
+#include "topology.h"
 #include "worker_coord.h"
 #include "worker_sleep.h"
 
@@ -37,8 +40,9 @@
 // pedigrees.
 bool __cilkrts_use_extension = false;
 
-// Boolean tracking whether the execution is currently in a cilkified region.
-bool __cilkrts_need_to_cilkify = true;
+// Boolean tracking whether the execution on this thread is currently in a
+// cilkified region.  Worker threads other than the boss are always in one.
+__thread bool __cilkrts_need_to_cilkify = true;
 
 // TLS pointer to the current worker structure.
 __thread __cilkrts_worker *__cilkrts_tls_worker = &default_worker;
@@ -70,6 +74,130 @@ static unsigned int get_rand(unsigned int state) {
     return state >> 16;
 }
 
+// Choose a random victim not equal to self from the first stealable entries of
+// index_to_worker.
+static inline worker_id choose_random_victim(const worker_id *index_to_worker,
+                                             uint32_t stealable, worker_id self,
+                                             unsigned int *rand_state) {
+    unsigned int state = *rand_state;
+    worker_id victim = index_to_worker[get_rand(state) % stealable];
+    state = update_rand_state(state);
+    while (victim == self) {
+        victim = index_to_worker[get_rand(state) % stealable];
+        state = update_rand_state(state);
+    }
+    *rand_state = state;
+    return victim;
+}
+
+// Choose a victim for hierarchical stealing.  The thief picks a random peer
+// within distance *level of itself in the machine hierarchy, skipping levels
+// with no peers.  At the remote level, or if the chosen peer is currently
+// disengaged, fall back to a random victim among the stealable workers.
+static inline worker_id
+choose_near_victim(const worker_id *peers, const uint32_t *level_end,
+                   const worker_id *index_to_worker,
+                   const worker_id *worker_to_index, uint32_t stealable,
+                   worker_id self, unsigned int *level,
+                   unsigned int *rand_state) {
+    while (*level < TOPO_LEVEL_REMOTE && level_end[*level] == 0)
+        ++*level;
+    if (*level < TOPO_LEVEL_REMOTE) {
+        worker_id victim = peers[get_rand(*rand_state) % level_end[*level]];
+        *rand_state = update_rand_state(*rand_state);
+        if (worker_to_index[victim] < stealable)
+            return victim;
+    }
+    return choose_random_victim(index_to_worker, stealable, self, rand_state);
+}
+
+// Choose a victim whose bit is set in the worker bitmap marked, scanning
+// cyclically from a random position.  Returns NO_WORKER if no worker other than
+// self is marked.  Bits of workers past nworkers, which the bitmap may still
+// hold after the pool shrinks, are ignored.
+static inline worker_id choose_marked_victim(_Atomic uint64_t *marked,
+                                             unsigned int nwords,
+                                             unsigned int nworkers,
+                                             worker_id self,
+                                             unsigned int *rand_state) {
+    unsigned int start = get_rand(*rand_state) % nworkers;
+    *rand_state = update_rand_state(*rand_state);
+    unsigned int word = start / 64;
+    uint64_t first_mask = ~(uint64_t)0 << (start % 64);
+    for (unsigned int i = 0; i <= nwords; ++i) {
+        uint64_t bits = atomic_load_explicit(&marked[word],
+                                             memory_order_relaxed);
+        if (word == self / 64)
+            bits &= ~((uint64_t)1 << (self % 64));
+        if (word >= nworkers / 64)
+            bits &= word > nworkers / 64
+                        ? 0
+                        : ((uint64_t)1 << (nworkers % 64)) - 1;
+        if (i == 0)
+            bits &= first_mask;
+        if (bits)
+            return word * 64 + __builtin_ctzll(bits);
+        word = (word + 1 == nwords) ? 0 : word + 1;
+    }
+    return NO_WORKER;
+}
+
+// Record whether this worker runs on a slow core of a hybrid machine, for the
+// thieves that prefer slow victims and for the choice of sentinels to
+// disengage.
+static inline void update_core_class(global_state *const rts, worker_id self) {
+    bool slow = cpu_is_slow(rts->slow_cpus, cilk_current_cpu());
+    if (slow == worker_on_slow_core(rts, self))
+        return;
+    uint64_t bit = (uint64_t)1 << (self % 64);
+    if (slow)
+        atomic_fetch_or_explicit(&rts->slow_workers[self / 64], bit,
+                                 memory_order_relaxed);
+    else
+        atomic_fetch_and_explicit(&rts->slow_workers[self / 64], ~bit,
+                                  memory_order_relaxed);
+}
+
+/***
+ * The stealable-work summary, if CILK_STEAL_SUMMARY is set, has one bit per
+ * worker, packed into as few cache lines as possible.  A worker sets its bit
+ * when it adds a closure to its empty ready deque, before it runs that closure
+ * and pushes any frames.  A thief clears the bit when it finds the deque empty.
+ * Both happen under the deque lock, so the bit of a worker that holds any work
+ * to steal is always set, and thieves need not probe workers whose bit is
+ * clear.  Neither the spawn nor the return path touches the summary: a bit
+ * stays set while its worker runs, and is cleared lazily by the first thief to
+ * find the worker idle.
+ ***/
+static inline bool summary_has_work(const _Atomic uint64_t *summary,
+                                    worker_id victim) {
+    return atomic_load_explicit(&summary[victim / 64], memory_order_relaxed) &
+           ((uint64_t)1 << (victim % 64));
+}
+
+// Set the bit of self after adding a closure to its own deque, which may have
+// been empty.  The caller holds the lock on that deque.
+static inline void summary_mark(global_state *const rts, worker_id self) {
+    _Atomic uint64_t *summary = rts->steal_summary;
+    if (!summary || summary_has_work(summary, self))
+        return;
+    atomic_fetch_or_explicit(&summary[self / 64], (uint64_t)1 << (self % 64),
+                             memory_order_relaxed);
+}
+
+// Clear the bit of victim if its deque is empty.  The caller holds the lock on
+// that deque.
+static void summary_clear_empty(__cilkrts_worker *const w, ReadyDeque *deques,
+                                worker_id victim) {
+    _Atomic uint64_t *summary = w->g->steal_summary;
+    if (!summary || deques[victim].top || !summary_has_work(summary, victim))
+        return;
+    atomic_fetch_and_explicit(&summary[victim / 64],
+                              ~((uint64_t)1 << (victim % 64)),
+                              memory_order_relaxed);
+    WHEN_SCHED_STATS(w->l->stats.summary_clears++);
+}
+
 static void worker_change_state(__cilkrts_worker *w,
                                 enum __cilkrts_worker_state s) {
     /* TODO: Update statistics based on state change. */
@@ -299,7 +427,9 @@ static Closure *provably_good_steal_maybe(__cilkrts_worker *const w,
     //               (void *)parent);
     CILK_ASSERT(!l->provably_good_steal);
 
-    if (!Closure_has_children(parent) && parent->status == CLOSURE_SUSPENDED) {
+    // A closure parked on a mutex is suspended, but not at a sync.
+    if (!Closure_has_children(parent) && parent->status == CLOSURE_SUSPENDED &&
+        !parent->mutex_parked) {
         // cilkrts_alert(STEAL | ALERT_SYNC,
         //      "(provably_good_steal_maybe) completing a sync");
 
@@ -767,7 +897,7 @@ static Closure *promote_child(__cilkrts_stack_frame **head, ReadyDeque *deques,
      * stacklet is stolen, and it's call parent is promoted into full and
      * suspended
      */
-    CILK_ASSERT(cl == w->g->root_closure || cl->spawn_parent ||
+    CILK_ASSERT(cl->is_root || cl->spawn_parent ||
                        cl->call_parent);
 
     Closure *spawn_parent = NULL;
@@ -925,6 +1055,25 @@ static void finish_promote(__cilkrts_worker *const w, worker_id self,
     return;
 }
 
+// Stack class of the fiber for the stolen continuation res, which was
+// promoted from the stacklet of cl: the class of the fiber that the stacklet
+// runs on, or a larger one that a frame in the stacklet asks for.
+static unsigned int stolen_stack_class(Closure *cl, Closure *res) {
+    unsigned int cls = cl->fiber->stack_class;
+    // Walk the stolen stacklet as oldest_non_stolen_frame_in_stacklet does,
+    // up to the stolen frame above it.  The call_parent of the oldest frame
+    // of a region, or of a frame past that, may be stale.
+    for (__cilkrts_stack_frame *sf = res->frame; sf; sf = sf->call_parent) {
+        unsigned int frame_cls = __cilkrts_frame_stack_class(sf);
+        if (frame_cls > cls)
+            cls = frame_cls;
+        if (sf == cl->frame || (sf != res->frame && __cilkrts_stolen(sf)) ||
+            (sf->flags & (CILK_FRAME_DETACHED | CILK_FRAME_LAST)))
+            break;
+    }
+    return cls;
+}
+
 /***
  * ANGE: This function promotes all frames in the top-most stacklet into
  * its own closures and also creates a new child closure to leave it with
@@ -969,9 +1118,10 @@ static Closure *extract_top_spawning_closure(__cilkrts_stack_frame **head,
         CILK_ASSERT_POINTER_EQUAL(cl, res);
     }
 
-    res->fiber = cilk_fiber_allocate_from_pool(w);
+    unsigned int stack_class = stolen_stack_class(cl, res);
+    res->fiber = cilk_fiber_allocate_from_pool(w, stack_class);
     if (USE_EXTENSION) {
-        res->ext_fiber = cilk_fiber_allocate_from_pool(w);
+        res->ext_fiber = cilk_fiber_allocate_from_pool(w, 0);
     }
 
     // make sure we are not holding the lock on child
@@ -984,6 +1134,224 @@ static Closure *extract_top_spawning_closure(__cilkrts_stack_frame **head,
     return res;
 }
 
+/***
+ * Batched stealing.  After a successful steal, the thief may take up to max
+ * more of the victim's oldest frames in the same critical section, but no more
+ * than half of the frames remaining on the victim's deque.  Each extra frame is
+ * promoted exactly as by a separate steal.  The extra closures are returned
+ * locked in extra[], oldest first.
+ *
+ * NOTE: this function assumes that w holds the lock on victim_w's deque.
+ ***/
+static unsigned int steal_extra_frames(ReadyDeque *deques,
+                                       __cilkrts_worker *const w,
+                                       __cilkrts_worker *const victim_w,
+                                       worker_id self, worker_id victim,
+                                       unsigned int max, Closure **extra) {
+    deque_assert_ownership(deques, self, victim);
+    __cilkrts_stack_frame **head =
+        atomic_load_explicit(&victim_w->head, memory_order_relaxed);
+    __cilkrts_stack_frame **tail =
+        atomic_load_explicit(&victim_w->tail, memory_order_relaxed);
+    unsigned int half = tail > head ? (tail - head) / 2 : 0;
+    if (max > half)
+        max = half;
+
+    unsigned int n = 0;
+    while (n < max) {
+        Closure *cl = deque_peek_top(deques, w, self, victim);
+        if (!cl || Closure_trylock(self, cl) == 0)
+            break;
+        if (cl->status != CLOSURE_RUNNING) {
+            Closure_unlock(self, cl);
+            break;
+        }
+        head = do_dekker_on(self, victim_w, cl);
+        if (!head) {
+            Closure_unlock(self, cl);
+            break;
+        }
+        extra[n++] = extract_top_spawning_closure(head, deques, w, victim_w,
+                                                  cl, self, victim);
+    }
+    return n;
+}
+
+/***
+ * Finish promoting the extra closures of a batched steal and park them, READY,
+ * on the thief's own deque, where the thief or other thieves can take them.
+ * The oldest closure ends up at the top of the deque.
+ ***/
+static void park_extra_closures(ReadyDeque *deques, __cilkrts_worker *const w,
+                                worker_id self,
+                                __cilkrts_worker *const victim_w,
+                                Closure **extra, unsigned int nextra) {
+    for (unsigned int i = 0; i < nextra; ++i) {
+        Closure_assert_ownership(self, extra[i]);
+        finish_promote(w, self, victim_w, extra[i],
+                       /* has_frames_to_promote */ false);
+        // MUST unlock the closure before locking the queue
+        // (rule A in file PROTOCOLS)
+        Closure_unlock(self, extra[i]);
+    }
+
+    deque_lock_self(deques, self);
+    for (unsigned int i = 0; i < nextra; ++i)
+        deque_add_bottom(deques, extra[i], self, self);
+    atomic_store_explicit(&deques[self].num_ready,
+                          deques[self].num_ready + nextra,
+                          memory_order_release);
+    summary_mark(w->g, self);
+    deque_unlock_self(deques, self);
+
+    WHEN_SCHED_STATS(w->l->stats.batch_steals += nextra);
+}
+
+// Remove the parked READY closure cl from the top of deque pn.  The caller
+// holds the locks on deque pn and on cl.
+static Closure *take_parked_top(ReadyDeque *deques, worker_id self,
+                                worker_id pn, Closure *cl) {
+    Closure *res = deque_xtract_top(deques, self, pn);
+    CILK_ASSERT_POINTER_EQUAL(cl, res);
+    CILK_ASSERT(res->status == CLOSURE_READY && res->fiber);
+    atomic_store_explicit(&deques[pn].num_ready, deques[pn].num_ready - 1,
+                          memory_order_relaxed);
+    return res;
+}
+
+// Take a READY closure parked on this worker's own deque by a batched steal or
+// a parking strand, or return NULL if there is none.  Only called from the scheduling loop, when
+// the worker is not running any closure.
+static Closure *take_parked_closure(ReadyDeque *deques,
+                                    __cilkrts_worker *const w,
+                                    worker_id self) {
+    if (!atomic_load_explicit(&deques[self].num_ready, memory_order_relaxed))
+        return NULL;
+
+    deque_lock_self(deques, self);
+    Closure *t = deque_xtract_bottom(deques, self, self);
+    if (t) {
+        CILK_ASSERT(t->status == CLOSURE_READY);
+        atomic_store_explicit(&deques[self].num_ready,
+                              deques[self].num_ready - 1,
+                              memory_order_relaxed);
+    }
+    deque_unlock_self(deques, self);
+
+    if (t) {
+        Closure_lock(self, t);
+        setup_for_execution(w, t);
+        Closure_unlock(self, t);
+    }
+    return t;
+}
+
+// Take the oldest guest region that no worker has started yet, and set up its
+// root closure to run on w.  Returns NULL if another worker took it first.
+static Closure *take_guest_root(global_state *g, __cilkrts_worker *const w) {
+    if (!atomic_load_explicit(&g->pending_roots, memory_order_acquire))
+        return NULL;
+
+    pthread_mutex_lock(&g->roots_lock);
+    struct guest_root *root = NULL;
+    for (struct guest_root *r = g->guest_roots; r; r = r->next) {
+        // New roots are pushed at the head of the list.
+        if (r->pending)
+            root = r;
+    }
+    Closure *t = NULL;
+    if (root) {
+        root->pending = false;
+        atomic_fetch_sub_explicit(&g->pending_roots, 1, memory_order_relaxed);
+        t = root->closure;
+    }
+    pthread_mutex_unlock(&g->roots_lock);
+
+    if (t) {
+        cilkrts_alert(SCHED, "(take_guest_root) closure %p", (void *)t);
+        setup_for_execution(w, t);
+        w->l->start_task = root->fn != NULL;
+    }
+    return t;
+}
+
+// Take the oldest strand woken by an unlock of the mutex it is parked on, and
+// set up its closure to resume on w.  Returns NULL if there is none.
+static Closure *take_mutex_waiter(global_state *g, __cilkrts_worker *const w) {
+    if (!atomic_load_explicit(&g->pending_waiters, memory_order_acquire))
+        return NULL;
+
+    pthread_mutex_lock(&g->ready_waiters_lock);
+    struct __cilkrts_mutex_waiter *r = g->ready_waiters;
+    if (r) {
+        g->ready_waiters = r->next;
+        if (!g->ready_waiters)
+            g->ready_waiters_tail = NULL;
+        atomic_fetch_sub_explicit(&g->pending_waiters, 1,
+                                  memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&g->ready_waiters_lock);
+    if (!r)
+        return NULL;
+
+    Closure *t = r->closure;
+    worker_id self = w->self;
+    cilkrts_alert(SCHED, "(take_mutex_waiter) closure %p", (void *)t);
+    Closure_lock(self, t);
+    CILK_ASSERT(t->status == CLOSURE_SUSPENDED && t->mutex_parked);
+    t->mutex_parked = false;
+    Closure_set_status(t, CLOSURE_RUNNING);
+    struct cilk_fiber *fh = t->fiber;
+    fh->worker = w;
+    Closure_unlock(self, t);
+
+    // The strand parked with an empty deque.  Resume it at the same depth of
+    // this worker's shadow stack.
+    __cilkrts_stack_frame **head = w->l->shadow_stack + r->base;
+    atomic_store_explicit(&w->head, head, memory_order_relaxed);
+    atomic_store_explicit(&w->exc, head, memory_order_relaxed);
+    atomic_store_explicit(&w->tail, head, memory_order_release);
+
+    __cilkrts_current_fh = fh;
+    w->l->resume_waiter = r;
+    return t;
+}
+
+/***
+ * Self-tuning of the steal delay.  A thief that mostly fails to steal backs off
+ * by raising the delay between rounds of steal attempts.  A thief that often
+ * succeeds, but finds little work per steal, lowers the delay to steal again
+ * sooner.  The work per steal comes from the same samples that
+ * decrease_fails_by_work uses.  Each adjustment is 1/8 of the current scale,
+ * and the scale stays within STEAL_DELAY_SCALE_RANGE of the profile's scale.
+ ***/
+static void self_tune_steal_delay(global_state *rts, unsigned int rounds,
+                                  unsigned int hits, uint64_t work,
+                                  unsigned int samples) {
+    const uint32_t base =
+        sched_tuning(rts)->steal_delay_pct * STEAL_DELAY_SCALE_ONE / 100;
+    uint32_t scale =
+        atomic_load_explicit(&rts->steal_delay_scale, memory_order_relaxed);
+    uint32_t new_scale = scale;
+    if (hits * 64 < rounds)
+        new_scale = scale + scale / 8 + 1;
+    else if (hits * 8 > rounds && samples > 0 &&
+             work / samples < STEAL_DELAY_SMALL_WORK)
+        new_scale = scale - scale / 8;
+
+    const uint32_t lo = base / STEAL_DELAY_SCALE_RANGE;
+    const uint32_t hi = base * STEAL_DELAY_SCALE_RANGE;
+    if (new_scale < lo)
+        new_scale = lo > 0 ? lo : 1;
+    if (new_scale > hi)
+        new_scale = hi;
+    // Losing a race with another worker's adjustment is fine.
+    if (new_scale != scale)
+        atomic_compare_exchange_strong_explicit(
+            &rts->steal_delay_scale, &scale, new_scale, memory_order_relaxed,
+            memory_order_relaxed);
+}
+
 /*
  * stealing protocol.  Tries to steal from the victim; returns a
  * stolen closure, or NULL if none.
@@ -991,7 +1359,8 @@ static Closure *extract_top_spawning_closure(__cilkrts_stack_frame **head,
 static Closure *Closure_steal(__cilkrts_worker **workers,
                               ReadyDeque *deques,
                               __cilkrts_worker *const w,
-                              worker_id self, worker_id victim) {
+                              worker_id self, worker_id victim,
+                              unsigned int batch) {
 
     Closure *cl;
     Closure *res = (Closure *)NULL;
@@ -999,12 +1368,22 @@ static Closure *Closure_steal(__cilkrts_worker **workers,
     victim_w = workers[victim];
 
     // Fast test for an unsuccessful steal attempt using only read operations.
-    // This fast test seems to improve parallel performance.
+    // This fast test seems to improve parallel performance.  The victim may
+    // also have READY closures parked on its deque.
     __cilkrts_stack_frame **head =
         atomic_load_explicit(&victim_w->head, memory_order_relaxed);
     __cilkrts_stack_frame **tail =
         atomic_load_explicit(&victim_w->tail, memory_order_relaxed);
-    if (head >= tail) {
+    if (head >= tail &&
+        !atomic_load_explicit(&deques[victim].num_ready,
+                              memory_order_relaxed)) {
+        // The victim may be idle with its bit still set.
+        _Atomic uint64_t *summary = w->g->steal_summary;
+        if (summary && summary_has_work(summary, victim) &&
+            deque_trylock(deques, self, victim)) {
+            summary_clear_empty(w, deques, victim);
+            deque_unlock(deques, self, victim);
+        }
         return NULL;
     }
 
@@ -1036,6 +1415,14 @@ static Closure *Closure_steal(__cilkrts_worker **workers,
                 res = extract_top_spawning_closure(head, deques, w, victim_w,
                                                    cl, self, victim);
 
+                // In batched mode, keep promoting the oldest frames of the
+                // victim while we hold its deque lock.
+                Closure *extra[MAX_STEAL_BATCH];
+                unsigned int nextra = 0;
+                if (batch > 1)
+                    nextra = steal_extra_frames(deques, w, victim_w, self,
+                                                victim, batch - 1, extra);
+
                 // at this point, more steals can happen from the victim.
                 deque_unlock(deques, self, victim);
 
@@ -1054,11 +1441,35 @@ static Closure *Closure_steal(__cilkrts_worker **workers,
                               (void *)res->right_most_child->fiber);
                 setup_for_execution(w, res);
                 Closure_unlock(self, res);
+
+                // Parking locks our own deque, so it must wait until res is
+                // unlocked (rule A in file PROTOCOLS).
+                if (nextra > 0)
+                    park_extra_closures(deques, w, self, victim_w, extra,
+                                        nextra);
             } else {
                 goto give_up;
             }
             break;
         }
+        case CLOSURE_READY:
+            // A READY closure at the top of a deque was parked there by a
+            // batched steal or a parking strand.  Take it as is; it already
+            // has a fiber.
+            if (!cl->is_root &&
+                atomic_load_explicit(&deques[victim].num_ready,
+                                     memory_order_relaxed) > 0) {
+                res = take_parked_top(deques, self, victim, cl);
+                deque_unlock(deques, self, victim);
+                cilkrts_alert(STEAL,
+                              "(Closure_steal) took parked closure %p from W%d",
+                              (void *)res, victim);
+                setup_for_execution(w, res);
+                Closure_unlock(self, res);
+                break;
+            }
+            goto give_up;
+
         case CLOSURE_RETURNING: /* ok, let it leave alone */
         give_up:
             // MUST unlock the closure before the queue;
@@ -1068,14 +1479,15 @@ static Closure *Closure_steal(__cilkrts_worker **workers,
             break;
 
         default:
-            // It's possible that this steal attempt peeked the root closure
+            // It's possible that this steal attempt peeked a root closure
             // from the top of a deque while a new Cilkified region was
             // starting.
-            if (cl != w->g->root_closure)
+            if (!cl->is_root)
                 cilkrts_bug("Bug: %s closure in ready deque",
                             Closure_status_to_str(cl->status));
         }
     } else {
+        summary_clear_empty(w, deques, victim);
         deque_unlock(deques, self, victim);
         //----- EVENT_STEAL_EMPTY_DEQUE
     }
@@ -1140,6 +1552,77 @@ void promote_own_deque(__cilkrts_worker *w) {
     }
 }
 
+/***
+ * Protocol for exposing a worker's own deque.
+ *
+ * This is used by a strand that parks on a mutex, which would otherwise take
+ * the unstolen frames on its worker's deque with it.  The holder of the mutex
+ * may be waiting for one of those ancestors of the strand to be stolen.  The
+ * worker promotes its own frames exactly as thieves would steal them, oldest
+ * first, and parks the stolen continuations READY on its deque, as the extra
+ * closures of a batched steal, where thieves or the worker itself can take
+ * them.  The strand is left running in the youngest spawned child, alone at
+ * the bottom of the deque.  Returns the number of closures parked.
+ ***/
+unsigned int expose_own_deque(__cilkrts_worker *w) {
+
+    ReadyDeque *deques = w->g->deques;
+    worker_id self = w->self;
+    Closure *exposed[MAX_STEAL_BATCH];
+    unsigned int nexposed = 0;
+
+    deque_lock_self(deques, self);
+    bool done = false;
+    while (!done) {
+        // Promotion expects the running closure alone on the deque, so set
+        // aside the READY closures already parked above it.
+        Closure *parked = deque_xtract_above_bottom(deques, self, self);
+
+        unsigned int n = 0;
+        while (n < MAX_STEAL_BATCH) {
+            Closure *cl = deque_peek_top(deques, w, self, self);
+            if (!cl) {
+                done = true;
+                break;
+            }
+            Closure_lock(self, cl);
+            __cilkrts_stack_frame **head = NULL;
+            if (cl->status == CLOSURE_RUNNING)
+                head = do_dekker_on(self, w, cl);
+            if (!head) {
+                Closure_unlock(self, cl);
+                done = true; // no more frames to promote
+                break;
+            }
+            exposed[n++] = extract_top_spawning_closure(head, deques, w, w, cl,
+                                                        self, self);
+        }
+
+        if (n > 0) {
+            for (unsigned int i = 0; i < n; ++i) {
+                finish_promote(w, self, w, exposed[i],
+                               /* has_frames_to_promote */ false);
+                Closure_unlock(self, exposed[i]);
+            }
+            // Keep the spawned child at the bottom, below its ancestors.
+            Closure *child = deque_xtract_bottom(deques, self, self);
+            for (unsigned int i = 0; i < n; ++i)
+                deque_add_bottom(deques, exposed[i], self, self);
+            deque_add_bottom(deques, child, self, self);
+            nexposed += n;
+        }
+        if (parked)
+            deque_add_above(deques, parked, self, self);
+    }
+
+    if (nexposed > 0)
+        atomic_store_explicit(&deques[self].num_ready,
+                              deques[self].num_ready + nexposed,
+                              memory_order_release);
+    deque_unlock_self(deques, self);
+    return nexposed;
+}
+
 // ==============================================
 // Scheduling functions
 // ==============================================
@@ -1216,6 +1699,54 @@ __attribute__((noreturn)) void longjmp_to_runtime(__cilkrts_worker *w) {
    finds CILK_FRAME_UNSYCHED is set.  It returns SYNC_READY if there
    are no children and execution can continue.  Otherwise it returns
    SYNC_NOT_READY to suspend the frame. */
+/***
+ * Leapfrogging.  When a sync fails, the worker records which workers are
+ * running the outstanding children of the suspended closure, and it tries to
+ * steal back from them before stealing randomly.  Work stolen this way is a
+ * descendant of the suspended closure, which keeps the working set local and
+ * bounds the number of fibers alive in deep divide-and-conquer computations.
+ ***/
+
+// Return the worker running closure c or, if c is itself suspended at a sync,
+// the worker running one of c's descendants, searching at most depth levels
+// down.  Locks are acquired parent before child, so the caller may hold the
+// lock on c's parent.  Returns NO_WORKER if c is busy or no worker is found.
+static worker_id leapfrog_victim(worker_id self, Closure *c,
+                                 unsigned int depth) {
+    if (Closure_trylock(self, c) == 0)
+        return NO_WORKER;
+    worker_id victim = NO_WORKER;
+    if (c->status == CLOSURE_RUNNING && c->fiber) {
+        __cilkrts_worker *cw = c->fiber->worker;
+        if (cw && cw != INVALID_WORKER)
+            victim = cw->self;
+    } else if (c->status == CLOSURE_SUSPENDED && c->right_most_child &&
+               depth > 1) {
+        victim = leapfrog_victim(self, c->right_most_child, depth - 1);
+    }
+    Closure_unlock(self, c);
+    return victim;
+}
+
+// Record the workers to steal back from after t fails to sync.  The caller
+// holds the lock on t, so t's list of children is stable.
+static void record_leapfrog_victims(local_state *l, worker_id self,
+                                    Closure *t) {
+    unsigned int n = 0;
+    for (Closure *c = t->right_most_child; c && n < LEAPFROG_MAX_VICTIMS;
+         c = c->left_sib) {
+        worker_id victim = leapfrog_victim(self, c, 3);
+        if (victim == NO_WORKER || victim == self)
+            continue;
+        bool seen = false;
+        for (unsigned int i = 0; i < n; ++i)
+            seen |= (l->leapfrog_victims[i] == victim);
+        if (!seen)
+            l->leapfrog_victims[n++] = victim;
+    }
+    l->leapfrog_count = n;
+}
+
 int Cilk_sync(__cilkrts_worker *const w, __cilkrts_stack_frame *frame) {
 
     // cilkrts_alert(SYNC, "(Cilk_sync) frame %p", (void *)frame);
@@ -1246,6 +1777,8 @@ int Cilk_sync(__cilkrts_worker *const w, __cilkrts_stack_frame *frame) {
     if (Closure_has_children(t)) {
         cilkrts_alert(SYNC, "(Cilk_sync) Closure %p has outstanding children",
                       (void *)t);
+        if (w->g->options.leapfrog)
+            record_leapfrog_victims(w->l, self, t);
         if (t->fiber) {
             cilk_fiber_deallocate_to_pool(w, t->fiber);
         }
@@ -1311,13 +1844,14 @@ static void do_what_it_says(ReadyDeque *deques, __cilkrts_worker *w,
             f = t->frame;
             cilkrts_alert(SCHED, "(do_what_it_says) resume_sf = %p",
                           (void *)f);
-            CILK_ASSERT(f);
+            CILK_ASSERT(f || l->resume_waiter);
             USE_UNUSED(f);
 
             // MUST unlock the closure before locking the queue
             // (rule A in file PROTOCOLS)
             deque_lock_self(deques, self);
             deque_add_bottom(deques, t, self, self);
+            summary_mark(w->g, self);
             deque_unlock_self(deques, self);
 
             /* now execute it */
@@ -1327,6 +1861,15 @@ static void do_what_it_says(ReadyDeque *deques, __cilkrts_worker *w,
             __cilkrts_worker *volatile w_save = w;
             if (__builtin_setjmp(l->rts_ctx) == 0) {
                 worker_change_state(w, WORKER_RUN);
+                struct __cilkrts_mutex_waiter *r = l->resume_waiter;
+                if (r) {
+                    l->resume_waiter = NULL;
+                    mutex_waiter_resume(w, r);
+                }
+                if (l->start_task) {
+                    l->start_task = false;
+                    task_root_start(w, t);
+                }
                 longjmp_to_user_code(w, t);
             } else {
                 w = w_save;
@@ -1337,6 +1880,13 @@ static void do_what_it_says(ReadyDeque *deques, __cilkrts_worker *w,
                 sanitizer_finish_switch_fiber();
                 worker_change_state(w, WORKER_SCHED);
 
+                // A strand parked on a mutex kept the mutex's waiter list
+                // locked until this worker left its fiber.
+                if (l->parked_on) {
+                    mutex_waiters_unlock(l->parked_on);
+                    l->parked_on = NULL;
+                }
+
                 // If this worker finished the cilkified region, mark the
                 // computation as no longer cilkified, to signal the thread that
                 // originally cilkified the execution.
@@ -1347,6 +1897,18 @@ static void do_what_it_says(ReadyDeque *deques, __cilkrts_worker *w,
                     signal_uncilkified(g);
                     return;
                 }
+                // Likewise for a guest region, whose root fiber this worker
+                // has now left.  No thread waits for a detached task, so
+                // recycle its root here.
+                if (l->exiting_root) {
+                    struct guest_root *root = l->exiting_root;
+                    l->exiting_root = NULL;
+                    if (root->detached)
+                        guest_root_free(w->g, root);
+                    else
+                        signal_guest_done(w->g, root);
+                    return;
+                }
 
                 t = NULL;
                 if (l->returning) {
@@ -1398,6 +1960,15 @@ void do_what_it_says_boss(__cilkrts_worker *w, Closure *t) {
     worker_scheduler(w);
 }
 
+// Check if a worker should leave the work-stealing loop.  The workers keep
+// stealing until every active cilkified region is done, but the boss leaves as
+// soon as its own region is done, to return to the thread that started it.
+static inline bool sched_loop_done(global_state *g, bool is_boss) {
+    return atomic_load_explicit(&g->done, memory_order_acquire) ||
+           (is_boss && !atomic_load_explicit(&g->cilkified,
+                                             memory_order_acquire));
+}
+
 void worker_scheduler(__cilkrts_worker *w) {
     Closure *t = NULL;
     CILK_ASSERT_POINTER_EQUAL(w, __cilkrts_get_tls_worker());
@@ -1435,18 +2006,70 @@ void worker_scheduler(__cilkrts_worker *w) {
     __cilkrts_worker **workers = rts->workers;
     ReadyDeque *deques = rts->deques;
 
-    while (!atomic_load_explicit(&rts->done, memory_order_acquire)) {
+    // State for hierarchical victim selection.  The thief starts at the
+    // nearest level of the machine hierarchy and moves outward after
+    // steal_escalate consecutive failed steal attempts at a level.
+    const struct cilk_topology *topo =
+        rts->options.steal_hierarchy ? rts->topology : NULL;
+    if (topo && topo->nworkers != nworkers)
+        topo = NULL;
+    const worker_id *peers = topo ? topo_peers(topo, self) : NULL;
+    const uint32_t *level_end = topo ? topo_level_end(topo, self) : NULL;
+    const worker_id *worker_to_index = rts->worker_to_index;
+    const unsigned int steal_escalate = rts->options.steal_escalate;
+    unsigned int steal_level = TOPO_LEVEL_SMT;
+    unsigned int level_fails = 0;
+
+    // Stealable-work summary, if enabled.  Thieves use it to avoid probing
+    // workers that have nothing to steal.
+    _Atomic uint64_t *summary = rts->steal_summary;
+    const unsigned int summary_words = rts->steal_summary_words;
+
+    // Workers on the slow cores of a hybrid machine, if any.
+    _Atomic uint64_t *slow_workers = rts->slow_workers;
+
+    // Number of frames to take per steal.  Extra frames from a batched steal
+    // are parked on this worker's deque.
+    const unsigned int steal_batch = rts->options.steal_batch;
+
+    // Steal outcomes and work samples for self-tuning of the steal delay.
+    unsigned int tune_rounds = 0, tune_hits = 0, tune_samples = 0;
+    uint64_t tune_work = 0;
+
+    while (!sched_loop_done(rts, is_boss)) {
         /* A worker entering the steal loop must have saved its reducer map into
            the frame to which it belongs. */
-        CILK_ASSERT(!w->hyper_table ||
-                           (is_boss && atomic_load_explicit(
-                                           &rts->done, memory_order_acquire)));
+        CILK_ASSERT_NULL(w->hyper_table);
 
         CILK_STOP_TIMING(w, INTERVAL_SCHED);
 
-        while (!t && !atomic_load_explicit(&rts->done, memory_order_acquire)) {
+        // Each search for work starts again at the nearest level.
+        steal_level = TOPO_LEVEL_SMT;
+        level_fails = 0;
+
+        while (!t && !sched_loop_done(rts, is_boss)) {
             CILK_START_TIMING(w, INTERVAL_SCHED);
             CILK_START_TIMING(w, INTERVAL_IDLE);
+            if (slow_workers)
+                update_core_class(rts, self);
+            // Start guest regions before stealing from the running ones.
+            t = take_guest_root(rts, w);
+            // Resume strands that were handed the mutex they parked on.
+            if (!t)
+                t = take_mutex_waiter(rts, w);
+            // Run work parked on our own deque before stealing.
+            if (!t)
+                t = take_parked_closure(deques, w, self);
+            if (t) {
+#if ENABLE_THIEF_SLEEP
+                // This worker found work without stealing it.  Stop counting
+                // it as a sentinel, as go_to_sleep_maybe does after a steal.
+                fails = reset_fails(rts, fails);
+#endif
+                CILK_STOP_TIMING(w, INTERVAL_SCHED);
+                CILK_DROP_TIMING(w, INTERVAL_IDLE);
+                break;
+            }
 #if ENABLE_THIEF_SLEEP
             // Get the set of workers we can steal from and a local copy of the
             // index-to-worker map.  We'll attempt a few steals using these
@@ -1484,22 +2107,89 @@ void worker_scheduler(__cilkrts_worker *w) {
 #endif // !defined(__aarch64__) && !defined(__APPLE__)
             int attempt = ATTEMPTS;
             do {
-                // Choose a random victim not equal to self.
-                worker_id victim =
-                        index_to_worker[get_rand(rand_state) % stealable];
-                rand_state = update_rand_state(rand_state);
-                while (victim == self) {
-                    victim = index_to_worker[get_rand(rand_state) % stealable];
-                    rand_state = update_rand_state(rand_state);
+                // Choose a victim not equal to self.
+                worker_id victim;
+                bool leapfrog = false;
+                if (l->leapfrog_count > 0) {
+                    // Steal back from a worker running a descendant of the
+                    // closure suspended at our last failed sync.
+                    victim = l->leapfrog_victims[--l->leapfrog_count];
+                    leapfrog = victim < nworkers;
+                    if (!leapfrog)
+                        victim = NO_WORKER;
+                    WHEN_SCHED_STATS(l->stats.leapfrog_attempts += leapfrog);
+                } else if (slow_workers && attempt == ATTEMPTS &&
+                           !worker_on_slow_core(rts, self)) {
+                    // A thief on a fast core first tries a worker on a slow
+                    // core, to move the continuations it holds, which may be
+                    // on the critical path, to a fast core.
+                    victim = choose_marked_victim(slow_workers,
+                                                  rts->slow_workers_words,
+                                                  nworkers, self, &rand_state);
+                    if (victim != NO_WORKER &&
+                        (victim >= nworkers ||
+                         worker_to_index[victim] >= stealable))
+                        victim = NO_WORKER;
+                    WHEN_SCHED_STATS(l->stats.slow_steal_attempts +=
+                                     (victim != NO_WORKER));
+                    if (victim == NO_WORKER)
+                        victim = choose_random_victim(index_to_worker,
+                                                      stealable, self,
+                                                      &rand_state);
+                } else if (summary && !peers) {
+                    // No worker has work to steal if none is marked, but
+                    // probe a random victim anyway, as without the summary.
+                    victim = choose_marked_victim(summary, summary_words,
+                                                  nworkers, self, &rand_state);
+                    if (victim == NO_WORKER)
+                        victim = choose_random_victim(index_to_worker,
+                                                      stealable, self,
+                                                      &rand_state);
+                } else {
+                    victim = peers ? choose_near_victim(
+                                         peers, level_end, index_to_worker,
+                                         worker_to_index, stealable, self,
+                                         &steal_level, &rand_state)
+                                   : choose_random_victim(index_to_worker,
+                                                          stealable, self,
+                                                          &rand_state);
+                    if (summary && !summary_has_work(summary, victim)) {
+                        WHEN_SCHED_STATS(l->stats.summary_skips++);
+                        victim = NO_WORKER;
+                    }
                 }
                 // Attempt to steal from that victim.
-                t = Closure_steal(workers, deques, w, self, victim);
+                if (victim != NO_WORKER) {
+                    t = Closure_steal(workers, deques, w, self, victim,
+                                      steal_batch);
+                    WHEN_SCHED_STATS(if (!t) l->stats.steal_fails++);
+                }
                 if (!t) {
+                    if (++level_fails >= steal_escalate) {
+                        level_fails = 0;
+                        if (steal_level < TOPO_LEVEL_REMOTE)
+                            ++steal_level;
+                    }
                     // Pause inside this busy loop.
                     busy_loop_pause();
+                } else {
+                    steal_level = TOPO_LEVEL_SMT;
+                    level_fails = 0;
+                    l->leapfrog_count = 0;
+                    WHEN_SCHED_STATS(l->stats.leapfrog_hits += leapfrog);
                 }
             } while (!t && --attempt > 0);
 
+            if (sched_tuning(rts)->self_tune) {
+                tune_hits += (t != NULL);
+                if (++tune_rounds == SELF_TUNE_WINDOW) {
+                    self_tune_steal_delay(rts, tune_rounds, tune_hits,
+                                          tune_work, tune_samples);
+                    tune_rounds = tune_hits = tune_samples = 0;
+                    tune_work = 0;
+                }
+            }
+
 #if SCHED_STATS
             if (t) { // steal successful
                 WHEN_SCHED_STATS(w->l->stats.steals++);
@@ -1511,11 +2201,19 @@ void worker_scheduler(__cilkrts_worker *w) {
             }
 #endif
 
+            unsigned int prev_fails = fails;
             fails = go_to_sleep_maybe(
                 rts, self, nworkers, NAP_THRESHOLD, w, t, fails,
                 &sample_threshold, &inefficient_history, &efficient_history,
                 sentinel_count_history, &sentinel_count_history_tail,
                 &recent_sentinel_count);
+            if (!t && fails <= prev_fails) {
+                // The fail count drops only when this worker slept or was
+                // disengaged.  The work it wakes for may be anywhere, but
+                // look nearby first.
+                steal_level = TOPO_LEVEL_SMT;
+                level_fails = 0;
+            }
 
             if (!t) {
                 // Add some delay to the time a worker takes between steal
@@ -1540,6 +2238,11 @@ void worker_scheduler(__cilkrts_worker *w) {
                 if (fails > stealable)
                     stop += 650 * ATTEMPTS;
                 stop *= sentinel_div_lg_sentinel;
+                // Scale the delay per the scheduling profile.
+                stop = stop *
+                       atomic_load_explicit(&rts->steal_delay_scale,
+                                            memory_order_relaxed) /
+                       STEAL_DELAY_SCALE_ONE;
                 // On x86-64, the latency of a pause instruction varies between
                 // microarchitectures.  We use the cycle counter to delay by a
                 // certain amount of time, regardless of the latency of pause.
@@ -1551,6 +2254,10 @@ void worker_scheduler(__cilkrts_worker *w) {
                 if (fails > stealable)
                     pause_count += 50 * ATTEMPTS;
                 pause_count *= sentinel_div_lg_sentinel;
+                pause_count = (uint64_t)pause_count *
+                              atomic_load_explicit(&rts->steal_delay_scale,
+                                                   memory_order_relaxed) /
+                              STEAL_DELAY_SCALE_ONE;
                 // On arm64, we can't necessarily read the cycle counter without
                 // a kernel patch.  Instead, we just perform some number of
                 // pause instructions.
@@ -1581,6 +2288,8 @@ void worker_scheduler(__cilkrts_worker *w) {
             if (fails > MIN_FAILS) {
                 end = gettime_fast();
                 uint64_t elapsed = end - start;
+                tune_work += elapsed;
+                ++tune_samples;
                 // Decrement the count of failed steal attempts based on the
                 // amount of work done.
                 fails = decrease_fails_by_work(rts, fails, elapsed,
@@ -1601,7 +2310,9 @@ void worker_scheduler(__cilkrts_worker *w) {
             // before exiting the work-stealing loop, in case another cilkified
             // region is started soon.
             unsigned int busy_fail = 0;
-            while (busy_fail++ < BUSY_LOOP_SPIN &&
+            const unsigned int busy_loop_spin =
+                sched_tuning(rts)->busy_loop_spin;
+            while (busy_fail++ < busy_loop_spin &&
                    atomic_load_explicit(&rts->done, memory_order_relaxed)) {
                 busy_pause();
             }
@@ -1630,29 +2341,48 @@ void *scheduler_thread_proc(void *arg) {
 
     cilkrts_alert(BOOT, "scheduler_thread_proc");
     __cilkrts_set_tls_worker(w);
+    __cilkrts_need_to_cilkify = false;
 
     CILK_ASSERT(w->self != 0);
 
     // Initialize the worker's fiber pool.  We have each worker do this itself
-    // to improve the locality of the initial fibers.
-    cilk_fiber_pool_per_worker_init(w);
+    // to improve the locality of the initial fibers.  A worker reused after a
+    // resize of the worker pool still has its (empty) pool.
+    if (!w->l->fiber_pool.fibers)
+        cilk_fiber_pool_per_worker_init(w);
+    if (w->g->warmup_fibers > 0)
+        worker_warmup(w);
+    // Let overflows of fiber stacks on this worker promote later regions.
+    if (w->g->options.overflow_handler)
+        cilk_fiber_guard_thread_init();
 
     // Avoid redundant lookups of these commonly accessed worker fields.
     const worker_id self = w->self;
     global_state *rts = w->g;
     local_state *l = w->l;
-    const unsigned int nworkers = rts->nworkers;
+    unsigned int nworkers = rts->nworkers;
 
     // Initialize worker's random-number generator.
     rts_srand(w, (self + 1) * 162347);
 
     CILK_START_TIMING(w, INTERVAL_SLEEP_UNCILK);
     do {
+        // Sit out a resize of the worker pool, and pick up the new worker
+        // count after it.
+        if (atomic_load_explicit(&rts->resizing, memory_order_relaxed)) {
+            if (!worker_wait_resize(w))
+                return NULL;
+            nworkers = rts->nworkers;
+        }
         l->wake_val = nworkers;
         // Wait for g->start == 1 to start executing the work-stealing loop.  We
         // use a condition variable to wait on g->start, because this approach
         // seems to result in better performance.
-        if (thief_should_wait(rts)) {
+        if (thief_should_wait(rts) && !thief_idle_spin(rts)) {
+            // Give back the worker's surplus fibers and the cold stack pages
+            // of the rest before it sleeps.
+            if (rts->options.fiber_pool_shrink || rts->options.fiber_trim)
+                cilk_fiber_pool_per_worker_idle(w);
             disengage_worker(rts, nworkers, self);
             l->wake_val = thief_wait(rts);
             reengage_worker(rts, nworkers, self);
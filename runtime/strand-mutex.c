@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "cilk-internal.h"
+#include "closure.h"
+#include "debug.h"
+#include "fiber.h"
+#include "global.h"
+#include "local.h"
+#include "readydeque.h"
+#include "sched_stats.h"
+#include "scheduler.h"
+#include "strand-mutex.h"
+#include "worker_coord.h"
+
+/***
+ * Cilk-aware mutex.  A strand that finds a __cilkrts_mutex locked parks its
+ * worker's running closure on the mutex, much as a failed sync suspends it,
+ * except that the closure keeps its fiber and the strand stays in the middle
+ * of __cilkrts_mutex_lock.  The unstolen ancestors of the strand on the
+ * worker's deque are promoted first, as if stolen, and left READY on the deque
+ * for thieves, since the holder of the mutex may need one of them to run
+ * before it can unlock it.  The worker then returns to the steal loop.  When
+ * the holder unlocks, it releases the mutex and queues the oldest parked
+ * strand on its runtime's ready_waiters list.  A worker in the steal loop
+ * takes the closure from there and jumps back into the strand, which tries to
+ * take the mutex again.  The mutex is not handed to the parked strand, since
+ * a strand that cannot park spins for the mutex on its worker, and all the
+ * workers might be spinning while the parked strand waits for one of them.
+ *
+ * The state of the mutex is MUTEX_CONTENDED while strands may be parked on
+ * it, which sends its unlock through the waiter list.  While a woken strand
+ * is on its way back, the mutex may be unlocked with strands parked on it, so
+ * the woken strand marks it contended again.  The list is guarded by a spin
+ * lock in the mutex, which the parking worker holds until it is off the
+ * strand's fiber, so that no worker can resume the strand there first.
+ ***/
+
+#define MUTEX_UNLOCKED 0
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2
+
+static inline void mutex_waiters_lock(__cilkrts_mutex *m) {
+    while (__atomic_exchange_n(&m->waiters_lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&m->waiters_lock, __ATOMIC_RELAXED))
+            busy_loop_pause();
+    }
+}
+
+void mutex_waiters_unlock(__cilkrts_mutex *m) {
+    __atomic_store_n(&m->waiters_lock, 0, __ATOMIC_RELEASE);
+}
+
+// Take m if it is unlocked, or else mark it contended.  Returns true if the
+// caller now holds m.  The caller holds the waiter list of m.
+static bool acquire_or_contend(__cilkrts_mutex *m) {
+    unsigned int state = __atomic_load_n(&m->state, __ATOMIC_RELAXED);
+    unsigned int locked = m->waiters_head ? MUTEX_CONTENDED : MUTEX_LOCKED;
+    while (true) {
+        if (state == MUTEX_UNLOCKED) {
+            if (__atomic_compare_exchange_n(&m->state, &state, locked,
+                                            false, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return true;
+        } else if (state == MUTEX_CONTENDED ||
+                   __atomic_compare_exchange_n(&m->state, &state,
+                                               MUTEX_CONTENDED, false,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED)) {
+            return false;
+        }
+    }
+}
+
+// Check if the strand running on w can park, suspending closure t, the bottom
+// closure on w's deque: it must be in user code on t's fiber and not unwinding
+// an exception.  The caller holds the locks on w's deque and on t.
+static bool can_park(__cilkrts_worker *w, Closure *t) {
+    struct cilk_fiber *fh = __cilkrts_current_fh;
+    return w->l->state == WORKER_RUN && t->status == CLOSURE_RUNNING &&
+           !t->has_cilk_callee && !t->exception_pending && fh &&
+           t->fiber == fh && fh->current_stack_frame &&
+           !__cilkrts_throwing(fh->current_stack_frame);
+}
+
+// Leave the parked strand of r for the runtime, and come back once its mutex
+// has been unlocked, possibly on another worker.
+static void __attribute__((noinline))
+suspend_strand(__cilkrts_worker *w, __cilkrts_mutex *m,
+               struct __cilkrts_mutex_waiter *r) {
+    if (__builtin_setjmp(r->ctx) == 0) {
+        w->l->parked_on = m;
+        longjmp_to_runtime(w);
+    }
+    sanitizer_finish_switch_fiber();
+}
+
+// Park the strand running on w on m until m is unlocked, and let w steal
+// meanwhile, until the strand takes m.  Returns true once the strand holds m,
+// or false if the strand cannot park and must wait for m some other way.
+static bool park_strand(__cilkrts_worker *w, __cilkrts_mutex *m) {
+    while (true) {
+        // Parking would hide the unstolen frames on w's deque from thieves.
+        // Only this worker pushes frames on it, so none come back before the
+        // strand parks.
+        if (w->l->state == WORKER_RUN &&
+            atomic_load_explicit(&w->head, memory_order_relaxed) <
+                atomic_load_explicit(&w->tail, memory_order_relaxed))
+            expose_own_deque(w);
+
+        mutex_waiters_lock(m);
+        if (acquire_or_contend(m)) {
+            mutex_waiters_unlock(m);
+            return true;
+        }
+
+        ReadyDeque *deques = w->g->deques;
+        worker_id self = w->self;
+        deque_lock_self(deques, self);
+        Closure *t = deque_peek_bottom(deques, self, self);
+        if (t)
+            Closure_lock(self, t);
+        if (!t || !can_park(w, t)) {
+            if (t)
+                Closure_unlock(self, t);
+            deque_unlock_self(deques, self);
+            mutex_waiters_unlock(m);
+            return false;
+        }
+
+        __cilkrts_stack_frame **head =
+            atomic_load_explicit(&w->head, memory_order_relaxed);
+        CILK_ASSERT(head ==
+                    atomic_load_explicit(&w->tail, memory_order_relaxed));
+        struct __cilkrts_mutex_waiter waiter = {
+            .next = NULL,
+            .g = w->g,
+            .closure = t,
+            .hyper_table = w->hyper_table,
+            .extension = w->extension,
+            .ext_stack = w->ext_stack,
+            .base = (size_t)(head - w->l->shadow_stack),
+        };
+        // The reducer views of the strand go with it, as at a failed sync.
+        w->hyper_table = NULL;
+
+        cilkrts_alert(SCHED, "(park_strand) closure %p on mutex %p",
+                      (void *)t, (void *)m);
+        Closure_park(deques, self, t);
+        Closure_unlock(self, t);
+        deque_unlock_self(deques, self);
+
+        if (m->waiters_tail)
+            m->waiters_tail->next = &waiter;
+        else
+            m->waiters_head = &waiter;
+        m->waiters_tail = &waiter;
+        WHEN_SCHED_STATS(w->l->stats.mutex_parks++);
+
+        suspend_strand(w, m, &waiter);
+        w = __cilkrts_get_tls_worker();
+    }
+}
+
+// Queue r, whose mutex was unlocked, for a worker of its runtime to resume.
+// r lives on the parked strand's fiber and may be gone as soon as it is
+// queued.
+static void queue_ready_waiter(struct __cilkrts_mutex_waiter *r) {
+    global_state *g = r->g;
+    r->next = NULL;
+    pthread_mutex_lock(&g->ready_waiters_lock);
+    if (g->ready_waiters_tail)
+        g->ready_waiters_tail->next = r;
+    else
+        g->ready_waiters = r;
+    g->ready_waiters_tail = r;
+    atomic_fetch_add_explicit(&g->pending_waiters, 1, memory_order_release);
+    pthread_mutex_unlock(&g->ready_waiters_lock);
+
+    if (g->nworkers > 1) {
+        __cilkrts_worker *w = __cilkrts_get_tls_worker();
+        request_more_thieves(g, (w && w->g == g) ? w->self : 0, 1);
+    }
+}
+
+void mutex_waiter_resume(__cilkrts_worker *w,
+                         struct __cilkrts_mutex_waiter *r) {
+    cilkrts_alert(SCHED, "(mutex_waiter_resume) closure %p",
+                  (void *)r->closure);
+    CILK_ASSERT_NULL(w->hyper_table);
+    w->hyper_table = r->hyper_table;
+    if (USE_EXTENSION) {
+        w->extension = r->extension;
+        w->ext_stack = r->ext_stack;
+    }
+    CILK_SWITCH_TIMING(w, INTERVAL_SCHED, INTERVAL_WORK);
+    sanitizer_start_switch_fiber(r->closure->fiber);
+    __builtin_longjmp(r->ctx, 1);
+}
+
+void __cilkrts_mutex_init(__cilkrts_mutex *m) {
+    m->state = MUTEX_UNLOCKED;
+    m->waiters_lock = 0;
+    m->waiters_head = NULL;
+    m->waiters_tail = NULL;
+}
+
+int __cilkrts_mutex_trylock(__cilkrts_mutex *m) {
+    unsigned int state = MUTEX_UNLOCKED;
+    return __atomic_compare_exchange_n(&m->state, &state, MUTEX_LOCKED, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void __cilkrts_mutex_lock(__cilkrts_mutex *m) {
+    if (__cilkrts_mutex_trylock(m))
+        return;
+
+    // The strand may come back from park_strand on another thread.
+    __cilkrts_worker *w = __cilkrts_get_tls_worker();
+    if (w && park_strand(w, m))
+        return;
+
+    // Not a worker, or a strand that cannot park: spin, then yield.
+    unsigned int pauses = 0;
+    while (!__cilkrts_mutex_trylock(m)) {
+        if (pauses < MUTEX_SPIN_PAUSES) {
+            ++pauses;
+            busy_loop_pause();
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+void __cilkrts_mutex_unlock(__cilkrts_mutex *m) {
+    unsigned int state = MUTEX_LOCKED;
+    if (__atomic_compare_exchange_n(&m->state, &state, MUTEX_UNLOCKED, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+
+    // Strands may be parked on m: release it and wake the oldest one, if any.
+    mutex_waiters_lock(m);
+    struct __cilkrts_mutex_waiter *r = m->waiters_head;
+    if (r) {
+        m->waiters_head = r->next;
+        if (!m->waiters_head)
+            m->waiters_tail = NULL;
+    }
+    __atomic_store_n(&m->state, MUTEX_UNLOCKED, __ATOMIC_RELEASE);
+    mutex_waiters_unlock(m);
+
+    if (r)
+        queue_ready_waiter(r);
+}
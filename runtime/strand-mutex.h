@@ -0,0 +1,37 @@
+#ifndef _CILK_STRAND_MUTEX_H
+#define _CILK_STRAND_MUTEX_H
+
+#include "cilk-internal.h"
+#include "jmpbuf.h"
+
+struct Closure;
+struct local_hyper_table;
+
+// A strand parked on a contended __cilkrts_mutex.  The record lives in the
+// frame of the parked __cilkrts_mutex_lock call, on the strand's fiber, which
+// the closure keeps until the strand resumes.  When the holder unlocks, it
+// queues the oldest waiter on its runtime's ready_waiters list, from which a
+// worker in the steal loop resumes it to try the mutex again.
+struct __cilkrts_mutex_waiter {
+    struct __cilkrts_mutex_waiter *next;
+    global_state *g;
+    struct Closure *closure;
+    struct local_hyper_table *hyper_table;
+    void *extension;
+    void *ext_stack;
+    // Position of the (empty) deque in the worker's shadow stack when the
+    // strand parked, to restore on the worker that resumes the strand.
+    size_t base;
+    jmpbuf ctx;
+};
+
+// Release the waiter list of m, which a worker keeps locked after parking a
+// strand on m until it has left the strand's fiber.
+CHEETAH_INTERNAL void mutex_waiters_unlock(__cilkrts_mutex *m);
+
+// Jump back into the parked strand of r, whose mutex was unlocked, on w.
+// The closure of r must already be set up to run on w.
+CHEETAH_INTERNAL __attribute__((noreturn)) void
+mutex_waiter_resume(__cilkrts_worker *w, struct __cilkrts_mutex_waiter *r);
+
+#endif /* _CILK_STRAND_MUTEX_H */
@@ -0,0 +1,523 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#include "debug.h"
+#include "topology.h"
+
+#if defined __FreeBSD__ && __FreeBSD__ < 13
+typedef cpuset_t cpu_set_t;
+#endif
+
+#if defined __linux__ && defined CPU_SETSIZE
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// Read the first line of the file at path into buf.  Returns false if the file
+// cannot be read.
+static bool read_line(const char *path, char *buf, size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// Read a Linux cpulist, such as "0-3,8-11", from path and return the lowest
+// CPU in it, or -1 if the file cannot be read.
+static int read_first_cpu(const char *path) {
+    char buf[256];
+    if (!read_line(path, buf, sizeof buf))
+        return -1;
+    char *end;
+    long cpu = strtol(buf, &end, 10);
+    if (end == buf || cpu < 0)
+        return -1;
+    return (int)cpu;
+}
+
+static int read_int(const char *path) {
+    char buf[64];
+    if (!read_line(path, buf, sizeof buf))
+        return -1;
+    return (int)strtol(buf, NULL, 10);
+}
+
+// Find the last-level cache of the given CPU by scanning its cache indices for
+// the highest cache level.
+static int find_llc(int cpu) {
+    char path[128];
+    int best_level = -1, llc = -1;
+    for (int index = 0;; ++index) {
+        snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cache/index%d/level",
+                 cpu, index);
+        int level = read_int(path);
+        if (level < 0)
+            break;
+        if (level < best_level)
+            continue;
+        snprintf(path, sizeof path,
+                 SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        int first = read_first_cpu(path);
+        if (first < 0)
+            continue;
+        best_level = level;
+        llc = first;
+    }
+    return llc;
+}
+
+// Find the NUMA node of the given CPU, which sysfs exposes as a nodeN entry in
+// the CPU's directory.
+static int find_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof path, SYSFS_CPU "/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    int node = -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' &&
+            ent->d_name[4] <= '9') {
+            node = (int)strtol(ent->d_name + 4, NULL, 10);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+static void read_cpu_place(struct cpu_place *p, int cpu) {
+    char path[128];
+    p->cpu = cpu;
+
+    snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/topology/thread_siblings_list",
+             cpu);
+    p->core = read_first_cpu(path);
+    if (p->core < 0)
+        p->core = cpu;
+
+    p->llc = find_llc(cpu);
+    if (p->llc < 0) {
+        // Without cache information, treat the package as the cache domain.
+        snprintf(path, sizeof path,
+                 SYSFS_CPU "/cpu%d/topology/core_siblings_list", cpu);
+        p->llc = read_first_cpu(path);
+        if (p->llc < 0)
+            p->llc = p->core;
+    }
+
+    p->node = find_node(cpu);
+    if (p->node < 0)
+        p->node = 0;
+}
+
+static int cpu_place_cmp(const void *a, const void *b) {
+    const struct cpu_place *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->llc != y->llc)
+        return x->llc - y->llc;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static bool topology_discover(struct cilk_topology *topo,
+                              const unsigned int *avail, unsigned int navail) {
+    cpu_set_t mask;
+    if (pthread_getaffinity_np(pthread_self(), sizeof mask, &mask) != 0)
+        return false;
+    if (avail) {
+        cpu_set_t only;
+        CPU_ZERO(&only);
+        for (unsigned int i = 0; i < navail; ++i) {
+            if (avail[i] < CPU_SETSIZE)
+                CPU_SET(avail[i], &only);
+        }
+        CPU_AND(&mask, &mask, &only);
+    }
+    int ncpus = CPU_COUNT(&mask);
+    if (ncpus <= 0)
+        return false;
+
+    topo->cpus = calloc(ncpus, sizeof(struct cpu_place));
+    unsigned int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < (unsigned)ncpus; ++cpu) {
+        if (CPU_ISSET(cpu, &mask))
+            read_cpu_place(&topo->cpus[n++], cpu);
+    }
+    topo->ncpus = n;
+    qsort(topo->cpus, n, sizeof(struct cpu_place), cpu_place_cmp);
+    return n > 0;
+}
+
+// Mark the CPUs of the efficiency class of a hybrid machine in slow, which
+// has SLOW_CPU_BITS bits.  Intel hybrid processors register a cpu_atom PMU
+// beside cpu_core, each listing the CPUs of its class.  Arm big.LITTLE systems
+// give each CPU a cpu_capacity, which is lower on the little cores.  Returns
+// false if all CPUs are of one class.
+static bool detect_slow_cpus(uint64_t *slow) {
+    char buf[4096];
+    if (access("/sys/devices/cpu_core/cpus", F_OK) == 0 &&
+        read_line("/sys/devices/cpu_atom/cpus", buf, sizeof buf)) {
+        unsigned int *cpus = malloc(SLOW_CPU_BITS * sizeof(unsigned int));
+        int n = cilk_cpulist_parse(buf, cpus, SLOW_CPU_BITS);
+        int marked = 0;
+        for (int i = 0; i < n; ++i) {
+            if (cpus[i] < SLOW_CPU_BITS) {
+                slow[cpus[i] / 64] |= (uint64_t)1 << (cpus[i] % 64);
+                ++marked;
+            }
+        }
+        free(cpus);
+        return marked > 0;
+    }
+
+    cpu_set_t mask;
+    if (pthread_getaffinity_np(pthread_self(), sizeof mask, &mask) != 0)
+        return false;
+    int *capacity = calloc(SLOW_CPU_BITS, sizeof(int));
+    int max = -1, min = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu < SLOW_CPU_BITS; ++cpu) {
+        if (!CPU_ISSET(cpu, &mask))
+            continue;
+        char path[64];
+        snprintf(path, sizeof path, SYSFS_CPU "/cpu%d/cpu_capacity", cpu);
+        capacity[cpu] = read_int(path);
+        if (capacity[cpu] > max)
+            max = capacity[cpu];
+        if (capacity[cpu] >= 0 && (min < 0 || capacity[cpu] < min))
+            min = capacity[cpu];
+    }
+    if (min >= 0 && min < max) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < SLOW_CPU_BITS; ++cpu) {
+            if (CPU_ISSET(cpu, &mask) && capacity[cpu] >= 0 &&
+                capacity[cpu] < max)
+                slow[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+        }
+    }
+    free(capacity);
+    return min >= 0 && min < max;
+}
+
+#else
+
+static bool topology_discover(struct cilk_topology *topo,
+                              const unsigned int *avail, unsigned int navail) {
+    (void)topo;
+    (void)avail;
+    (void)navail;
+    return false;
+}
+
+static bool detect_slow_cpus(uint64_t *slow) {
+    (void)slow;
+    return false;
+}
+
+#endif // defined __linux__ && defined CPU_SETSIZE
+
+// Fill order with the indices into topo->cpus of the CPUs that the pinning
+// policy hands out to workers, in the order that it hands them out.  Returns
+// the number of CPUs.
+static unsigned int pin_order(const struct cilk_topology *topo,
+                              unsigned int *order) {
+    const struct cpu_place *cpus = topo->cpus;
+    unsigned int n = 0;
+    switch (topo->pin) {
+    case PIN_CORE:
+        // Sibling hardware threads are adjacent; take the first of each core.
+        for (unsigned int i = 0; i < topo->ncpus; ++i) {
+            if (i == 0 || cpus[i].core != cpus[i - 1].core)
+                order[n++] = i;
+        }
+        return n;
+    case PIN_SCATTER: {
+        // Rank each CPU by its thread within its core, then by its core
+        // within its node, then by its node, so that workers take one
+        // thread of every core before any second thread, and alternate
+        // between nodes.
+        uint64_t *key = calloc(topo->ncpus, sizeof(uint64_t));
+        unsigned int node = 0, core = 0, thread = 0;
+        for (unsigned int i = 0; i < topo->ncpus; ++i) {
+            if (i > 0 && cpus[i].node != cpus[i - 1].node) {
+                ++node;
+                core = 0;
+                thread = 0;
+            } else if (i > 0 && cpus[i].core != cpus[i - 1].core) {
+                ++core;
+                thread = 0;
+            } else if (i > 0) {
+                ++thread;
+            }
+            key[i] = (uint64_t)thread << 48 | (uint64_t)core << 32 |
+                     (uint64_t)node << 16;
+        }
+        // A selection sort keeps this simple; it runs once per resize.
+        bool *taken = calloc(topo->ncpus, sizeof(bool));
+        for (n = 0; n < topo->ncpus; ++n) {
+            unsigned int best = 0;
+            while (taken[best])
+                ++best;
+            for (unsigned int i = best + 1; i < topo->ncpus; ++i) {
+                if (!taken[i] && key[i] < key[best])
+                    best = i;
+            }
+            taken[best] = true;
+            order[n] = best;
+        }
+        free(taken);
+        free(key);
+        return n;
+    }
+    case PIN_LIST:
+        for (n = 0; n < topo->pin_list_len; ++n)
+            order[n] = topo->pin_list[n];
+        return n;
+    case PIN_NONE:
+    case PIN_COMPACT:
+    default:
+        for (n = 0; n < topo->ncpus; ++n)
+            order[n] = n;
+        return n;
+    }
+}
+
+static enum topo_level place_distance(const struct cpu_place *a,
+                                      const struct cpu_place *b) {
+    if (a->core == b->core)
+        return TOPO_LEVEL_SMT;
+    if (a->llc == b->llc)
+        return TOPO_LEVEL_LLC;
+    if (a->node == b->node)
+        return TOPO_LEVEL_NUMA;
+    return TOPO_LEVEL_REMOTE;
+}
+
+void cilk_topology_set_nworkers(struct cilk_topology *topo,
+                                unsigned int nworkers) {
+    CILK_ASSERT(nworkers > 0);
+    free(topo->worker_cpu);
+    free(topo->peers);
+    free(topo->level_end);
+
+    topo->nworkers = nworkers;
+    topo->worker_cpu = calloc(nworkers, sizeof(unsigned int));
+    unsigned int max = topo->ncpus > topo->pin_list_len ? topo->ncpus
+                                                        : topo->pin_list_len;
+    unsigned int *order = calloc(max, sizeof(unsigned int));
+    unsigned int norder = pin_order(topo, order);
+    for (unsigned int i = 0; i < nworkers; ++i)
+        topo->worker_cpu[i] = order[i % norder];
+    free(order);
+
+    // Pinning more workers than CPUs would stack workers on CPUs while
+    // others idle, except where the user listed the CPUs.
+    topo->pinned = topo->pin == PIN_LIST ||
+                   (topo->pin != PIN_NONE && nworkers <= norder);
+    if (topo->pin != PIN_NONE && !topo->pinned)
+        cilkrts_alert(BOOT,
+                      "(cilk_topology_set_nworkers) %u workers but %u cpus "
+                      "to pin to; not pinning",
+                      nworkers, norder);
+    if (topo->pinned && ALERT_ENABLED(BOOT)) {
+        for (unsigned int i = 0; i < nworkers; ++i) {
+            const struct cpu_place *p = topo_worker_place(topo, i);
+            cilkrts_alert(BOOT,
+                          "(cilk_topology_set_nworkers) pin worker %u to cpu "
+                          "%d: core %d llc %d node %d",
+                          i, p->cpu, p->core, p->llc, p->node);
+        }
+    }
+
+    topo->peers = calloc((size_t)nworkers * (nworkers - 1) + 1,
+                         sizeof(worker_id));
+    topo->level_end =
+        calloc((size_t)nworkers * TOPO_NUM_LEVELS, sizeof(uint32_t));
+
+    // Bucket the other workers by distance, keeping each bucket in worker
+    // order.  A counting sort suffices, since there are only a few levels.
+    for (worker_id i = 0; i < nworkers; ++i) {
+        worker_id *row = topo->peers + (size_t)i * (nworkers - 1);
+        uint32_t *end = topo->level_end + (size_t)i * TOPO_NUM_LEVELS;
+        const struct cpu_place *mine = topo_worker_place(topo, i);
+        uint32_t count[TOPO_NUM_LEVELS] = {0};
+        for (worker_id j = 0; j < nworkers; ++j) {
+            if (j != i)
+                ++count[place_distance(mine, topo_worker_place(topo, j))];
+        }
+        uint32_t start[TOPO_NUM_LEVELS];
+        uint32_t total = 0;
+        for (int l = 0; l < TOPO_NUM_LEVELS; ++l) {
+            start[l] = total;
+            total += count[l];
+            end[l] = total;
+        }
+        for (worker_id j = 0; j < nworkers; ++j) {
+            if (j != i)
+                row[start[place_distance(mine, topo_worker_place(topo, j))]++] =
+                    j;
+        }
+    }
+}
+
+// Map the CPU numbers of a PIN_LIST policy to indices into topo->cpus.  CPUs
+// outside the process affinity mask are dropped.
+static void set_pin_list(struct cilk_topology *topo, const unsigned int *cpus,
+                         unsigned int ncpus) {
+    topo->pin_list = calloc(ncpus ? ncpus : 1, sizeof(unsigned int));
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < ncpus; ++i) {
+        unsigned int j = 0;
+        while (j < topo->ncpus && topo->cpus[j].cpu != (int)cpus[i])
+            ++j;
+        if (j < topo->ncpus)
+            topo->pin_list[n++] = j;
+        else
+            cilkrts_alert(BOOT,
+                          "(cilk_topology_init) cpu %u of CILK_PIN is not "
+                          "available",
+                          cpus[i]);
+    }
+    topo->pin_list_len = n;
+    if (n == 0)
+        topo->pin = PIN_NONE;
+}
+
+struct cilk_topology *cilk_topology_init(unsigned int nworkers,
+                                         enum pin_policy pin,
+                                         const unsigned int *cpus,
+                                         unsigned int ncpus,
+                                         const unsigned int *avail,
+                                         unsigned int navail) {
+    struct cilk_topology *topo = calloc(1, sizeof(struct cilk_topology));
+    if (!topology_discover(topo, avail, navail)) {
+        cilkrts_alert(BOOT, "(cilk_topology_init) topology unavailable");
+        free(topo->cpus);
+        free(topo);
+        return NULL;
+    }
+    topo->pin = pin;
+    if (pin == PIN_LIST)
+        set_pin_list(topo, cpus, ncpus);
+    cilk_topology_set_nworkers(topo, nworkers);
+
+    if (ALERT_ENABLED(BOOT)) {
+        for (unsigned int i = 0; i < topo->ncpus; ++i) {
+            const struct cpu_place *p = &topo->cpus[i];
+            cilkrts_alert(BOOT,
+                          "(cilk_topology_init) cpu %d: core %d llc %d node %d",
+                          p->cpu, p->core, p->llc, p->node);
+        }
+    }
+    return topo;
+}
+
+void cilk_topology_destroy(struct cilk_topology *topo) {
+    if (!topo)
+        return;
+    free(topo->cpus);
+    free(topo->pin_list);
+    free(topo->worker_cpu);
+    free(topo->peers);
+    free(topo->level_end);
+    free(topo);
+}
+
+void cilk_topology_pin_thread(const struct cilk_topology *topo, worker_id w,
+                              pthread_t thread) {
+    if (!topo->pinned)
+        return;
+#if defined __linux__ && defined CPU_SETSIZE
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(topo_worker_place(topo, w)->cpu, &mask);
+    int err = pthread_setaffinity_np(thread, sizeof mask, &mask);
+    if (err != 0)
+        cilkrts_alert(BOOT,
+                      "(cilk_topology_pin_thread) cannot pin worker %u: %s", w,
+                      strerror(err));
+#else
+    (void)w;
+    (void)thread;
+#endif
+}
+
+uint64_t *cilk_slow_cpus(const unsigned int *fast, unsigned int nfast) {
+    uint64_t *slow = calloc(SLOW_CPU_BITS / 64, sizeof(uint64_t));
+    if (fast) {
+        memset(slow, 0xff, SLOW_CPU_BITS / 8);
+        for (unsigned int i = 0; i < nfast; ++i) {
+            if (fast[i] < SLOW_CPU_BITS)
+                slow[fast[i] / 64] &= ~((uint64_t)1 << (fast[i] % 64));
+        }
+    } else if (!detect_slow_cpus(slow)) {
+        free(slow);
+        return NULL;
+    }
+    if (ALERT_ENABLED(BOOT)) {
+        for (unsigned int cpu = 0; cpu < SLOW_CPU_BITS; ++cpu) {
+            if (cpu_is_slow(slow, cpu))
+                cilkrts_alert(BOOT, "(cilk_slow_cpus) cpu %u is slow", cpu);
+        }
+    }
+    return slow;
+}
+
+int cilk_current_cpu(void) {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+int cilk_cpulist_parse(const char *list, unsigned int *cpus,
+                       unsigned int max) {
+    unsigned int n = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (n == max)
+                return -1;
+            cpus[n++] = (unsigned int)cpu;
+        }
+        if (*p == ',')
+            ++p;
+        else if (*p && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return (int)n;
+}
@@ -0,0 +1,129 @@
+#ifndef _CILK_TOPOLOGY_H
+#define _CILK_TOPOLOGY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rts-config.h"
+#include "types.h"
+
+// Levels of the machine hierarchy, ordered from nearest to farthest.  A worker
+// at distance TOPO_LEVEL_SMT from another runs on a hardware thread of the
+// same core, TOPO_LEVEL_LLC on the same last-level cache, TOPO_LEVEL_NUMA on
+// the same NUMA node, and TOPO_LEVEL_REMOTE anywhere else.
+enum topo_level {
+    TOPO_LEVEL_SMT = 0,
+    TOPO_LEVEL_LLC,
+    TOPO_LEVEL_NUMA,
+    TOPO_LEVEL_REMOTE,
+    TOPO_NUM_LEVELS
+};
+
+// Location of one CPU in the machine hierarchy.  Each id is the number of the
+// lowest-numbered CPU sharing the corresponding resource, so two CPUs share a
+// resource iff their ids for that resource are equal.
+struct cpu_place {
+    int cpu;
+    int core;
+    int llc;
+    int node;
+};
+
+// Policies for pinning worker threads to CPUs, selected by CILK_PIN.
+enum pin_policy {
+    PIN_NONE = 0,
+    PIN_COMPACT, /* fill each core, then each cache and node, in CPU order */
+    PIN_SCATTER, /* spread over nodes and cores before sharing any core */
+    PIN_CORE,    /* one worker per physical core */
+    PIN_LIST,    /* the CPUs of an explicit list, in order */
+};
+
+struct cilk_topology {
+    // CPUs in the process affinity mask, sorted so that CPUs sharing a core,
+    // cache, and node are adjacent.
+    unsigned int ncpus;
+    struct cpu_place *cpus;
+
+    // Pinning policy, and for PIN_LIST, the listed CPUs as indices into cpus.
+    enum pin_policy pin;
+    unsigned int pin_list_len;
+    unsigned int *pin_list;
+
+    // Number of workers covered by the tables below.
+    unsigned int nworkers;
+    // Index into cpus of the placement of each worker, chosen by the pinning
+    // policy.  Only pinned workers are known to run there.  Without pinning,
+    // worker i is placed nominally on the (i % ncpus)-th CPU of the sorted
+    // list, wherever the OS runs it, and worker 0 keeps the affinity of the
+    // thread that entered the runtime even with pinning, so steal distances
+    // are then only a guess.
+    unsigned int *worker_cpu;
+    // Whether the workers are pinned to their placement.  False without a
+    // policy, or if the policy offers fewer CPUs than there are workers.
+    bool pinned;
+    // For each worker, the other workers sorted from nearest to farthest.  Row
+    // i has nworkers - 1 entries.
+    worker_id *peers;
+    // For each worker, level_end[i * TOPO_NUM_LEVELS + l] is the number of
+    // entries in row i of peers at distance at most l.
+    uint32_t *level_end;
+};
+
+// Discover the machine topology and compute the placement and steal peers of
+// nworkers workers under pinning policy pin.  For PIN_LIST, cpus holds the
+// ncpus listed CPU numbers.  If avail is not NULL, only its navail CPUs are
+// used, as for an arena.  Returns NULL if the topology is unavailable.
+CHEETAH_INTERNAL struct cilk_topology *
+cilk_topology_init(unsigned int nworkers, enum pin_policy pin,
+                   const unsigned int *cpus, unsigned int ncpus,
+                   const unsigned int *avail, unsigned int navail);
+// Recompute the placement and steal peers for a different number of workers.
+CHEETAH_INTERNAL void cilk_topology_set_nworkers(struct cilk_topology *topo,
+                                                 unsigned int nworkers);
+CHEETAH_INTERNAL void cilk_topology_destroy(struct cilk_topology *topo);
+// Pin thread, which runs worker w, to the worker's CPU.  Does nothing unless
+// topo->pinned.
+CHEETAH_INTERNAL void cilk_topology_pin_thread(const struct cilk_topology *topo,
+                                               worker_id w, pthread_t thread);
+
+// Number of CPU numbers covered by the bitmap of slow CPUs.
+#define SLOW_CPU_BITS 1024
+
+// Return a bitmap, of SLOW_CPU_BITS bits, of the CPUs of the slower class on a
+// hybrid machine, with performance and efficiency cores.  If fast is not
+// NULL, it lists the nfast CPUs of the faster class, and all other CPUs are
+// slow; otherwise, the classes come from sysfs.  Returns NULL if all CPUs are
+// of one class.
+CHEETAH_INTERNAL uint64_t *cilk_slow_cpus(const unsigned int *fast,
+                                          unsigned int nfast);
+
+static inline bool cpu_is_slow(const uint64_t *slow, int cpu) {
+    return cpu >= 0 && cpu < SLOW_CPU_BITS &&
+           (slow[cpu / 64] >> (cpu % 64) & 1);
+}
+
+// Return the CPU the calling thread is running on, or -1 if unknown.
+CHEETAH_INTERNAL int cilk_current_cpu(void);
+
+// Parse a cpulist, such as "0-3,8-11", into at most max CPU numbers in cpus.
+// Returns the number of CPUs, or -1 if the list is malformed or too long.
+CHEETAH_INTERNAL int cilk_cpulist_parse(const char *list, unsigned int *cpus,
+                                        unsigned int max);
+
+static inline const worker_id *topo_peers(const struct cilk_topology *topo,
+                                          worker_id w) {
+    return topo->peers + (size_t)w * (topo->nworkers - 1);
+}
+
+static inline const uint32_t *topo_level_end(const struct cilk_topology *topo,
+                                             worker_id w) {
+    return topo->level_end + (size_t)w * TOPO_NUM_LEVELS;
+}
+
+static inline const struct cpu_place *
+topo_worker_place(const struct cilk_topology *topo, worker_id w) {
+    return &topo->cpus[topo->worker_cpu[w]];
+}
+
+#endif /* _CILK_TOPOLOGY_H */
@@ -7,6 +7,7 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <limits.h>
+#include <time.h>
 
 #ifdef __linux__
 #include <errno.h>
@@ -16,6 +17,7 @@
 #endif
 
 #include "global.h"
+#include "topology.h"
 
 #define USER_USE_FUTEX 1
 #ifdef __linux__
@@ -88,6 +90,12 @@ __attribute__((always_inline)) static inline void busy_pause(void) {
         busy_loop_pause();
 }
 
+static inline uint64_t gettime_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 // Routines to update global flags to prevent workers from re-entering the
 // work-stealing loop.  Note that we don't wait for the workers to exit the
 // work-stealing loop, since its more efficient to allow that to happen
@@ -107,8 +115,13 @@ static inline void set_cilkified(global_state *g) {
 // originally cilkified the execution.
 static inline void signal_uncilkified(global_state *g) {
 #if USE_FUTEX
-    atomic_store_explicit(&g->cilkified, 0, memory_order_release);
-    fpost(&g->cilkified_futex);
+    // The boss may still be spinning, in which case it needs no syscall to
+    // wake it.  Pairs with the stores in wait_while_cilkified.
+    atomic_store_explicit(&g->cilkified, 0, memory_order_seq_cst);
+    if (atomic_load_explicit(&g->cilkified_sleeping, memory_order_seq_cst))
+        fpost(&g->cilkified_futex);
+    else
+        atomic_store_explicit(&g->cilkified_futex, 1, memory_order_release);
 #else
     pthread_mutex_lock(&(g->cilkified_lock));
     atomic_store_explicit(&g->cilkified, 0, memory_order_release);
@@ -121,16 +134,32 @@ static inline void signal_uncilkified(global_state *g) {
 // region.
 static inline void wait_while_cilkified(global_state *g) {
     unsigned int fail = 0;
-    while (fail++ < BUSY_LOOP_SPIN) {
+    const unsigned int busy_loop_spin = sched_tuning(g)->busy_loop_spin;
+    while (fail++ < busy_loop_spin) {
         if (!atomic_load_explicit(&g->cilkified, memory_order_acquire)) {
             return;
         }
         busy_pause();
     }
+    // For short regions, keep spinning for up to the idle spin time.
+    const uint64_t idle_spin_nsec = sched_tuning(g)->idle_spin_nsec;
+    if (idle_spin_nsec) {
+        uint64_t start = gettime_nsec();
+        do {
+            for (unsigned int i = 0; i < IDLE_SPIN_CHECK; ++i) {
+                if (!atomic_load_explicit(&g->cilkified,
+                                          memory_order_acquire))
+                    return;
+                busy_pause();
+            }
+        } while (gettime_nsec() - start < idle_spin_nsec);
+    }
 #if USE_FUTEX
-    while (atomic_load_explicit(&g->cilkified, memory_order_acquire)) {
+    atomic_store_explicit(&g->cilkified_sleeping, 1, memory_order_seq_cst);
+    while (atomic_load_explicit(&g->cilkified, memory_order_seq_cst)) {
         fwait(&g->cilkified_futex);
     }
+    atomic_store_explicit(&g->cilkified_sleeping, 0, memory_order_relaxed);
 #else
     // TODO: Convert pthread_mutex_lock, pthread_mutex_unlock, and
     // pthread_cond_wait to cilk_* equivalents.
@@ -148,6 +177,45 @@ static inline void wait_while_cilkified(global_state *g) {
 #endif
 }
 
+// Signal the thread waiting for the guest region of root that the region is
+// done.
+static inline void signal_guest_done(global_state *g, struct guest_root *root) {
+#if USE_FUTEX
+    (void)g;
+    fpost(&root->done);
+#else
+    pthread_mutex_lock(&g->cilkified_lock);
+    atomic_store_explicit(&root->done, 1, memory_order_release);
+    pthread_cond_broadcast(&g->guest_done_cond_var);
+    pthread_mutex_unlock(&g->cilkified_lock);
+#endif
+}
+
+// Wait for the guest region of root to be done.  Executed by the thread that
+// started the guest region.
+static inline void wait_for_guest_done(global_state *g,
+                                       struct guest_root *root) {
+    unsigned int fail = 0;
+    const unsigned int busy_loop_spin = sched_tuning(g)->busy_loop_spin;
+    while (fail++ < busy_loop_spin) {
+        if (atomic_load_explicit(&root->done, memory_order_acquire)) {
+            return;
+        }
+        busy_pause();
+    }
+#if USE_FUTEX
+    while (!atomic_load_explicit(&root->done, memory_order_acquire)) {
+        fwait(&root->done);
+    }
+#else
+    pthread_mutex_lock(&g->cilkified_lock);
+    while (!atomic_load_explicit(&root->done, memory_order_acquire)) {
+        pthread_cond_wait(&g->guest_done_cond_var, &g->cilkified_lock);
+    }
+    pthread_mutex_unlock(&g->cilkified_lock);
+#endif
+}
+
 //=========================================================
 // Operations to disengage and reengage workers within the work-stealing loop.
 //=========================================================
@@ -164,8 +232,70 @@ static inline void reset_disengaged_var(global_state *g) {
 #endif
 }
 
-// Request to reengage `count` thief threads.
-static inline void request_more_thieves(global_state *g, uint32_t count) {
+#if USE_FUTEX
+//=========================================================
+// Targeted wakeup.  With CILK_TARGETED_WAKE, a thief that disengages inside
+// the work-stealing loop waits on its own wake slot rather than on the shared
+// disengaged_thieves_futex.  A worker that requests more thieves then wakes
+// the parked workers nearest to it, one futex per worker, instead of waking
+// an arbitrary subset of all sleepers.  Region start and termination still
+// wake every parked worker.
+//=========================================================
+
+#define WAKE_SLOT_IDLE 0      /* the worker is not waiting on its slot */
+#define WAKE_SLOT_PARKED 1    /* the worker is waiting on its slot */
+#define WAKE_SLOT_WOKEN 2     /* woken by a request for more thieves */
+#define WAKE_SLOT_BROADCAST 3 /* woken to start a region or to terminate */
+
+// Wake worker target if it is parked on its wake slot.  Returns 1 if this call
+// woke the worker, 0 otherwise.
+static inline uint32_t wake_slot(global_state *g, worker_id target,
+                                 uint32_t how) {
+    _Atomic uint32_t *slot = &g->wake_slots[target].state;
+    uint32_t parked = WAKE_SLOT_PARKED;
+    if (atomic_load_explicit(slot, memory_order_relaxed) != parked ||
+        !atomic_compare_exchange_strong_explicit(slot, &parked, how,
+                                                 memory_order_release,
+                                                 memory_order_relaxed))
+        return 0;
+    long s = futex(slot, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    if (s == -1)
+        errExit("futex-FUTEX_WAKE");
+    return 1;
+}
+
+// Wake up to count parked workers, nearest to worker self first.  Returns the
+// number of workers woken.
+static inline uint32_t wake_nearest_thieves(global_state *g, worker_id self,
+                                            uint32_t count) {
+    const unsigned int nworkers = g->nworkers;
+    const struct cilk_topology *topo = g->topology;
+    if (topo && topo->nworkers != nworkers)
+        topo = NULL;
+    const worker_id *peers = topo ? topo_peers(topo, self) : NULL;
+
+    uint32_t woken = 0;
+    for (unsigned int i = 0; i + 1 < nworkers && woken < count; ++i) {
+        worker_id target = peers ? peers[i] : (self + 1 + i) % nworkers;
+        woken += wake_slot(g, target, WAKE_SLOT_WOKEN);
+    }
+    return woken;
+}
+
+// Wake every parked worker.  The caller has already published the reason for
+// waking in disengaged_thieves_futex; the fence orders that store before the
+// loads of the slots, pairing with the fence in thief_park.
+static inline void wake_all_slots(global_state *g) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (worker_id i = 1; i < g->nworkers; ++i)
+        wake_slot(g, i, WAKE_SLOT_BROADCAST);
+}
+#endif // USE_FUTEX
+
+// Request to reengage `count` thief threads, preferring thieves near worker
+// self when targeted wakeup is enabled.
+static inline void request_more_thieves(global_state *g, worker_id self,
+                                        uint32_t count) {
     CILK_ASSERT(count > 0);
 
     // Don't allow this routine increment the futex beyond half the number of
@@ -174,6 +304,25 @@ static inline void request_more_thieves(global_state *g, uint32_t count) {
     // not be as much parallelism.
     int32_t max_requests = (int32_t)(g->nworkers / 2);
 #if USE_FUTEX
+    if (g->wake_slots) {
+        uint32_t woken = wake_nearest_thieves(
+            g, self, count < (uint32_t)max_requests ? count : max_requests);
+        if (woken >= count)
+            return;
+        // Thieves parked on wake slots never wait on disengaged_thieves_futex,
+        // and wake_nearest_thieves has tried every slot.  Post the rest of the
+        // request on the shared futex only for the thieves sleeping on it
+        // between regions, so that no token is left behind to stop a later
+        // thief from disengaging.
+        uint32_t sleepers = atomic_load_explicit(&g->disengaged_sleepers,
+                                                 memory_order_seq_cst);
+        count -= woken;
+        if (count > sleepers)
+            count = sleepers;
+        if (count == 0)
+            return;
+    }
+
     // This step synchronizes with concurrent calls to request_more_thieves and
     // concurrent calls to try_to_disengage_thief.
     while (true) {
@@ -190,7 +339,11 @@ static inline void request_more_thieves(global_state *g, uint32_t count) {
                 disengaged_thieves_futex + to_wake, memory_order_release,
                 memory_order_relaxed)) {
             // We successfully updated the futex.  Wake the thief threads
-            // waiting on this futex.
+            // waiting on this futex.  With tree-structured wakeup, the woken
+            // thieves wake the rest.
+            uint32_t fanout = g->options.wake_fanout;
+            if (fanout && fanout < to_wake)
+                to_wake = fanout;
             long s = futex(&g->disengaged_thieves_futex, FUTEX_WAKE_PRIVATE,
                            to_wake, NULL, NULL, 0);
             if (s == -1)
@@ -199,6 +352,7 @@ static inline void request_more_thieves(global_state *g, uint32_t count) {
         }
     }
 #else
+    (void)self;
     pthread_mutex_lock(&g->disengaged_lock);
     uint32_t disengaged_thieves_futex = atomic_load_explicit(
         &g->disengaged_thieves_futex, memory_order_acquire);
@@ -220,24 +374,38 @@ static inline void request_more_thieves(global_state *g, uint32_t count) {
 }
 
 #if USE_FUTEX
-static inline uint32_t thief_disengage_futex(_Atomic uint32_t *futexp) {
+// Take one token from the futex pointed to by `futexp`.  Returns the value of
+// the futex before the decrement, or 0 if there was no token to take.
+static inline uint32_t thief_take_token(_Atomic uint32_t *futexp) {
+    // The loop and compare-exchange are designed to handle cases where
+    // multiple threads waiting on the futex were woken up and where there may
+    // be spurious wakeups.
+    uint32_t val;
+    while ((val = atomic_load_explicit(futexp, memory_order_relaxed)) > 0) {
+        if (atomic_compare_exchange_weak_explicit(futexp, &val, val - 1,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+            return val;
+        }
+        busy_loop_pause();
+    }
+    return 0;
+}
+
+static inline uint32_t thief_disengage_futex(_Atomic uint32_t *futexp,
+                                             _Atomic uint32_t *sleepers) {
     // This step synchronizes with calls to request_more_thieves.
     while (true) {
-        // Decrement the futex when woken up.  The loop and compare-exchange are
-        // designed to handle cases where multiple threads waiting on the futex
-        // were woken up and where there may be spurious wakeups.
-        uint32_t val;
-        while ((val = atomic_load_explicit(futexp, memory_order_relaxed)) > 0) {
-            if (atomic_compare_exchange_weak_explicit(futexp, &val, val - 1,
-                                                      memory_order_release,
-                                                      memory_order_relaxed)) {
-                return val;
-            }
-            busy_loop_pause();
-        }
+        // Decrement the futex when woken up.
+        uint32_t val = thief_take_token(futexp);
+        if (val > 0)
+            return val;
 
-        // Wait on the futex.
+        // Wait on the futex.  Count this thief as a sleeper first, so that
+        // wake_thieves can skip the syscall when there are none.
+        atomic_fetch_add_explicit(sleepers, 1, memory_order_seq_cst);
         long s = futex(futexp, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+        atomic_fetch_sub_explicit(sleepers, 1, memory_order_relaxed);
         if (__builtin_expect(s == -1 && errno != EAGAIN, false))
             errExit("futex-FUTEX_WAIT");
     }
@@ -259,9 +427,34 @@ static inline uint32_t thief_disengage_cond_var(_Atomic uint32_t *count,
     }
 }
 #endif
+
+#if USE_FUTEX
+// Tree-structured wakeup.  With CILK_WAKE_FANOUT=k, a worker that posts
+// tokens on disengaged_thieves_futex wakes only k sleeping thieves, and each
+// thief woken from that futex wakes up to k more while tokens remain.  This
+// takes the wakeup of all workers off the critical path of the boss entering
+// a cilkified region.
+static inline void propagate_wakeup(global_state *g) {
+    uint32_t fanout = g->options.wake_fanout;
+    if (fanout == 0)
+        return;
+    uint32_t remaining = atomic_load_explicit(&g->disengaged_thieves_futex,
+                                              memory_order_relaxed);
+    if (remaining == 0)
+        return;
+    long s = futex(&g->disengaged_thieves_futex, FUTEX_WAKE_PRIVATE,
+                   remaining < fanout ? remaining : fanout, NULL, NULL, 0);
+    if (s == -1)
+        errExit("futex-FUTEX_WAKE");
+}
+#endif
+
 static inline uint32_t thief_disengage(global_state *g) {
 #if USE_FUTEX
-    return thief_disengage_futex(&g->disengaged_thieves_futex);
+    uint32_t val = thief_disengage_futex(&g->disengaged_thieves_futex,
+                                         &g->disengaged_sleepers);
+    propagate_wakeup(g);
+    return val;
 #else
     return thief_disengage_cond_var(&g->disengaged_thieves_futex,
                                     &g->disengaged_lock,
@@ -278,6 +471,8 @@ static inline void wake_all_disengaged(global_state *g) {
                    NULL, NULL, 0);
     if (s == -1)
         errExit("futex-FUTEX_WAKE");
+    if (g->wake_slots)
+        wake_all_slots(g);
 #else
     pthread_mutex_lock(&g->disengaged_lock);
     atomic_store_explicit(&g->disengaged_thieves_futex, INT_MAX,
@@ -305,18 +500,10 @@ static inline uint32_t thief_wait(global_state *g) {
 // work stealing.
 static inline bool thief_should_wait(global_state *g) {
     _Atomic uint32_t *futexp = &g->disengaged_thieves_futex;
-    uint32_t val = atomic_load_explicit(futexp, memory_order_relaxed);
 #if USE_FUTEX
-    while (val > 0) {
-        if (atomic_compare_exchange_weak_explicit(futexp, &val, val - 1,
-                                                  memory_order_release,
-                                                  memory_order_relaxed))
-            return false;
-        busy_loop_pause();
-        val = atomic_load_explicit(futexp, memory_order_relaxed);
-    }
-    return true;
+    return thief_take_token(futexp) == 0;
 #else
+    uint32_t val = atomic_load_explicit(futexp, memory_order_relaxed);
     if (val == 0)
         return true;
 
@@ -333,16 +520,76 @@ static inline bool thief_should_wait(global_state *g) {
 #endif
 }
 
+#if USE_FUTEX
+// Called by a thief thread that disengages inside the work-stealing loop, when
+// targeted wakeup is enabled.  Waits on the thief's wake slot until another
+// worker wakes it.
+static inline void thief_park(global_state *g, worker_id self) {
+    _Atomic uint32_t *slot = &g->wake_slots[self].state;
+    atomic_store_explicit(slot, WAKE_SLOT_PARKED, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // A region start, termination, or request on the shared futex may have
+    // been posted before the slot was marked parked.  Consume it as a thief
+    // waiting on the shared futex would.
+    bool consumed = !thief_should_wait(g);
+    if (consumed) {
+        uint32_t parked = WAKE_SLOT_PARKED;
+        if (atomic_compare_exchange_strong_explicit(
+                slot, &parked, WAKE_SLOT_IDLE, memory_order_acquire,
+                memory_order_relaxed))
+            return;
+    }
+
+    uint32_t val;
+    while ((val = atomic_load_explicit(slot, memory_order_acquire)) ==
+           WAKE_SLOT_PARKED) {
+        long s = futex(slot, FUTEX_WAIT_PRIVATE, WAKE_SLOT_PARKED, NULL, NULL,
+                       0);
+        if (__builtin_expect(s == -1 && errno != EAGAIN, false))
+            errExit("futex-FUTEX_WAIT");
+    }
+    atomic_store_explicit(slot, WAKE_SLOT_IDLE, memory_order_relaxed);
+    if (val == WAKE_SLOT_BROADCAST) {
+        // Account for this thief in disengaged_thieves_futex, like a thief
+        // woken from the shared futex.
+        if (!consumed)
+            (void)thief_should_wait(g);
+    } else if (consumed) {
+        // A request for more thieves woke this slot after this thief took a
+        // token from the shared futex.  Give the token back, so that the
+        // thief it was posted for still starts.
+        atomic_fetch_add_explicit(&g->disengaged_thieves_futex, 1,
+                                  memory_order_seq_cst);
+        if (atomic_load_explicit(&g->disengaged_sleepers,
+                                 memory_order_seq_cst)) {
+            long s = futex(&g->disengaged_thieves_futex, FUTEX_WAKE_PRIVATE, 1,
+                           NULL, NULL, 0);
+            if (s == -1)
+                errExit("futex-FUTEX_WAKE");
+        }
+    }
+}
+#endif // USE_FUTEX
+
 // Signal the thief threads to start work-stealing (or terminate, if
 // g->terminate == 1).
 static inline void wake_thieves(global_state *g) {
 #if USE_FUTEX
     atomic_store_explicit(&g->disengaged_thieves_futex, g->nworkers - 1,
-                          memory_order_release);
-    long s = futex(&g->disengaged_thieves_futex, FUTEX_WAKE_PRIVATE, INT_MAX,
-                   NULL, NULL, 0);
-    if (s == -1)
-        errExit("futex-FUTEX_WAKE");
+                          memory_order_seq_cst);
+    // Thieves spinning between regions see the store, so make the syscall
+    // only if some thief sleeps.  Pairs with thief_disengage_futex.
+    if (atomic_load_explicit(&g->disengaged_sleepers, memory_order_seq_cst)) {
+        // With tree-structured wakeup, wake only the first level of the tree.
+        uint32_t fanout = g->options.wake_fanout;
+        long s = futex(&g->disengaged_thieves_futex, FUTEX_WAKE_PRIVATE,
+                       fanout ? fanout : INT_MAX, NULL, NULL, 0);
+        if (s == -1)
+            errExit("futex-FUTEX_WAKE");
+    }
+    if (g->wake_slots)
+        wake_all_slots(g);
 #else
     pthread_mutex_lock(&g->disengaged_lock);
     atomic_store_explicit(&g->disengaged_thieves_futex, g->nworkers - 1,
@@ -352,4 +599,66 @@ static inline void wake_thieves(global_state *g) {
 #endif
 }
 
+//=========================================================
+// Spinning between cilkified regions.  With a nonzero tuning.idle_spin_nsec,
+// a thief that runs out of regions spins for the next one before sleeping,
+// for about twice the recent gap between regions, but not at all once the
+// gaps grow longer than idle_spin_nsec.  A region that starts while the
+// thieves spin then costs no syscalls.
+//=========================================================
+
+// Record the end of the last active region.  Called with g->roots_lock held.
+static inline void note_region_end(global_state *g) {
+    if (sched_tuning(g)->idle_spin_nsec)
+        atomic_store_explicit(&g->region_end_nsec, gettime_nsec(),
+                              memory_order_relaxed);
+}
+
+// Record the start of a region while no other region is active, and update
+// the average gap between regions.
+static inline void note_region_start(global_state *g) {
+    uint64_t end =
+        atomic_load_explicit(&g->region_end_nsec, memory_order_relaxed);
+    if (!sched_tuning(g)->idle_spin_nsec || !end)
+        return;
+    uint64_t gap = gettime_nsec() - end;
+    uint64_t avg =
+        atomic_load_explicit(&g->region_gap_nsec, memory_order_relaxed);
+    atomic_store_explicit(&g->region_gap_nsec, avg ? (7 * avg + gap) / 8 : gap,
+                          memory_order_relaxed);
+}
+
+// Spin while waiting for the next region.  Returns true if a region started
+// and this thief took one of the tokens that wake_thieves posted for it, or
+// false if the thief should sleep.  A thief that returned without taking its
+// token would leave it behind, and every later attempt to disengage in the
+// region would take that token and return at once.
+static inline bool thief_idle_spin(global_state *g) {
+    const uint64_t max = sched_tuning(g)->idle_spin_nsec;
+    if (!max)
+        return false;
+    uint64_t gap =
+        atomic_load_explicit(&g->region_gap_nsec, memory_order_relaxed);
+    if (gap > max)
+        return false;
+    uint64_t budget = gap && 2 * gap < max ? 2 * gap : max;
+
+    uint64_t start = gettime_nsec();
+    do {
+        for (unsigned int i = 0; i < IDLE_SPIN_CHECK; ++i) {
+#if USE_FUTEX
+            if (thief_take_token(&g->disengaged_thieves_futex))
+                return true;
+#else
+            if (atomic_load_explicit(&g->disengaged_thieves_futex,
+                                     memory_order_relaxed) &&
+                !thief_should_wait(g))
+                return true;
+#endif
+            busy_pause();
+        }
+    } while (gettime_nsec() - start < budget);
+    return false;
+}
+
 #endif /* _WORKER_COORD_H */
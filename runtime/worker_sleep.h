@@ -7,6 +7,7 @@
 #include <time.h>
 
 #include "cilk-internal.h"
+#include "cpu_limits.h"
 #include "global.h"
 #include "rts-config.h"
 #include "sched_stats.h"
@@ -20,17 +21,6 @@
 #include <mach/mach_time.h>
 #endif // APPLE_ARM64
 
-// Nanoseconds that a sentinel worker should sleep if it reaches the disengage
-// threshold but does not disengage.
-/* #define NAP_NSEC 12500 */
-#define NAP_NSEC 25000
-/* #define NAP_NSEC 50000 */
-/* #define SLEEP_NSEC 4 * NAP_NSEC */
-#define SLEEP_NSEC NAP_NSEC
-
-// Ratio of active workers over sentinels that the system aims to maintain.
-#define AS_RATIO 2
-
 // Threshold for number of consective failed steal attempts to declare a
 // thief as sentinel.  Must be a power of 2.
 #define SENTINEL_THRESHOLD 128
@@ -45,14 +35,11 @@ typedef uint32_t history_t;
 #define HISTORY_LENGTH 32
 #define SENTINEL_COUNT_HISTORY 4
 
-// Amount of history that must be efficient/inefficient to reengage/disengage
-// workers.
-#define HISTORY_THRESHOLD (3 * HISTORY_LENGTH / 4)
-/* #define HISTORY_THRESHOLD (1 * HISTORY_LENGTH / 2) */
-
-// Threshold for number of consecutive failed steal attempts to try disengaging
-// this worker.  Must be a multiple of SENTINEL_THRESHOLD and a power of 2.
-#define DISENGAGE_THRESHOLD HISTORY_THRESHOLD * SENTINEL_THRESHOLD
+// The nap and sleep times, the active-to-sentinel ratio, and the amount of
+// history needed to reengage or disengage workers are taken from
+// sched_tuning(rts).
+// The threshold for the number of consecutive failed steal attempts to try
+// disengaging a worker is the history threshold times SENTINEL_THRESHOLD.
 
 static inline __attribute__((always_inline)) uint64_t gettime_fast(void) {
     // __builtin_readcyclecounter triggers "illegal instruction" errors on ARM64
@@ -154,7 +141,12 @@ static bool try_to_disengage_thief(global_state *g, worker_id self,
         cilk_mutex_unlock(&g->index_lock);
 
         // Disengage this thread.
-        thief_disengage(g);
+#if USE_FUTEX
+        if (g->wake_slots)
+            thief_park(g, self);
+        else
+#endif
+            thief_disengage(g);
 
         // The thread is now reengaged.  Grab the lock on the index structure.
         cilk_mutex_lock(&g->index_lock);
@@ -200,19 +192,51 @@ get_worker_counts(uint64_t disengaged_sentinel, unsigned int nworkers) {
 // Check if the given worker counts are inefficient, i.e., if active <
 // sentinels.
 __attribute__((const, always_inline)) static inline history_t
-is_inefficient(worker_counts counts) {
+is_inefficient(worker_counts counts, int32_t as_ratio) {
     return counts.sentinels > 1 && counts.active >= 1 &&
-           counts.active * AS_RATIO < counts.sentinels * 1;
+           counts.active * as_ratio < counts.sentinels * 1;
 }
 
 // Check if the given worker counts are efficient, i.e., if active >= 2 *
 // sentinels.
 __attribute__((const, always_inline)) static inline history_t
-is_efficient(worker_counts counts) {
-    return (counts.active * 1 >= counts.sentinels * AS_RATIO) ||
+is_efficient(worker_counts counts, int32_t as_ratio) {
+    return (counts.active * 1 >= counts.sentinels * as_ratio) ||
            (counts.sentinels <= 1);
 }
 
+// Check if worker w last ran on a slow core of a hybrid machine.
+__attribute__((always_inline)) static inline bool
+worker_on_slow_core(global_state *const rts, worker_id w) {
+    return atomic_load_explicit(&rts->slow_workers[w / 64],
+                                memory_order_relaxed) >>
+               (w % 64) &
+           1;
+}
+
+// Ratio of active workers to sentinels that this sentinel passes to
+// is_inefficient when it decides whether to disengage.  On a hybrid machine,
+// sentinels on fast cores tolerate a larger surplus of sentinels, so that
+// sentinels on slow cores disengage first and the fast cores stay ready to
+// take new work.
+__attribute__((always_inline)) static inline int32_t
+disengage_ratio(global_state *const rts, worker_id self) {
+    int32_t as_ratio = sched_tuning(rts)->as_ratio;
+    if (rts->slow_workers && !worker_on_slow_core(rts, self))
+        as_ratio *= HYBRID_FAST_STAY;
+    return as_ratio;
+}
+
+// Check if more workers are engaged than the cap that adapts to CPU throttling
+// and load (CILK_ADAPT_NWORKERS).
+__attribute__((always_inline)) static inline bool
+is_over_engaged_cap(global_state *const rts, worker_counts counts) {
+    return rts->cpu_limits &&
+           counts.active + counts.sentinels >
+               (int32_t)atomic_load_explicit(&rts->engaged_cap,
+                                             memory_order_relaxed);
+}
+
 // Convert the elapsed time spent working into a fail count.
 __attribute__((const, always_inline)) static inline unsigned int
 get_scaled_elapsed(unsigned int elapsed) {
@@ -243,6 +267,7 @@ maybe_reengage_workers(global_state *const rts, worker_id self,
     (void)w; // unused if scheduling stats not enabled
 
     if (fails >= SENTINEL_THRESHOLD) {
+        const struct sched_tuning *tuning = sched_tuning(rts);
         // This thief is no longer a sentinel.  Decrement the number of
         // sentinels.
         uint64_t disengaged_sentinel = add_to_sentinels(rts, -1);
@@ -256,12 +281,13 @@ maybe_reengage_workers(global_state *const rts, worker_id self,
         unsigned int my_sentinel_count = *recent_sentinel_count;
         if (fails >= *sample_threshold) {
             // Update the inefficient history.
-            history_t curr_ineff = is_inefficient(counts);
+            history_t curr_ineff =
+                is_inefficient(counts, tuning->as_ratio);
             my_inefficient_history = (my_inefficient_history >> 1) |
                                      (curr_ineff << (HISTORY_LENGTH - 1));
 
             // Update the efficient history.
-            history_t curr_eff = is_efficient(counts);
+            history_t curr_eff = is_efficient(counts, tuning->as_ratio);
             my_efficient_history = (my_efficient_history >> 1) |
                                    (curr_eff << (HISTORY_LENGTH - 1));
 
@@ -289,7 +315,7 @@ maybe_reengage_workers(global_state *const rts, worker_id self,
         int32_t eff_steps = __builtin_popcount(my_efficient_history);
         int32_t ineff_steps = __builtin_popcount(my_inefficient_history);
         int32_t eff_diff = eff_steps - ineff_steps;
-        if (eff_diff < HISTORY_THRESHOLD) {
+        if (eff_diff < (int32_t)tuning->history_threshold) {
             request = 0;
             *efficient_history = my_efficient_history;
             *inefficient_history = my_inefficient_history;
@@ -319,8 +345,20 @@ maybe_reengage_workers(global_state *const rts, worker_id self,
             }
         }
 
+        // Don't engage more workers than the CPUs can currently run.
+        if (request > 0 && rts->cpu_limits) {
+            int32_t room =
+                (int32_t)atomic_load_explicit(&rts->engaged_cap,
+                                              memory_order_relaxed) -
+                (counts.active + counts.sentinels) -
+                (int32_t)atomic_load_explicit(&rts->disengaged_thieves_futex,
+                                              memory_order_relaxed);
+            if (request > room)
+                request = room;
+        }
+
         if (request > 0) {
-            request_more_thieves(rts, request);
+            request_more_thieves(rts, self, request);
         }
 
         // Set a cap on the fail count.
@@ -351,8 +389,15 @@ static bool maybe_disengage_thief(global_state *g, worker_id self,
 
         worker_counts counts = get_worker_counts(disengaged_sentinel, nworkers);
 
+        // Stay engaged while a guest region waits for a worker to start it.
+        if (atomic_load_explicit(&g->pending_roots, memory_order_relaxed))
+            break;
+
         // Make sure that we don't inadvertently disengage the last sentinel.
-        if (is_inefficient(counts)) {
+        // The engaged cap is at least 1, so exceeding it leaves another
+        // worker engaged.
+        if (is_inefficient(counts, disengage_ratio(g, self)) ||
+            is_over_engaged_cap(g, counts)) {
             // Too many sentinels.  Try to disengage this worker.  If it fails,
             // repeat the loop.
             if (try_to_disengage_thief(g, self, disengaged_sentinel)) {
@@ -389,9 +434,15 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
     // for an extended amount of time.  Must be at least SENTINEL_THRESHOLD and
     // a power of 2.
     const unsigned int SLEEP_THRESHOLD = NAP_THRESHOLD;
+    const struct sched_tuning *tuning = sched_tuning(rts);
+    const unsigned int history_threshold = tuning->history_threshold;
+    const unsigned int DISENGAGE_THRESHOLD =
+        history_threshold * SENTINEL_THRESHOLD;
     const unsigned int MAX_FAILS =
         2 * ((SLEEP_THRESHOLD > DISENGAGE_THRESHOLD) ? SLEEP_THRESHOLD
                                                      : DISENGAGE_THRESHOLD);
+    const long nap_nsec = tuning->nap_nsec;
+    const long sleep_nsec = tuning->sleep_nsec;
 
     CILK_START_TIMING(w, INTERVAL_SLEEP);
     fails += ATTEMPTS;
@@ -404,7 +455,7 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
             // Prevent the fail count from exceeding this maximum, so we don't
             // have to worry about the fail count overflowing.
             fails = MAX_FAILS;
-            const struct timespec sleeptime = {.tv_sec = 0, .tv_nsec = SLEEP_NSEC};
+            const struct timespec sleeptime = {.tv_sec = 0, .tv_nsec = sleep_nsec};
             nanosleep(&sleeptime, NULL);
         } else {
 #if ENABLE_THIEF_SLEEP
@@ -428,7 +479,7 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
             *sentinel_count_history_tail = (tail + 1) % SENTINEL_COUNT_HISTORY;
 
             // Update the efficient history.
-            history_t curr_eff = is_efficient(counts);
+            history_t curr_eff = is_efficient(counts, tuning->as_ratio);
             history_t my_efficient_history = *efficient_history;
             my_efficient_history = (my_efficient_history >> 1) |
                                    (curr_eff << (HISTORY_LENGTH - 1));
@@ -436,7 +487,8 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
             *efficient_history = my_efficient_history;
 
             // Update the inefficient history.
-            history_t curr_ineff = is_inefficient(counts);
+            history_t curr_ineff =
+                is_inefficient(counts, tuning->as_ratio);
             history_t my_inefficient_history = *inefficient_history;
             my_inefficient_history = (my_inefficient_history >> 1) |
                                      (curr_ineff << (HISTORY_LENGTH - 1));
@@ -444,6 +496,14 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
                 __builtin_popcount(my_inefficient_history);
             *inefficient_history = my_inefficient_history;
 
+            // Adapt the cap on engaged workers to CPU throttling and load, and
+            // check if this worker should disengage to respect it.
+            bool over_cap = false;
+            if (rts->cpu_limits) {
+                cpu_limits_sample(rts, counts.active + counts.sentinels);
+                over_cap = is_over_engaged_cap(rts, counts);
+            }
+
 #endif
             if (is_boss) {
                 if (fails % NAP_THRESHOLD == 0) {
@@ -451,14 +511,16 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
                     const struct timespec sleeptime = {
                         .tv_sec = 0,
                         .tv_nsec =
-                            (fails > SLEEP_THRESHOLD) ? SLEEP_NSEC : NAP_NSEC};
+                            (fails > SLEEP_THRESHOLD) ? sleep_nsec : nap_nsec};
                     nanosleep(&sleeptime, NULL);
                 }
             } else {
 #if ENABLE_THIEF_SLEEP
 
-                if (ENABLE_THIEF_SLEEP && curr_ineff &&
-                    (ineff_steps - eff_steps) > HISTORY_THRESHOLD) {
+                if (ENABLE_THIEF_SLEEP &&
+                    ((curr_ineff &&
+                      (ineff_steps - eff_steps) > (int32_t)history_threshold) ||
+                     over_cap)) {
                     uint64_t start, end;
                     start = gettime_fast();
                     if (maybe_disengage_thief(rts, self, nworkers)) {
@@ -514,8 +576,8 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
                         // approximately 50 us.
                         const struct timespec sleeptime = {
                             .tv_sec = 0,
-                            .tv_nsec = (fails > SLEEP_THRESHOLD) ? SLEEP_NSEC
-                                                                 : NAP_NSEC};
+                            .tv_nsec = (fails > SLEEP_THRESHOLD) ? sleep_nsec
+                                                                 : nap_nsec};
                         nanosleep(&sleeptime, NULL);
                     }
 #else
@@ -530,7 +592,7 @@ handle_failed_steal_attempts(global_state *const rts, worker_id self,
                     const struct timespec sleeptime = {
                         .tv_sec = 0,
                         .tv_nsec =
-                            (fails > SLEEP_THRESHOLD) ? SLEEP_NSEC : NAP_NSEC};
+                            (fails > SLEEP_THRESHOLD) ? sleep_nsec : nap_nsec};
                     nanosleep(&sleeptime, NULL);
                 }
             }